@@ -13,6 +13,7 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
     ProInfo *proinfo = (ProInfo*)malloc(sizeof(ProInfo));
     proinfo->number_of_images = args.number_of_images;
     proinfo->pyramid_level = args.pyramid_level;
+    proinfo->check_box_NCC = args.check_box_NCC;
     if(args.GCP_spacing > 0)
         proinfo->GCP_spacing = args.GCP_spacing;
     else
@@ -254,7 +255,14 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
             printf("\nbefor preprocessing %f\n\n",total_gap);
             total_ST = time(0);
             
-            Preprocessing_Coreg(proinfo,proinfo->tmpdir,OriImages,Subsetfilename,py_level,OriImagesizes,data_size_lr);
+            //keep the pyramid resident when it fits in memory, otherwise spill the levels to tmpdir
+            uint16 ***PyImages = NULL;
+            const double pyramid_memory = CalMemorySize_Pyramid_Coreg(proinfo,py_level,data_size_lr);
+            printf("Pyramid memory : System %f\t required %f\n",args.System_memory,pyramid_memory);
+            if(pyramid_memory < args.System_memory - 2)
+                PyImages = SetPyramidImages_Coreg(proinfo,OriImages,py_level,data_size_lr);
+            else
+                Preprocessing_Coreg(proinfo,proinfo->tmpdir,OriImages,Subsetfilename,py_level,OriImagesizes,data_size_lr);
             
             total_ET = time(0);
             total_gap = difftime(total_ET,total_ST);
@@ -268,8 +276,19 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
             TransParam param;
             SetTranParam_fromGeoTiff(&param,proinfo->Imagefilename[0]);
             int reference_id = 0;
+            
+            //targets share the reference pyramid and may run concurrently (-coreg_batch). each one keeps its own timers
+            //and file names, and its result line is written in image order after all targets are done
+            char **result_lines = (char**)calloc(sizeof(char*),proinfo->number_of_images);
+            
+#pragma omp parallel for schedule(dynamic,1) num_threads(args.coreg_batch_threads) if(args.coreg_batch_threads > 1)
             for(int ti = 1 ; ti < proinfo->number_of_images ; ti ++)
             {
+                time_t total_ST = time(0), total_ET = 0;
+                double total_gap;
+                char out_file[500];
+                result_lines[ti] = (char*)malloc(sizeof(char)*1000);
+                
                 double avg_roh = 0;
                 vector<D2DPOINT> matched_MPs;
                 vector<D2DPOINT> matched_MPs_ref;
@@ -278,8 +297,18 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
                     printf("Processing level %d\n",level);
                     printf("level\tImage ID\trow(pixel)\tcolumn(pixel)\tTy(meter)\tTx(meter)\tGCPS #\tavg_roh\t# of iteration\n");
                     
-                    uint16 *SubImages_ref = LoadPyramidImages(proinfo->tmpdir,Subsetfilename[reference_id],data_size_lr[reference_id][level],level);
-                    uint16 *SubImages_tar = LoadPyramidImages(proinfo->tmpdir,Subsetfilename[ti],data_size_lr[ti][level],level);
+                    uint16 *SubImages_ref = NULL;
+                    uint16 *SubImages_tar = NULL;
+                    if(PyImages)
+                    {
+                        SubImages_ref = PyImages[reference_id][level];
+                        SubImages_tar = PyImages[ti][level];
+                    }
+                    else
+                    {
+                        SubImages_ref = LoadPyramidImages(proinfo->tmpdir,Subsetfilename[reference_id],data_size_lr[reference_id][level],level);
+                        SubImages_tar = LoadPyramidImages(proinfo->tmpdir,Subsetfilename[ti],data_size_lr[ti][level],level);
+                    }
                     
                     int iter_counts;
                     D2DPOINT grid_dxy_ref(ortho_dx[reference_id], ortho_dy[reference_id]);
@@ -316,8 +345,11 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
                      
                     printf("%d\t%d\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t%4.2f\t%d\n",level,ti,ImageAdjust_coreg[ti][0], ImageAdjust_coreg[ti][1],
                            -ImageAdjust_coreg[ti][0]*ortho_dy[ti], ImageAdjust_coreg[ti][1]*ortho_dx[ti],matched_MPs.size(),avg_roh,iter_counts);
-                    free(SubImages_ref);
-                    free(SubImages_tar);
+                    if(!PyImages)
+                    {
+                        free(SubImages_ref);
+                        free(SubImages_tar);
+                    }
                     
                     total_ET = time(0);
                     total_gap = difftime(total_ET,total_ST);
@@ -331,7 +363,7 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
                 total_ST = time(0);
                 
                 
-                fprintf(fid_out,"%s\t%4.2f\t%4.2f\t%4.2f\t%4.2f\t%3.2f\n",proinfo->Imagefilename[ti],ImageAdjust_coreg[ti][0], ImageAdjust_coreg[ti][1], -ImageAdjust_coreg[ti][0]*ortho_dy[ti], ImageAdjust_coreg[ti][1]*ortho_dx[ti],avg_roh);
+                snprintf(result_lines[ti],1000,"%s\t%4.2f\t%4.2f\t%4.2f\t%4.2f\t%3.2f\n",proinfo->Imagefilename[ti],ImageAdjust_coreg[ti][0], ImageAdjust_coreg[ti][1], -ImageAdjust_coreg[ti][0]*ortho_dy[ti], ImageAdjust_coreg[ti][1]*ortho_dx[ti],avg_roh);
                 
                 
                 FILE* p_GCP = NULL;
@@ -383,11 +415,22 @@ double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO
                 
                 matched_MPs_ref.clear();
                 matched_MPs.clear();
-                free(OriImages[ti]);
+                if(!PyImages)
+                    free(OriImages[ti]);
+            }
+            
+            for(int ti = 1 ; ti < proinfo->number_of_images ; ti ++)
+            {
+                fprintf(fid_out,"%s",result_lines[ti]);
+                free(result_lines[ti]);
                 free(ImageBoundary[ti]);
             }
+            free(result_lines);
             fclose(fid_out);
-            RemoveFiles(proinfo,proinfo->tmpdir,Subsetfilename,py_level,0);
+            if(PyImages)
+                FreePyramidImages_Coreg(proinfo,PyImages,py_level);
+            else
+                RemoveFiles(proinfo,proinfo->tmpdir,Subsetfilename,py_level,0);
             
             total_ET = time(0);
             total_gap = difftime(total_ET,total_ST);
@@ -470,12 +513,53 @@ void Preprocessing_Coreg(ProInfo *proinfo, char *save_path,uint16 **Oriimage, ch
     }
 }
 
+double CalMemorySize_Pyramid_Coreg(const ProInfo *proinfo, const uint8 py_level, CSize **data_size_lr)
+{
+    long int Memory = 0;
+    for(int ti = 0 ; ti < proinfo->number_of_images ; ti++)
+    {
+        //level 0 is the original image, which is already loaded
+        for(int level = 1 ; level <= py_level ; level++)
+            Memory += (long)(sizeof(uint16)*(long)data_size_lr[ti][level].width*(long)data_size_lr[ti][level].height);
+    }
+    
+    return (double)(Memory/1024.0/1024.0/1024.0);
+}
+
+uint16*** SetPyramidImages_Coreg(const ProInfo *proinfo, uint16 **Oriimage, const uint8 py_level, CSize **data_size_lr)
+{
+    printf("start Preprocessing in memory\n");
+    uint16 ***PyImages = (uint16***)malloc(sizeof(uint16**)*proinfo->number_of_images);
+    for(int count = 0; count<proinfo->number_of_images ; count++)
+    {
+        PyImages[count] = (uint16**)malloc(sizeof(uint16*)*(py_level+1));
+        PyImages[count][0] = Oriimage[count];
+        for(int i=0;i<py_level;i++)
+            PyImages[count][i+1] = CreateImagePyramid(PyImages[count][i],data_size_lr[count][i],9,(double)(1.5));
+    }
+    
+    return PyImages;
+}
+
+void FreePyramidImages_Coreg(const ProInfo *proinfo, uint16 ***PyImages, const uint8 py_level)
+{
+    //level 0 points at OriImages, which are released here as well
+    for(int count = 0; count<proinfo->number_of_images ; count++)
+    {
+        for(int i=0;i<=py_level;i++)
+            free(PyImages[count][i]);
+        free(PyImages[count]);
+    }
+    free(PyImages);
+}
+
 void DEM_ImageCoregistration_hillshade(TransParam *return_param, char* _filename, ARGINFO args, char *_save_filepath, int gcp_opt)
 {
     ProInfo *proinfo = (ProInfo*)malloc(sizeof(ProInfo));
     
     proinfo->number_of_images = args.number_of_images;
     proinfo->pyramid_level = args.pyramid_level;
+    proinfo->check_box_NCC = args.check_box_NCC;
     sprintf(proinfo->save_filepath,"%s",args.Outputpath);
     if(args.GCP_spacing > 0)
         proinfo->GCP_spacing = args.GCP_spacing;
@@ -1297,6 +1381,7 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
     
     proinfo->number_of_images = args.number_of_images;
     proinfo->pyramid_level = args.pyramid_level;
+    proinfo->check_box_NCC = args.check_box_NCC;
     sprintf(proinfo->save_filepath,"%s",args.Outputpath);
     if(args.GCP_spacing > 0)
         proinfo->GCP_spacing = args.GCP_spacing;
@@ -1376,11 +1461,20 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
             fprintf(fid_out,"ref DEM name\t%s\n",DEM_name_refoutfile);
             fprintf(fid_out,"DEM name\t\t\t\t\t\t\tDist_std[meter]\tTx[meter]\tTy[meter]\tTz[meter]\tTx_std[meter]\tTy_std[meter]\tTz_std[meter]\tdH_cp(mean)\tdH_cp_std(mean)\tdH_cp(med.)\tdH_cp_std(med.)\tdh_mean\t\tdh_med.\t\tdh_std\t\tNumberOfCPs\tprocessing time\n");
         
+            //targets may run concurrently, so each one keeps its own timers and read window,
+            //and its result line is written in list order after all targets are done
+            char **result_lines = (char**)calloc(sizeof(char*),proinfo->number_of_images);
+            
+#pragma omp parallel for schedule(dynamic,1) num_threads(args.coreg_batch_threads) if(args.coreg_batch_threads > 1)
             for(int ti = 1; ti < proinfo->number_of_images ; ti++)
             {
                 time_t total_ST_iter = 0, total_ET_iter = 0;
                 total_ST_iter = time(0);
                 
+                time_t total_ST = time(0), total_ET = 0;
+                double total_gap;
+                result_lines[ti] = (char*)malloc(sizeof(char)*1000);
+                
                 char tar_dem_name[500];
                 sprintf(tar_dem_name,"%s",args.Image[ti]);
                 printf("dem name = %s\n",tar_dem_name);
@@ -1390,11 +1484,8 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                 
                 double ImageBoundary_tar[4] = {tar_minX, tar_maxY - tar_dy*tar_dem_size.height, tar_minX + tar_dx*tar_dem_size.width, tar_maxY};
             
-                cols[0] = 0;
-                cols[1] = tar_dem_size.width;
-                
-                rows[0] = 0;
-                rows[1] = tar_dem_size.height;
+                long cols[2] = {0, tar_dem_size.width};
+                long rows[2] = {0, tar_dem_size.height};
                 
                 //dem image
                 float type(0);
@@ -1567,6 +1658,9 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                     double min_Y = Boundary[1];
                     double max_Y = Boundary[3];
                     
+                    vector<RefSurfacePoint> ref_surface;
+                    SetRefSurfacePoints(DEM, select_pts_tar, coord_center, coord_scale, ImageBoundary_ref, ref_dem_size, level_ref_dx, ref_surface);
+                    
                     int max_W_update = 4;
                     while(!check_stop && while_iter < 50)
                     {
@@ -1606,14 +1700,11 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                                         D3DPOINT normalized_pt = Normalize_coord(select_pts_tar[index],coord_center,coord_scale);
                                         D3DPOINT transformed_coord_pt = ConformalTransform(normalized_pt,conparam);
                                         
-                                        D3DPOINT ref_normal_ori;
-                                        double ref_iter_height;
-                                        double* ref_array = (double*)calloc(sizeof(double),9);
-                                        D3DPOINT ref_normal = FindNormal(&ref_normal_ori,DEM, normalized_pt,coord_center,coord_scale, ImageBoundary_ref, conparam, ref_dem_size, level_ref_dx, ref_array, &ref_iter_height, 0);
+                                        const RefSurfacePoint &ref_surface_pt = ref_surface[index];
                                         
-                                        if(ref_normal.m_X > -999)
+                                        if(ref_surface_pt.check_valid)
                                         {
-                                            double* tar_array = (double*)calloc(sizeof(double),9);
+                                            double tar_array[9];
                                             double tar_iter_height;
                                             
                                             D3DPOINT tar_normal_ori;
@@ -1621,11 +1712,12 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                                             
                                             if(tar_normal.m_X > -999)
                                             {
-                                                double ref_slope, ref_aspect, tar_slope, tar_aspect;
-                                                SlopeAspect(ref_normal,coord_scale,&ref_slope,&ref_aspect);
+                                                const double ref_slope = ref_surface_pt.slope;
+                                                const double ref_aspect = ref_surface_pt.aspect;
+                                                double tar_slope, tar_aspect;
                                                 SlopeAspect(tar_normal,coord_scale,&tar_slope,&tar_aspect);
                                                 
-                                                double ncc = Correlate(ref_array,tar_array,9);
+                                                double ncc = Correlate(ref_surface_pt.roh_array,tar_array,9);
                                                 if (ncc != -99)
                                                     ncc = (ncc + 1)/2.0;
                                                 else
@@ -1659,7 +1751,7 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                                                     D3DPOINT t_coord = normalized_pt;
                                                     t_coord.m_Z = tar_iter_height;
                                                     
-                                                    D3DPOINT ref_pts = SurfaceDistance_ori(tar_normal_ori,DEM,tar_normal, t_coord, ImageBoundary_ref,ref_dem_size, level_ref_dx, conparam, coord_center,coord_scale, ref_iter_height);
+                                                    D3DPOINT ref_pts = SurfaceDistance_ori(tar_normal_ori,DEM,tar_normal, t_coord, ImageBoundary_ref,ref_dem_size, level_ref_dx, conparam, coord_center,coord_scale, ref_surface_pt.height);
                                                     
                                                     double D = -(tar_normal.m_X*t_coord.m_X + tar_normal.m_Y*t_coord.m_Y + tar_normal.m_Z*t_coord.m_Z);
                                                     double diff_distance = -(tar_normal.m_X*ref_pts.m_X + tar_normal.m_Y*ref_pts.m_Y + tar_normal.m_Z*ref_pts.m_Z + D);
@@ -2017,21 +2109,21 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                         if(sigma0*coord_scale.m_Z < 2 && vertical_average_distance < 1.0 && SD_distance_vertical < 5.0 && final_number_of_selected > 100 && sigmaX[4]*sigma0*coord_scale.m_X*(sqrt(distance_scale/coord_scale.m_X)) < tar_dx/2.0 && sigmaX[5]*sigma0*coord_scale.m_Y*(sqrt(distance_scale/coord_scale.m_Y)) < tar_dx/2.0)
                         {
                             
-                               fprintf(fid_out,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X*(sqrt(distance_scale/coord_scale.m_X)),sigmaX[5]*sigma0*coord_scale.m_Y*(sqrt(distance_scale/coord_scale.m_Y)),sigmaX[6]*sigma0*coord_scale.m_Z*(sqrt(distance_scale/coord_scale.m_Z)),vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
+                               snprintf(result_lines[ti],1000,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X*(sqrt(distance_scale/coord_scale.m_X)),sigmaX[5]*sigma0*coord_scale.m_Y*(sqrt(distance_scale/coord_scale.m_Y)),sigmaX[6]*sigma0*coord_scale.m_Z*(sqrt(distance_scale/coord_scale.m_Z)),vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
                             
-                           /* fprintf(fid_out,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*distance_scale,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X,sigmaX[5]*sigma0*coord_scale.m_Y,sigmaX[6]*sigma0*coord_scale.m_Z,vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
+                           /* snprintf(result_lines[ti],1000,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*distance_scale,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X,sigmaX[5]*sigma0*coord_scale.m_Y,sigmaX[6]*sigma0*coord_scale.m_Z,vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
                             
-                            fprintf(fid_out,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4],sigmaX[5],sigmaX[6],vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
+                            snprintf(result_lines[ti],1000,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4],sigmaX[5],sigmaX[6],vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
                             */
                         }
                         else
                         {
-                            fprintf(fid_out,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X*(sqrt(distance_scale/coord_scale.m_X)),sigmaX[5]*sigma0*coord_scale.m_Y*(sqrt(distance_scale/coord_scale.m_Y)),sigmaX[6]*sigma0*coord_scale.m_Z*(sqrt(distance_scale/coord_scale.m_Z)),vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
+                            snprintf(result_lines[ti],1000,"%s\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%4.2f\t\t%d\t\t%4.2f\n",DEM_name_outfile,sigma0*coord_scale.m_Z,conparam.Tx*coord_scale.m_X,conparam.Ty*coord_scale.m_Y,conparam.Tz*coord_scale.m_Z,sigmaX[4]*sigma0*coord_scale.m_X*(sqrt(distance_scale/coord_scale.m_X)),sigmaX[5]*sigma0*coord_scale.m_Y*(sqrt(distance_scale/coord_scale.m_Y)),sigmaX[6]*sigma0*coord_scale.m_Z*(sqrt(distance_scale/coord_scale.m_Z)),vertical_average_distance,SD_distance_vertical, MED_distance,SD_z_med,all_average,all_med,all_std,final_number_of_selected,total_gap_iter);
                         }
                     }
                     else
                     {
-                        fprintf(fid_out,"%s\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\t%d\t\tNaN\n",DEM_name_outfile,final_number_of_selected);
+                        snprintf(result_lines[ti],1000,"%s\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\t%d\t\tNaN\n",DEM_name_outfile,final_number_of_selected);
                     }
                     free(dX);
                     free(sigmaX);
@@ -2042,12 +2134,19 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
                 }
                 else
                 {
-                    fprintf(fid_out,"%s\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\t%d\t\tNaN\n",DEM_name_outfile,tin_point_num);
+                    snprintf(result_lines[ti],1000,"%s\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\tNaN\t\t%d\t\tNaN\n",DEM_name_outfile,tin_point_num);
                 }
                 free(DEM_tar);
                 free(data_size_tar);
                 select_pts_tar.clear();
             }
+            
+            for(int ti = 1; ti < proinfo->number_of_images ; ti++)
+            {
+                fprintf(fid_out,"%s",result_lines[ti]);
+                free(result_lines[ti]);
+            }
+            free(result_lines);
             fclose(fid_out);
              
             free(DEM);
@@ -2376,6 +2475,34 @@ D3DPOINT SurfaceDistance_ori(const D3DPOINT tar_normal_ori, const float* ref_dem
     return ref_pts;
 }
 
+//FindNormal, slope and aspect of the reference DEM at every control point, computed once per target
+void SetRefSurfacePoints(const float* DEM_ref, const vector<D3DPOINT> &select_pts, const D3DPOINT coord_center, const D3DPOINT coord_scale, const double *boundary_ref, const CSize ref_dem_size, const double grid_size, vector<RefSurfacePoint> &ref_surface)
+{
+    Conformalparam conparam;
+    conparam.scale = 1.0;
+    conparam.omega = 0.0;
+    conparam.phi = 0.0;
+    conparam.kappa = 0.0;
+    conparam.Tx = 0.0;
+    conparam.Ty = 0.0;
+    conparam.Tz = 0.0;
+    
+    ref_surface.resize(select_pts.size());
+    
+#pragma omp parallel for schedule(guided)
+    for(long index = 0 ; index < select_pts.size() ; index++)
+    {
+        RefSurfacePoint &ref_pt = ref_surface[index];
+        
+        const D3DPOINT normalized_pt = Normalize_coord(select_pts[index],coord_center,coord_scale);
+        ref_pt.normal = FindNormal(&ref_pt.normal_ori, DEM_ref, normalized_pt, coord_center, coord_scale, boundary_ref, conparam, ref_dem_size, grid_size, ref_pt.roh_array, &ref_pt.height, 0);
+        ref_pt.check_valid = ref_pt.normal.m_X > -999;
+        
+        if(ref_pt.check_valid)
+            SlopeAspect(ref_pt.normal, coord_scale, &ref_pt.slope, &ref_pt.aspect);
+    }
+}
+
 void SlopeAspect(D3DPOINT normal, const D3DPOINT scale, double *slope, double *aspect)
 {
     normal.m_X = normal.m_X/(scale.m_X);
@@ -2592,175 +2719,200 @@ void SettingControls(const ProInfo *proinfo, const float* DEM_ref, const float*
     printf("SettingControls %d\n",tin_point_num);
 }
 
+//observation row of the 2.5D conformal adjustment: target normal times the partials of the transformed point.
+//trig holds sin/cos of omega, phi and kappa
+static inline void ConformalRow_25D(const RM &R, const double S, const double *trig, const D3DPOINT &P, const D3DPOINT &normal, double *row)
+{
+    const double P1 = P.m_X;
+    const double P2 = P.m_Y;
+    const double P3 = P.m_Z;
+    
+    const double sA1 = trig[0], cA1 = trig[1];
+    const double sA2 = trig[2], cA2 = trig[3];
+    const double sA3 = trig[4], cA3 = trig[5];
+    
+    const double Gx = normal.m_X;
+    const double Gy = normal.m_Y;
+    const double Gz = -normal.m_Z;
+    
+    //X equation
+    const double C0 = R.m11*P1 + R.m21*P2 + R.m31*P3; //d_scale
+    const double C2 = ( -sA2*cA3*P1 + sA2*sA3*P2 + cA2*P3 )*S; //d_phi
+    const double C3 = ( R.m21*P1 - R.m11*P2 )*S; //d_kappa
+    
+    //Y equation
+    const double C7 = R.m12*P1 + R.m22*P2 + R.m32*P3;
+    const double C8 = (-R.m13*P1 - R.m23*P2 - R.m33*P3)*S;
+    const double C9 = ( sA1*cA2*cA3*P1 - sA1*cA2*sA3*P2 + sA1*sA2*P3 )*S;
+    const double C10 = ( R.m22*P1 - R.m12*P2 )*S;
+    
+    //Z equation
+    const double C14 = R.m13*P1 + R.m23*P2 + R.m33*P3;
+    const double C15 = ( R.m12*P1 + R.m22*P2 + R.m32*P3 )*S;
+    const double C16 = ( -cA1*cA2*cA3*P1 + cA1*cA2*sA3*P2 - cA1*sA2*P3 )*S;
+    const double C17 = ( R.m23*P1 - R.m13*P2 )*S;
+    
+    row[0] = Gx*C0 + Gy*C7  + Gz*C14; //Scale
+    row[1] = Gy*C8  + Gz*C15; //omega
+    row[2] = Gx*C2 + Gy*C9  + Gz*C16; //phi
+    row[3] = Gx*C3 + Gy*C10 + Gz*C17; //kappa
+    row[4] = Gx; //tx
+    row[5] = Gy; //ty
+    row[6] = Gz; //tz
+}
+
+//in-place Cholesky factor (lower) of a 7x7 normal matrix, false when it is not positive definite
+static bool Cholesky_7(double N[7][7])
+{
+    for(int j = 0 ; j < 7 ; j++)
+    {
+        double sum = N[j][j];
+        for(int k = 0 ; k < j ; k++)
+            sum -= N[j][k]*N[j][k];
+        if(sum <= 0)
+            return false;
+        N[j][j] = sqrt(sum);
+        
+        for(int i = j+1 ; i < 7 ; i++)
+        {
+            double sum_i = N[i][j];
+            for(int k = 0 ; k < j ; k++)
+                sum_i -= N[i][k]*N[j][k];
+            N[i][j] = sum_i/N[j][j];
+        }
+    }
+    return true;
+}
+
+static void CholeskySolve_7(const double L[7][7], const double *b, double *x)
+{
+    double y[7];
+    for(int i = 0 ; i < 7 ; i++)
+    {
+        double sum = b[i];
+        for(int k = 0 ; k < i ; k++)
+            sum -= L[i][k]*y[k];
+        y[i] = sum/L[i][i];
+    }
+    for(int i = 6 ; i >= 0 ; i--)
+    {
+        double sum = y[i];
+        for(int k = i+1 ; k < 7 ; k++)
+            sum -= L[k][i]*x[k];
+        x[i] = sum/L[i][i];
+    }
+}
+
+//normal equations (A^T W A + Wb) x = A^T W L + Wb Lb accumulated per thread, so memory does not grow with the number of points.
+//the per-thread partials are added in thread order, so a run with the same thread count gives the same bits. the residuals for sigma0 are a second streaming pass
 double* CoeffMatrix_25D(const D3DPOINT coord_center, const D3DPOINT coord_scale, const long selected_pts, const vector<D3DPOINT> &transformed_coord, const vector<double> &dH, const Conformalparam param, const vector<D3DPOINT> &tar_normal, const vector<double> &weight, double* sigmaX, double *sigma0)
 {
-    double C[21] = {0.0};
-    
     const RM R = MakeRotationMatrix(param.omega, param.phi, param.kappa);
     
     const double A1 = param.omega*DegToRad;
     const double A2 = param.phi*DegToRad;
     const double A3 = param.kappa*DegToRad;
     const double S = param.scale;
+    const double trig[6] = {sin(A1), cos(A1), sin(A2), cos(A2), sin(A3), cos(A3)};
     
-    const double R11 = R.m11;
-    const double R12 = R.m12;
-    const double R13 = R.m13;
-    
-    const double R21 = R.m21;
-    const double R22 = R.m22;
-    const double R23 = R.m23;
-    
-    const double R31 = R.m31;
-    const double R32 = R.m32;
-    const double R33 = R.m33;
-    
-    GMA_double *A_matrix = GMA_double_create(selected_pts, 7);
-    GMA_double *AW_matrix = GMA_double_create(selected_pts, 7);
-    GMA_double *AWT_matrix = GMA_double_create(7,selected_pts);
-    GMA_double *AWTA_matrix = GMA_double_create(7,7);
-    GMA_double *AWTAWb_matrix = GMA_double_create(7,7);
-    
-    GMA_double *Wb_matrix = GMA_double_create(7,7);
-    GMA_double *Qxx_matrix = GMA_double_create(7,7);
-    
-    GMA_double *L_matrix = GMA_double_create(selected_pts, 1);
-    GMA_double *AWTL_matrix = GMA_double_create(7,1);
+    //constraints on scale and rotations, translation is free
+    const double Wb[7] = {100000000000, 100000000000, 100000000000, 100000000000, 1.0, 1.0, 1.0};
+    const double Lb = 0.000000001;
     
-    GMA_double *Lb_matrix = GMA_double_create(7,1);
-    GMA_double *WbLb_matrix = GMA_double_create(7,1);
-    GMA_double *AWTLWbLb_matrix = GMA_double_create(7,1);
+    //per thread: 28 lower triangle entries of N, 7 of A^T W L
+    const int max_threads = omp_get_max_threads();
+    vector<double> N_partial(max_threads*35, 0.0);
     
-    GMA_double *X_matrix = GMA_double_create(7,1);
-    GMA_double *AX_matrix = GMA_double_create(selected_pts,1);
-    GMA_double *V_matrix = GMA_double_create(selected_pts,1);
-    GMA_double *VT_matrix = GMA_double_create(1,selected_pts);
-    GMA_double *VTV_matrix = GMA_double_create(1,1);
-    
-    for(int i=0;i<7;i++)
+#pragma omp parallel
     {
-        for(int j=0;j<7;j++)
-            Wb_matrix->val[i][j] = 0.0;
- 
-        Lb_matrix->val[i][0] = 0.000000001;
+        double *N_local = &N_partial[omp_get_thread_num()*35];
+        double *AWTL_local = N_local + 28;
+        
+#pragma omp for schedule(static)
+        for(long count = 0 ; count < selected_pts ; count++)
+        {
+            double row[7];
+            ConformalRow_25D(R, S, trig, transformed_coord[count], tar_normal[count], row);
+            
+            const double w = weight[count];
+            for(int i = 0 ; i < 7 ; i++)
+            {
+                const double wa = row[i]*w;
+                for(int j = 0 ; j <= i ; j++)
+                    N_local[i*(i+1)/2 + j] += wa*row[j];
+                AWTL_local[i] += wa*dH[count];
+            }
+        }
     }
     
-    Wb_matrix->val[0][0] = 100000000000;
-    Wb_matrix->val[1][1] = 100000000000;
-    Wb_matrix->val[2][2] = 100000000000;
-    Wb_matrix->val[3][3] = 100000000000;
-    Wb_matrix->val[4][4] = 1.0;
-    Wb_matrix->val[5][5] = 1.0;
-    Wb_matrix->val[6][6] = 1.0;
-    
-    long count = 0;
-    
-    for(long count = 0 ; count < selected_pts ; count++)
+    double N[7][7] = {{0.0}};
+    double AWTL[7] = {0.0};
+    for(int t = 0 ; t < max_threads ; t++)
     {
-        const double P1 = transformed_coord[count].m_X;
-        const double P2 = transformed_coord[count].m_Y;
-        const double P3 = transformed_coord[count].m_Z;
-        
-        const double Gx = tar_normal[count].m_X;///coord_scale.m_X;
-        const double Gy = tar_normal[count].m_Y;///coord_scale.m_Y;
-        const double Gz = -tar_normal[count].m_Z;///coord_scale.m_Z;
-        
-        //X equation
-        C[0] = R11*P1 + R21*P2 + R31*P3; //d_scale
-        C[1] = 0.0; //d_omega
-        C[2] = ( -sin(A2)*cos(A3)*P1 + sin(A2)*sin(A3)*P2 + cos(A2)*P3 )*S; //d_phi
-        C[3] = ( R21*P1 - R11*P2 )*S; //d_kappa
-        C[4] = 1.0;
-        C[5] = 0.0;
-        C[6] = 0.0;
-        
-        //Y equation
-        C[7] = R12*P1 + R22*P2 + R32*P3;
-        C[8] = (-R13*P1 - R23*P2 - R33*P3)*S;
-        C[9] =( sin(A1)*cos(A2)*cos(A3)*P1 - sin(A1)*cos(A2)*sin(A3)*P2 + sin(A1)*sin(A2)*P3 )*S;
-        C[10] = ( R22*P1 - R12*P2 )*S;
-        C[11] = 0.0;
-        C[12] = 1.0;
-        C[13] = 0.0;
-        
-        //Z equation
-        C[14] = R13*P1 + R23*P2 + R33*P3;
-        C[15] = ( R12*P1 + R22*P2 + R32*P3 )*S;
-        C[16] = ( -cos(A1)*cos(A2)*cos(A3)*P1 + cos(A1)*cos(A2)*sin(A3)*P2 - cos(A1)*sin(A2)*P3 )*S;
-        C[17] = ( R23*P1 - R13*P2 )*S;
-        C[18] = 0.0;
-        C[19] = 0.0;
-        C[20] = 1.0;
-        
-        A_matrix->val[count][0] = (Gx*C[0] + Gy*C[7]  + Gz*C[14]); //Scale
-        A_matrix->val[count][1] = (Gx*C[1] + Gy*C[8]  + Gz*C[15]); //omega
-        A_matrix->val[count][2] = (Gx*C[2] + Gy*C[9]  + Gz*C[16]); //phi
-        A_matrix->val[count][3] = (Gx*C[3] + Gy*C[10] + Gz*C[17]); //kappa
-        A_matrix->val[count][4] = (Gx*C[4] + Gy*C[11] + Gz*C[18]); //tx
-        A_matrix->val[count][5] = (Gx*C[5] + Gy*C[12] + Gz*C[19]); //ty
-        A_matrix->val[count][6] = (Gx*C[6] + Gy*C[13] + Gz*C[20]); //tz
-        
-        AW_matrix->val[count][0] = A_matrix->val[count][0]*weight[count];
-        AW_matrix->val[count][1] = A_matrix->val[count][1]*weight[count];
-        AW_matrix->val[count][2] = A_matrix->val[count][2]*weight[count];
-        AW_matrix->val[count][3] = A_matrix->val[count][3]*weight[count];
-        AW_matrix->val[count][4] = A_matrix->val[count][4]*weight[count];
-        AW_matrix->val[count][5] = A_matrix->val[count][5]*weight[count];
-        AW_matrix->val[count][6] = A_matrix->val[count][6]*weight[count];
-        
-        L_matrix->val[count][0] = dH[count];
+        const double *N_local = &N_partial[t*35];
+        for(int i = 0 ; i < 7 ; i++)
+        {
+            for(int j = 0 ; j <= i ; j++)
+                N[i][j] += N_local[i*(i+1)/2 + j];
+            AWTL[i] += N_local[28 + i];
+        }
     }
     
-    GMA_double_Tran(AW_matrix,AWT_matrix);
-    GMA_double_mul(AWT_matrix,A_matrix,AWTA_matrix);
-    GMA_double_sum(AWTA_matrix,Wb_matrix,AWTAWb_matrix);
-        
-    GMA_double_inv(AWTAWb_matrix,Qxx_matrix);
+    for(int i = 0 ; i < 7 ; i++)
+    {
+        N[i][i] += Wb[i];
+        AWTL[i] += Wb[i]*Lb;
+        for(int j = i+1 ; j < 7 ; j++)
+            N[i][j] = N[j][i];
+    }
     
-    GMA_double_mul(AWT_matrix,L_matrix,AWTL_matrix);
-    GMA_double_mul(Wb_matrix,Lb_matrix,WbLb_matrix);
+    double* dx = (double*)calloc(sizeof(double),7);
+    if(!Cholesky_7(N))
+    {
+        printf("CoeffMatrix_25D : normal matrix is not positive definite\n");
+        for(int i = 0 ; i < 7 ; i++)
+            sigmaX[i] = 0;
+        *sigma0 = 0;
+        return dx;
+    }
+    CholeskySolve_7(N, AWTL, dx);
     
-    GMA_double_sum(AWTL_matrix,WbLb_matrix,AWTLWbLb_matrix);
+    //diagonal of Qxx from the unit columns
+    for(int i = 0 ; i < 7 ; i++)
+    {
+        double e[7] = {0.0};
+        double q[7];
+        e[i] = 1.0;
+        CholeskySolve_7(N, e, q);
+        sigmaX[i] = sqrt(q[i]);
+    }
     
-    GMA_double_mul(Qxx_matrix,AWTLWbLb_matrix,X_matrix);
-    GMA_double_mul(A_matrix,X_matrix,AX_matrix);
+    vector<double> VTV_partial(max_threads, 0.0);
+#pragma omp parallel
+    {
+        double VTV_local = 0;
+#pragma omp for schedule(static)
+        for(long count = 0 ; count < selected_pts ; count++)
+        {
+            double row[7];
+            ConformalRow_25D(R, S, trig, transformed_coord[count], tar_normal[count], row);
+            
+            double v = -dH[count];
+            for(int i = 0 ; i < 7 ; i++)
+                v += row[i]*dx[i];
+            VTV_local += v*v;
+        }
+        VTV_partial[omp_get_thread_num()] = VTV_local;
+    }
     
-    GMA_double_sub(AX_matrix,L_matrix,V_matrix);
-    GMA_double_Tran(V_matrix,VT_matrix);
-    GMA_double_mul(VT_matrix,V_matrix,VTV_matrix);
+    double VTV = 0;
+    for(int t = 0 ; t < max_threads ; t++)
+        VTV += VTV_partial[t];
     
-    *sigma0 = sqrt((VTV_matrix->val[0][0])/(selected_pts - 7));
-    double* dx = (double*)calloc(sizeof(double),7);
+    *sigma0 = sqrt(VTV/(selected_pts - 7));
     
     for(int i = 0 ; i < 7 ; i++)
-    {
-        sigmaX[i] = sqrt(Qxx_matrix->val[i][i]);
-        dx[i] = X_matrix->val[i][0];
-        
         printf("dx %d\t%f\tsigmaX %f\n",i,dx[i],sigmaX[i]);
-    }
- 
-    GMA_double_destroy(A_matrix);
-    GMA_double_destroy(AW_matrix);
-    GMA_double_destroy(AWT_matrix);
-    GMA_double_destroy(AWTA_matrix);
-    GMA_double_destroy(AWTAWb_matrix);
-    
-    GMA_double_destroy(Wb_matrix);
-    GMA_double_destroy(Qxx_matrix);
-    
-    GMA_double_destroy(L_matrix);
-    GMA_double_destroy(AWTL_matrix);
-    
-    GMA_double_destroy(Lb_matrix);
-    GMA_double_destroy(WbLb_matrix);
-    GMA_double_destroy(AWTLWbLb_matrix);
-    
-    GMA_double_destroy(X_matrix);
-    GMA_double_destroy(AX_matrix);
-    GMA_double_destroy(V_matrix);
-    GMA_double_destroy(VT_matrix);
-    GMA_double_destroy(VTV_matrix);
     
     return dx;
 }
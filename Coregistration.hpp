@@ -8,11 +8,15 @@
 #ifndef Coregistration_hpp
 #define Coregistration_hpp
 
+#include <omp.h>
 #include "SubFunctions.hpp"
 
 //Image Coregistration
 double** ImageCoregistration(TransParam *return_param, char* _filename, ARGINFO args, char *_save_filepath, int gcp_opt, D2DPOINT *adjust_std, bool* cal_check);
 void Preprocessing_Coreg(ProInfo *proinfo, char *save_path,uint16 **Oriimage,char **Subsetfile, uint8 py_level, CSize *Subsetsize, CSize **data_size_lr);
+double CalMemorySize_Pyramid_Coreg(const ProInfo *proinfo, const uint8 py_level, CSize **data_size_lr);
+uint16*** SetPyramidImages_Coreg(const ProInfo *proinfo, uint16 **Oriimage, const uint8 py_level, CSize **data_size_lr);
+void FreePyramidImages_Coreg(const ProInfo *proinfo, uint16 ***PyImages, const uint8 py_level);
 //End Image Coregistration
 
 void DEM_ImageCoregistration_hillshade(TransParam *return_param, char* _filename, ARGINFO args, char *_save_filepath, int gcp_opt);
@@ -20,6 +24,7 @@ void DEM_ImageCoregistration_GeomatricConstraint(TransParam *return_param, char*
 D3DPOINT FindNormal(D3DPOINT *normal_ori, const float* dem, const D3DPOINT Pos, const D3DPOINT Mean, const D3DPOINT Scale, const double* Boundary, const Conformalparam X, const CSize tinsize, const double Gridspace, double *roh_array, double *Z, const bool check_tar);
 D3DPOINT SurfaceDistance_ori(const D3DPOINT tar_normal_ori, const float* ref_dem, const D3DPOINT tar_normal, const D3DPOINT tar_pts, const double *tin_boundary,const CSize tinsize, const double Gridspace, const Conformalparam param, const D3DPOINT Mean, const D3DPOINT Scale, const double p_ref_z);
 void SlopeAspect(const D3DPOINT normal, const D3DPOINT scale, double *slope, double *aspect);
+void SetRefSurfacePoints(const float* DEM_ref, const vector<D3DPOINT> &select_pts, const D3DPOINT coord_center, const D3DPOINT coord_scale, const double *boundary_ref, const CSize ref_dem_size, const double grid_size, vector<RefSurfacePoint> &ref_surface);
 D3DPOINT ConformalTransform(const D3DPOINT input, const Conformalparam param);
 D3DPOINT Normalize_coord(const D3DPOINT input, const D3DPOINT Mean, const D3DPOINT Scale);
 D3DPOINT Denormalize_coord(const D3DPOINT input, const D3DPOINT Mean, const D3DPOINT Scale);
@@ -10,26 +10,293 @@
 
 //orthogeneration
 void orthogeneration(const TransParam _param, const ARGINFO args, char *ImageFilename, char *DEMFilename, const char *Outputpath, const int pair, const int DEM_divide, const double * const *Imageparams)
+{
+    orthogeneration_multi(_param, args, &ImageFilename, &pair, 1, DEMFilename, Outputpath, DEM_divide, Imageparams);
+}
+
+//orthoimages of several images over one DEM. Each band of the DEM is read once and resampled for all images together
+void orthogeneration_multi(const TransParam _param, const ARGINFO args, char **ImageFilenames, const int *pairs, const int num_images, char *DEMFilename, const char *Outputpath, const int DEM_divide, const double * const *Imageparams)
 {
     if(args.RA_only) {
         return;
     }
     
+    time_t ST = 0, ET = 0;
+    double gap;
+    
+    ST = time(0);
+    
+    char DEM_header[500];
+    char *tmp_chr = remove_ext(DEMFilename);
+    sprintf(DEM_header,"%s.hdr",tmp_chr);
+    free(tmp_chr);
+    
+    printf("save = %s\n",Outputpath);
+    printf("DEM = %s\n",DEMFilename);
+    printf("DEM hdr= %s\n",DEM_header);
+    
+    // load DEM infor from geotiff file.
+    double Ortho_resolution, DEM_resolution, DEM_minX, DEM_maxY;
+    CSize DEM_size = ReadGeotiff_info(DEMFilename, &DEM_minX, &DEM_maxY, &DEM_resolution);
+    
+    if (!args.check_DEM_space)
+        Ortho_resolution = DEM_resolution;
+    else
+        Ortho_resolution = args.DEM_space;
+    
+    vector<OrthoImage> orthos(num_images);
+    int count_ortho = 0;
+    for(int ti = 0 ; ti < num_images ; ti++)
+    {
+        if(SetOrthoImage_ortho(&orthos[ti], _param, args, ImageFilenames[ti], Outputpath, pairs[ti], DEM_divide, Imageparams, DEM_size, DEM_minX, DEM_maxY, DEM_resolution, Ortho_resolution))
+            count_ortho++;
+        else
+            printf("check overlap area between DEM and image, or match a projection type of input image based on DEM projection by adding '-projection' option\n");
+    }
+    
+    if(count_ortho > 0)
+    {
+        // set saving pointer for orthoimage
+        CSize Orthoimagesize(DEM_size.width, DEM_size.height);
+        double OrthoBoundary[4];
+        OrthoBoundary[0]  = DEM_minX;
+        OrthoBoundary[1]  = DEM_maxY-DEM_size.height*DEM_resolution;
+        OrthoBoundary[2]  = DEM_minX+DEM_size.width*DEM_resolution;
+        OrthoBoundary[3]  = DEM_maxY;
+        
+        // open DEM; values are read per band window
+        DEMAccessor DEM_accessor;
+        const bool check_DEM = OpenDEMAccessor(DEMFilename, &DEM_accessor, 16);
+        
+        printf("%d\n",DEM_size.width);
+        printf("%d\n",DEM_size.height);
+        printf("%f\n",DEM_minX);
+        printf("%f\n",DEM_maxY);
+        printf("%f\n",DEM_resolution);
+        printf("%f\n",Ortho_resolution);
+        
+        printf("Orthoimage info size %d\t%d\tBR %f\t%f\t%f\t%f\n",Orthoimagesize.width,Orthoimagesize.height,OrthoBoundary[0],OrthoBoundary[1],OrthoBoundary[2],OrthoBoundary[3]);
+        
+        const long width = Orthoimagesize.width;
+        const long band_rows = GEOTIFF_TILE_SIZE;
+        const long num_bands = (Orthoimagesize.height + band_rows - 1)/band_rows;
+        const long blocks_x = (width + ORTHO_BLOCK_SIZE - 1)/ORTHO_BLOCK_SIZE;
+        const long blocks_y = band_rows/ORTHO_BLOCK_SIZE;
+        const long band_blocks = blocks_x*blocks_y;
+        
+        count_ortho = 0;
+        for(int ti = 0 ; ti < num_images ; ti++)
+        {
+            OrthoImage &ortho = orthos[ti];
+            ortho.writer.tif = NULL;
+            ortho.writer.gtif = NULL;
+            if(ortho.check_ortho && check_DEM)
+                ortho.check_ortho = OpenGeotiffTileWriter(ortho.OrthoGEOTIFFFilename, &ortho.writer, Orthoimagesize.width, Orthoimagesize.height, Ortho_resolution, OrthoBoundary[0], OrthoBoundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 12);
+            else
+                ortho.check_ortho = false;
+            
+            if(ortho.check_ortho)
+            {
+                ortho.result_ortho = (uint16*)malloc(sizeof(uint16)*band_rows*width);
+                count_ortho++;
+            }
+        }
+        
+        for(long band = 0 ; band < num_bands && count_ortho > 0 ; band++)
+        {
+            printf("Band %ld/%ld, processing:%6.1f\n",band+1,num_bands,(band+1)/(double)num_bands*100);
+            
+            const long r_start = band*band_rows;
+            const long rows = min((long)Orthoimagesize.height, r_start + band_rows) - r_start;
+            
+            double subBoundary[4];
+            subBoundary[0] = OrthoBoundary[0];
+            subBoundary[1] = OrthoBoundary[3] - (r_start + rows - 1)*Ortho_resolution;
+            subBoundary[2] = OrthoBoundary[0] + (width - 1)*Ortho_resolution;
+            subBoundary[3] = OrthoBoundary[3] - r_start*Ortho_resolution;
+            
+            long DEM_cols[2], DEM_rows[2];
+            CSize DEM_window_size;
+            float *DEM_value = GetDEMAccessorWindow(&DEM_accessor, subBoundary, DEM_cols, DEM_rows, &DEM_window_size);
+            
+            double minmaxHeight[2] = {99999.0, -99999.0};
+            if(DEM_value)
+            {
+                const long DEM_length = (long)DEM_window_size.width*(long)DEM_window_size.height;
+                for(long i = 0 ; i < DEM_length ; i++)
+                {
+                    if(DEM_value[i] > -1000)
+                    {
+                        if(minmaxHeight[0] > DEM_value[i])
+                            minmaxHeight[0] = DEM_value[i];
+                        if(minmaxHeight[1] < DEM_value[i])
+                            minmaxHeight[1] = DEM_value[i];
+                    }
+                }
+            }
+            const bool check_height = minmaxHeight[0] <= minmaxHeight[1];
+            
+            //grids and image windows of all images, one image at a time: the grid and pyramid loops inside are the parallel ones
+            for(int ti = 0 ; ti < num_images ; ti++)
+            {
+                OrthoImage &ortho = orthos[ti];
+                ortho.check_band = false;
+                if(ortho.check_ortho)
+                {
+                    memset(ortho.result_ortho,0,sizeof(uint16)*band_rows*width);
+                    if(check_height)
+                        LoadOrthoBand_ortho(&ortho, _param, minmaxHeight, OrthoBoundary[0], OrthoBoundary[3] - r_start*Ortho_resolution, Ortho_resolution, width, rows);
+                }
+            }
+            
+#pragma omp parallel for schedule(dynamic,1)
+            for(long block = 0 ; block < num_images*band_blocks ; block++)
+            {
+                const OrthoImage &ortho = orthos[block/band_blocks];
+                if(!ortho.check_band)
+                    continue;
+                
+                const OrthoBandGrid &grid = ortho.grid;
+                const long num_nodes = grid.cols*grid.rows;
+                const uint16 *image_data = ortho.py_step > 0 ? ortho.pyimg : ortho.subimage;
+                const CSize Image_size = ortho.Image_size;
+                const long data_length_image = (long)Image_size.width*(long)Image_size.height;
+                
+                const long block_row = ((block%band_blocks)/blocks_x)*ORTHO_BLOCK_SIZE;
+                const long block_col = ((block%band_blocks)%blocks_x)*ORTHO_BLOCK_SIZE;
+                const long row_end = min(rows, block_row + ORTHO_BLOCK_SIZE);
+                const long col_end = min(width, block_col + ORTHO_BLOCK_SIZE);
+                
+                for(long r = block_row ; r < row_end ; r++)
+                {
+                    const double row  = OrthoBoundary[3] - (r_start + r)*Ortho_resolution;
+                    for(long c = block_col ; c < col_end ; c++)
+                    {
+                        const double col  = OrthoBoundary[0] + c*Ortho_resolution;
+                        
+                        double t_col       = (col - DEM_minX)/DEM_resolution;
+                        double t_row       = (DEM_maxY - row)/DEM_resolution;
+                        
+                        long t_col_int   = (long)(t_col + 0.01);
+                        long t_row_int   = (long)(t_row + 0.01);
+                        
+                        if(t_col_int >= 0 && t_col_int +1 < DEM_size.width && t_row_int >= 0 && t_row_int +1 < DEM_size.height &&
+                           t_col_int >= DEM_cols[0] && t_col_int < DEM_cols[1] && t_row_int >= DEM_rows[0] && t_row_int < DEM_rows[1])
+                        {
+                            const long index  = (t_col_int - DEM_cols[0]) + (t_row_int - DEM_rows[0])*(long)DEM_window_size.width;
+                            const double value = DEM_value[index];
+                            
+                            if(value > -1000)
+                            {
+                                const long g_col = c/ORTHO_GRID_SPACE;
+                                const long g_row = r/ORTHO_GRID_SPACE;
+                                const long node = g_row*grid.cols + g_col;
+                                
+                                D2DPOINT image;
+                                if(ortho.sensor_type == SB && !grid.clamped[node] && !grid.clamped[node+1] && !grid.clamped[node+grid.cols] && !grid.clamped[node+grid.cols+1])
+                                {
+                                    //bilinear in the grid cell on the two nearest height levels, then linear in height
+                                    const double dcol = (c - g_col*ORTHO_GRID_SPACE)/(double)ORTHO_GRID_SPACE;
+                                    const double drow = (r - g_row*ORTHO_GRID_SPACE)/(double)ORTHO_GRID_SPACE;
+                                    const double w1 = (1-dcol)*(1-drow), w2 = dcol*(1-drow), w3 = (1-dcol)*drow, w4 = dcol*drow;
+                                    
+                                    const double t_level = (value - grid.height_start)/grid.height_step;
+                                    int level_int = (int)t_level;
+                                    if(level_int > grid.levels - 2)
+                                        level_int = grid.levels - 2;
+                                    const double dh = t_level - level_int;
+                                    
+                                    D2DPOINT level[2];
+                                    for(int h = 0 ; h < 2 ; h++)
+                                    {
+                                        const D2DPOINT *pts = &grid.image[(level_int + h)*num_nodes + node];
+                                        level[h].m_X = w1*pts[0].m_X + w2*pts[1].m_X + w3*pts[grid.cols].m_X + w4*pts[grid.cols+1].m_X;
+                                        level[h].m_Y = w1*pts[0].m_Y + w2*pts[1].m_Y + w3*pts[grid.cols].m_Y + w4*pts[grid.cols+1].m_Y;
+                                    }
+                                    image.m_X = level[0].m_X + dh*(level[1].m_X - level[0].m_X);
+                                    image.m_Y = level[0].m_Y + dh*(level[1].m_Y - level[0].m_Y);
+                                }
+                                else
+                                    image = GetOrthoImageCoord_ortho(ortho.sensor_type, _param, ortho.m_frameinfo, ortho.RPCs, ortho.imageparam, col, row, value);
+                                
+                                const D2DPOINT temp_pt     = OriginalToPyramid_single(image, ortho.startpos, ortho.py_step);
+                                
+                                t_col_int   = (long int)(temp_pt.m_X + 0.01);
+                                t_row_int   = (long int)(temp_pt.m_Y + 0.01);
+                                
+                                if(t_col_int >= 0 && t_col_int +1 < Image_size.width && t_row_int >= 0 && t_row_int +1 < Image_size.height
+                                   && (t_col_int +1) + (t_row_int +1)*(long)Image_size.width < data_length_image)
+                                    ortho.result_ortho[r*width + c] = image_data[t_col_int + t_row_int*(long)Image_size.width];
+                            }
+                        }
+                    }
+                }
+            }
+            
+            for(int ti = 0 ; ti < num_images ; ti++)
+            {
+                OrthoImage &ortho = orthos[ti];
+                if(ortho.check_band)
+                {
+                    if(ortho.py_step > 0)
+                        free(ortho.pyimg);
+                    free(ortho.subimage);
+                }
+                if(ortho.check_ortho)
+                    WriteGeotiffTileBand(&ortho.writer, ortho.result_ortho, rows);
+            }
+            
+            if(DEM_value)
+                free(DEM_value);
+        }
+        
+        if(check_DEM)
+            CloseDEMAccessor(&DEM_accessor);
+        
+        for(int ti = 0 ; ti < num_images ; ti++)
+        {
+            if(orthos[ti].check_ortho)
+            {
+                CloseGeotiffTileWriter(&orthos[ti].writer);
+                free(orthos[ti].result_ortho);
+            }
+        }
+        
+        ET = time(0);
+        
+        gap = difftime(ET,ST);
+        printf("ortho finish(time[m] = %5.2f)!!\n",gap/60.0);
+    }
+    
+    for(int ti = 0 ; ti < num_images ; ti++)
+    {
+        if(orthos[ti].RPCs)
+            RPCsFree(orthos[ti].RPCs);
+    }
+}
+
+//RPCs, resolution and output name of one image of orthogeneration_multi. false when the image misses the DEM
+bool SetOrthoImage_ortho(OrthoImage *ortho, const TransParam _param, const ARGINFO args, char *ImageFilename, const char *Outputpath, const int pair, const int DEM_divide, const double * const *Imageparams,
+const CSize DEM_size, const double DEM_minX, const double DEM_maxY, const double DEM_resolution, const double Ortho_resolution)
+{
     ProInfo *proinfo = new ProInfo;
     proinfo->sensor_type = args.sensor_type;
     proinfo->number_of_images = 1;
     
-    char DEM_header[500];
     char RPCFilename[500];
     char OrthoFilename[500];
-    char OrthoGEOTIFFFilename[500];
     char Ortho_header[500];
     
-    time_t ST = 0, ET = 0;
-    double gap;
+    ortho->ImageFilename = ImageFilename;
+    ortho->sensor_type = args.sensor_type;
+    ortho->RPCs = NULL;
+    ortho->check_ortho = false;
+    ortho->check_band = false;
+    ortho->result_ortho = NULL;
+    ortho->subimage = NULL;
+    ortho->pyimg = NULL;
     
-    ST = time(0);
-    FrameInfo m_frameinfo;
+    FrameInfo &m_frameinfo = ortho->m_frameinfo;
     m_frameinfo.m_Camera.m_focalLength  = 0;
     m_frameinfo.m_Camera.m_CCDSize      = 0;
     
@@ -67,9 +334,7 @@ void orthogeneration(const TransParam _param, const ARGINFO args, char *ImageFil
         fclose(fid_xml);
     
     free(tmp_chr);
-
-    tmp_chr = remove_ext(DEMFilename);
-    sprintf(DEM_header,"%s.hdr",tmp_chr);
+    
     char *Ifilename  = SetOutpathName(ImageFilename);
     char *tmp_no_ext = remove_ext(Ifilename);
     
@@ -77,42 +342,37 @@ void orthogeneration(const TransParam _param, const ARGINFO args, char *ImageFil
     {
         sprintf(OrthoFilename, "%s/%s_ortho_%3.1f.raw",Outputpath,tmp_no_ext,args.DEM_space);
         sprintf(Ortho_header, "%s/%s_ortho_%3.1f.hdr",Outputpath, tmp_no_ext,args.DEM_space);
-        sprintf(OrthoGEOTIFFFilename, "%s/%s_ortho_%3.1f.tif",Outputpath, tmp_no_ext,args.DEM_space);
+        sprintf(ortho->OrthoGEOTIFFFilename, "%s/%s_ortho_%3.1f.tif",Outputpath, tmp_no_ext,args.DEM_space);
     }
     else
     {
         sprintf(OrthoFilename, "%s/%s_%d_ortho_%3.1f.raw",Outputpath, tmp_no_ext,DEM_divide,args.DEM_space);
         sprintf(Ortho_header, "%s/%s_%d_ortho_%3.1f.hdr",Outputpath, tmp_no_ext,DEM_divide,args.DEM_space);
-        sprintf(OrthoGEOTIFFFilename, "%s/%s_%d_ortho_%3.1f.tif",Outputpath, tmp_no_ext,DEM_divide,args.DEM_space);
+        sprintf(ortho->OrthoGEOTIFFFilename, "%s/%s_%d_ortho_%3.1f.tif",Outputpath, tmp_no_ext,DEM_divide,args.DEM_space);
     }
-
+    
     free(tmp_no_ext);
-    free(tmp_chr);
     free(Ifilename);
-
+    
     printf("image = %s\n",ImageFilename);
     printf("rpc = %s\n",RPCFilename);
-    printf("save = %s\n",Outputpath);
-    printf("DEM = %s\n",DEMFilename);
-    printf("DEM hdr= %s\n",DEM_header);
     printf("ortho = %s\n",OrthoFilename);
     printf("ortho hdr= %s\n",Ortho_header);
-    printf("ortho geotiff = %s\n", OrthoGEOTIFFFilename);
+    printf("ortho geotiff = %s\n", ortho->OrthoGEOTIFFFilename);
     
     double Image_resolution = 0.5;
     
     // load RPCs info from xml file
     double row_grid_size, col_grid_size, product_grid_size;
-    double** RPCs;
     BandInfo band;
     if(args.sensor_type == SB)
     {
         if(args.sensor_provider == DG)
-            RPCs            = OpenXMLFile(proinfo, 0, &row_grid_size, &col_grid_size,&product_grid_size, &band);
+            ortho->RPCs     = OpenXMLFile(proinfo, 0, &row_grid_size, &col_grid_size,&product_grid_size, &band);
         else if(args.sensor_provider == PL)
-            RPCs            = OpenXMLFile_Pleiades(RPCFilename);
+            ortho->RPCs     = OpenXMLFile_Pleiades(RPCFilename);
         else if(args.sensor_provider == PT)
-            RPCs            = OpenXMLFile_Planet(RPCFilename);
+            ortho->RPCs     = OpenXMLFile_Planet(RPCFilename);
     }
     else
     {
@@ -164,288 +424,165 @@ void orthogeneration(const TransParam _param, const ARGINFO args, char *ImageFil
             Image_resolution  = args.image_resolution;
         }
     }
-
+    
     printf("Image resolution %f\n",Image_resolution);
     printf("Hemis projection %d %d\n",_param.bHemisphere, _param.projection);
     printf("param %s %d %d\n", _param.direction,_param.utm_zone,_param.projection);
     
-    // load DEM infor from geotiff file.
-    double Ortho_resolution, DEM_resolution, DEM_minX, DEM_maxY;
-    CSize DEM_size = ReadGeotiff_info(DEMFilename, &DEM_minX, &DEM_maxY, &DEM_resolution);
-    
-    if (!args.check_DEM_space)
-        Ortho_resolution = DEM_resolution;
-    else
-        Ortho_resolution = args.DEM_space;
-    
     double resolution[3] = {DEM_resolution, Image_resolution, Ortho_resolution};
     
     if(fabs(resolution[1] - resolution[2]) <= 1)
         resolution[1] = Ortho_resolution;
     
-    const double OrthoGridFactor = resolution[2]/resolution[0];
+    ortho->impyramid_step  = ceil(log(resolution[2]/resolution[1])/log(2));
+    printf("impyramid_step %d\n ortho_Resolution %f\n",ortho->impyramid_step,Ortho_resolution);
     
-    int impyramid_step  = ceil(log(resolution[2]/resolution[1])/log(2));
-    printf("impyramid_step %d\n ortho_Resolution %f\n",impyramid_step,Ortho_resolution);
+    //the first pyramid level is sampled at most, filtered for the full pyramid step
+    ortho->py_step = ortho->impyramid_step > 0 ? 1 : 0;
+    int filter_size = ortho->py_step > 0 ? pwrtwo(ortho->impyramid_step)-1 : 0;
+    if(ortho->py_step > 0 && filter_size < 3)
+        filter_size = 3;
+    ortho->image_margin = filter_size + ORTHO_IMAGE_MARGIN;
     
     bool check_overlap = false;
     CSize Orthoimagesize_temp;
     double OrthoBoundary[4];
     // set generated orthoimage info by comparing DEM info
     if(args.sensor_type == SB)
-        check_overlap = SetOrthoBoundary_ortho(&Orthoimagesize_temp, OrthoBoundary, RPCs, DEM_resolution, DEM_size, DEM_minX, DEM_maxY, _param, Ortho_resolution);
+        check_overlap = SetOrthoBoundary_ortho(&Orthoimagesize_temp, OrthoBoundary, ortho->RPCs, DEM_resolution, DEM_size, DEM_minX, DEM_maxY, _param, Ortho_resolution);
     else
     {
         GetImageSize(ImageFilename,&m_frameinfo.m_Camera.m_ImageSize);
         check_overlap = SetDEMBoundary_ortho_photo(&Orthoimagesize_temp, OrthoBoundary,DEM_resolution, DEM_size, DEM_minX, DEM_maxY, Ortho_resolution, m_frameinfo.Photoinfo[0], m_frameinfo.m_Camera, m_frameinfo.Photoinfo[0].m_Rm);
     }
     
-    if(check_overlap)
+    if(pair == 1)
     {
-        // set saving pointer for orthoimage
-        CSize Orthoimagesize(DEM_size.width, DEM_size.height);
-        OrthoBoundary[0]  = DEM_minX;
-        OrthoBoundary[1]  = DEM_maxY-DEM_size.height*DEM_resolution;
-        OrthoBoundary[2]  = DEM_minX+DEM_size.width*DEM_resolution;
-        OrthoBoundary[3]  = DEM_maxY;
-        
-        uint16 *result_ortho    = (uint16*)calloc((long)Orthoimagesize.width*(long)Orthoimagesize.height,sizeof(uint16));
-        
-        // load DEM value;
-        float *DEM_value = GetDEMValue(DEMFilename, DEM_size);
-        
-        printf("%d\n",DEM_size.width);
-        printf("%d\n",DEM_size.height);
-        printf("%f\n",DEM_minX);
-        printf("%f\n",DEM_maxY);
-        printf("%f\n",DEM_resolution);
-        printf("%f\n",Ortho_resolution);
-        
-        double minmaxHeight[2] = {99999.0, -99999.0};
-        for(long i=0;i<DEM_size.height;i++)
-        {
-            for(long j=0;j<DEM_size.width;j++)
-            {
-                long index = i*(long)DEM_size.width + j;
-                if( (minmaxHeight[0] > DEM_value[index]) && (DEM_value[index] > -1000))
-                    minmaxHeight[0] = DEM_value[index];
-                
-                if( (minmaxHeight[1] < DEM_value[index]) && (DEM_value[index] > -1000))
-                    minmaxHeight[1] = DEM_value[index];
-            }
-        }
-        
-        double subfactor                      = pow(4-impyramid_step,2.0);
-        if(subfactor <= 1)
-            subfactor                       = 1;
-        const int sub_height                  = ceil(Orthoimagesize.height/subfactor);
-        const int sub_width                   = ceil(Orthoimagesize.width/subfactor);
-        const int height_interval             = Ortho_resolution*sub_height;
-        const int width_interval              = Ortho_resolution*sub_width;
-        
-        const int buffer_x                    = Ortho_resolution*5*ceil(1.0/OrthoGridFactor);
-        const int buffer_y                    = Ortho_resolution*5*ceil(1.0/OrthoGridFactor);
-        
-        double imageparam[2];
-        if(pair == 1)
-        {
-            imageparam[0] = 0.0;
-            imageparam[1] = 0.0;
-        }
-        else
-        {
-            imageparam[0] = Imageparams[1][0];
-            imageparam[1] = Imageparams[1][1];
-        }
-        printf("Image ID %d\tRPCs bias %f\t%f\n",pair,imageparam[0],imageparam[1]);
-        
-        printf("Orthoimage info size %d\t%d\tBR %f\t%f\t%f\t%f\n",Orthoimagesize.width,Orthoimagesize.height,OrthoBoundary[0],OrthoBoundary[1],OrthoBoundary[2],OrthoBoundary[3]);
-        
-        long data_length_ortho = (long)Orthoimagesize.width*(long)Orthoimagesize.height;
-        for(long i=0; i < subfactor;i++)
-        {
-            for(long j=0; j<subfactor;j++)
-            {
-                char MEG[500];
-                sprintf(MEG,"Tile %d %d, processing:%6.1f\n",j+1,i+1,((i)*subfactor+j+1)/subfactor/subfactor*100);
-                printf("%s",MEG);
-
-                double Y_size[2];
-                Y_size[0]        = OrthoBoundary[3] - (i+1)*height_interval;
-                Y_size[1]        = OrthoBoundary[3] - i*height_interval;
-                double X_size[2];
-                X_size[0]        = OrthoBoundary[0] + j*width_interval;
-                X_size[1]        = OrthoBoundary[0] + (j+1)*width_interval;
-                
-                X_size[0]       = X_size[0] - buffer_x;
-                Y_size[0]       = Y_size[0] - buffer_y;
-                Y_size[1]       = Y_size[1] + buffer_y;
-                X_size[1]       = X_size[1] + buffer_x;
-                
-                if( X_size[0] < OrthoBoundary[0])
-                    X_size[0]   = OrthoBoundary[0];
-                
-                if (X_size[1] > OrthoBoundary[2])
-                    X_size[1]   = OrthoBoundary[2];
-                
-                if (Y_size[0] < OrthoBoundary[1])
-                    Y_size[0]   = OrthoBoundary[1];
-                
-                if (Y_size[1] > OrthoBoundary[3])
-                    Y_size[1]   = OrthoBoundary[3];
-                
-                double subBoundary[4];
-                subBoundary[0] = X_size[0];
-                subBoundary[1] = Y_size[0];
-                subBoundary[2] = X_size[1];
-                subBoundary[3] = Y_size[1];
-                
-                D2DPOINT startpos_ori;
-                CSize subsetsize;
-                bool check_subsetImage = false;
-                
-                uint16 *subimage = subsetImage_ortho(args.sensor_type, m_frameinfo, _param, imageparam, RPCs, ImageFilename,
-                                             subBoundary,  minmaxHeight, &startpos_ori, &subsetsize, &check_subsetImage);
-                if(check_subsetImage)
-                {
-                    const int ori_impyramid_step = impyramid_step;
-                    if(impyramid_step > 0)
-                        impyramid_step = 1;
-                    
-                    CSize* data_size = new CSize[impyramid_step+1];
-                    D2DPOINT startpos;
-                    
-                    SetPySizes(data_size, subsetsize, impyramid_step);
-                    startpos.m_X       = (double)(startpos_ori.m_X/pwrtwo(impyramid_step));      startpos.m_Y       = (double)(startpos_ori.m_Y/pwrtwo(impyramid_step));
-                    
-                    uint16 *pyimg = NULL;
-                    if(impyramid_step > 0)
-                        pyimg = Preprocessing_ortho(ori_impyramid_step,data_size,subimage);
-                    
-                    CSize Image_size  = data_size[impyramid_step];
-                    long data_length_image = (long)Image_size.width*(long)Image_size.height;
-                    const int col_size    = (int)((X_size[1] - X_size[0])/Ortho_resolution + 0.5);
-                    const int row_size    = (int)((Y_size[1] - Y_size[0])/Ortho_resolution + 0.5);
-                    
-    #pragma omp parallel for schedule(guided)
-                    for(long count = 0; count < (long)col_size*(long)row_size ; count++)
-                    {
-                        const double row  = (floor(count/col_size))*Ortho_resolution + Y_size[0];
-                        const double col  = (count % col_size)*Ortho_resolution + X_size[0];
+        ortho->imageparam[0] = 0.0;
+        ortho->imageparam[1] = 0.0;
+    }
+    else
+    {
+        ortho->imageparam[0] = Imageparams[1][0];
+        ortho->imageparam[1] = Imageparams[1][1];
+    }
+    printf("Image ID %d\tRPCs bias %f\t%f\n",pair,ortho->imageparam[0],ortho->imageparam[1]);
+    
+    ortho->check_ortho = check_overlap && GetImageSize(ImageFilename,&ortho->Imagesize);
+    
+    delete proinfo;
+    
+    return ortho->check_ortho;
+}
 
-                        double t_col       = (col - DEM_minX)/DEM_resolution;
-                        double t_row       = (DEM_maxY - row)/DEM_resolution;
-                        
-                        long t_col_int   = (long)(t_col + 0.01);
-                        long t_row_int   = (long)(t_row + 0.01);
-                        
-                        if(t_col_int >= 0 && t_col_int +1 < DEM_size.width && t_row_int >= 0 && t_row_int +1 < DEM_size.height)
-                        {
-                            long index  = (t_col_int   ) + (t_row_int   )*(long)DEM_size.width;
-                            double value = DEM_value[index];
-                            D3DPOINT object;
-                            D2DPOINT objectXY;
-                            object.m_X  = col;
-                            object.m_Y  = row;
-                            object.m_Z  = value;
-                            
-                            objectXY.m_X  = col;
-                            objectXY.m_Y  = row;
-                            
-                            if(value > -1000)
-                            {
-                                D2DPOINT image;
-                                D2DPOINT temp_pt;
-                                if(args.sensor_type == SB)
-                                {
-                                    D2DPOINT wgsPt = ps2wgs_single(_param, objectXY);
-                                   
-                                    object.m_X  = wgsPt.m_X;
-                                    object.m_Y  = wgsPt.m_Y;
-                                    image = GetObjectToImageRPC_single(RPCs, 2, imageparam, object);
-                                }
-                                else
-                                {
-                                    D2DPOINT photo  = GetPhotoCoordinate_single(object,m_frameinfo.Photoinfo[0],m_frameinfo.m_Camera,m_frameinfo.Photoinfo[0].m_Rm);
-                                    image = PhotoToImage_single(photo, m_frameinfo.m_Camera.m_CCDSize, m_frameinfo.m_Camera.m_ImageSize);
-                                }
-                                
-                                temp_pt     = OriginalToPyramid_single(image, startpos, impyramid_step);
-                                
-                                t_col       = temp_pt.m_X;
-                                t_row       = temp_pt.m_Y;
-                                
-                                t_col_int   = (long int)(t_col + 0.01);
-                                t_row_int   = (long int)(t_row + 0.01);
-                                
-                                double dcol        = t_col - t_col_int;
-                                double drow        = t_row - t_row_int;
-                                
-                                if(t_col_int >= 0 && t_col_int +1 < Image_size.width && t_row_int >= 0 && t_row_int +1 < Image_size.height
-                                   && (t_col_int +1) + (t_row_int +1)*(long)Image_size.width < data_length_image)
-                                {
-                                    double value1, value2, value3, value4;
-                                    long index1  = (t_col_int   ) + (t_row_int   )*(long)Image_size.width;
-                                    long index2  = (t_col_int +1) + (t_row_int   )*(long)Image_size.width;
-                                    long index3  = (t_col_int   ) + (t_row_int +1)*(long)Image_size.width;
-                                    long index4  = (t_col_int +1) + (t_row_int +1)*(long)Image_size.width;
-                                    
-                                    if(impyramid_step > 0)
-                                    {
-                                        value1      = pyimg[index1];
-                                        value2      = pyimg[index2];
-                                        value3      = pyimg[index3];
-                                        value4      = pyimg[index4];
-                                    }
-                                    else
-                                    {
-                                        value1      = subimage[index1];
-                                        value2      = subimage[index2];
-                                        value3      = subimage[index3];
-                                        value4      = subimage[index4];
-                                    }
+//grid, image window and pyramid of one image for the band starting at (minX, maxY). check_band is false when the band misses the image
+void LoadOrthoBand_ortho(OrthoImage *ortho, const TransParam param, const double *minmaxHeight, const double minX, const double maxY, const double Ortho_resolution, const long width, const long rows)
+{
+    SetOrthoBandGrid_ortho(&ortho->grid, ortho->sensor_type, param, ortho->m_frameinfo, ortho->RPCs, ortho->imageparam, minmaxHeight, minX, maxY, Ortho_resolution, width, rows);
+    
+    long cols[2], image_rows[2];
+    if(!GetOrthoBandWindow_ortho(ortho->grid, ortho->Imagesize, ortho->image_margin, cols, image_rows))
+        return;
+    
+    CSize subsetsize;
+    uint16 type(0);
+    ortho->subimage = Readtiff_T(ortho->ImageFilename,&ortho->Imagesize,cols,image_rows,&subsetsize,type);
+    
+    CSize data_size[2];
+    SetPySizes(data_size, subsetsize, ortho->py_step);
+    ortho->startpos.m_X       = (double)cols[0]/pwrtwo(ortho->py_step);      ortho->startpos.m_Y       = (double)image_rows[0]/pwrtwo(ortho->py_step);
+    
+    if(ortho->py_step > 0)
+        ortho->pyimg = Preprocessing_ortho(ortho->impyramid_step,data_size,ortho->subimage);
+    
+    ortho->Image_size = data_size[ortho->py_step];
+    ortho->check_band = true;
+}
 
-                                    value       = value1*(1-dcol)*(1-drow) + value2*dcol*(1-drow) + value3*(1-dcol)*drow + value4*dcol*drow;
-                                    
-                                    t_col_int       = (long )((col - OrthoBoundary[0])/Ortho_resolution + 0.01);
-                                    t_row_int       = (long )((OrthoBoundary[3] - row)/Ortho_resolution + 0.01);
-                                    index           = t_col_int + t_row_int*(long)Orthoimagesize.width;
-                                    
-                                    if(t_col_int >= 0 && t_col_int < Orthoimagesize.width && t_row_int >= 0 && t_row_int < Orthoimagesize.height && index >= 0 && index < data_length_ortho)
-                                        result_ortho[index] = value1;
-                                }
-                            }
-                        }
-                    }
-                    
-                    if(impyramid_step > 0)
-                        free(pyimg);
-                    
-                    free(subimage);
-                    
-                    delete[] data_size;
-                }
-                
-            }
-        }
-        RPCsFree(RPCs);
-        free(DEM_value);
-        
-        WriteGeotiff(OrthoGEOTIFFFilename, result_ortho, Orthoimagesize.width, Orthoimagesize.height, Ortho_resolution, OrthoBoundary[0], OrthoBoundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 12);
-        free(result_ortho);
-        
-        ET = time(0);
+//image coordinate of an object point (X,Y in the DEM projection)
+D2DPOINT GetOrthoImageCoord_ortho(const int sensor_type, const TransParam param, const FrameInfo &m_frameinfo, const double * const *RPCs, const double *imageparam, const double X, const double Y, const double Z)
+{
+    D3DPOINT object(X, Y, Z);
+    if(sensor_type == SB)
+    {
+        D2DPOINT objectXY;
+        objectXY.m_X  = X;
+        objectXY.m_Y  = Y;
         
-        gap = difftime(ET,ST);
-        printf("ortho finish(time[m] = %5.2f)!!\n",gap/60.0);
+        const D2DPOINT wgsPt = ps2wgs_single(param, objectXY);
+        object.m_X  = wgsPt.m_X;
+        object.m_Y  = wgsPt.m_Y;
+        return GetObjectToImageRPC_single(RPCs, 2, imageparam, object);
     }
     else
     {
-        printf("check overlap area between DEM and image, or match a projection type of input image based on DEM projection by adding '-projection' option\n");
-        RPCsFree(RPCs);
+        const D2DPOINT photo  = GetPhotoCoordinate_single(object,m_frameinfo.Photoinfo[0],m_frameinfo.m_Camera,m_frameinfo.Photoinfo[0].m_Rm);
+        return PhotoToImage_single(photo, m_frameinfo.m_Camera.m_CCDSize, m_frameinfo.m_Camera.m_ImageSize);
     }
+}
 
-    delete proinfo;
+//grid nodes of a band of rows starting at (minX, maxY), projected over the DEM height range of the band
+void SetOrthoBandGrid_ortho(OrthoBandGrid *grid, const int sensor_type, const TransParam param, const FrameInfo &m_frameinfo, const double * const *RPCs, const double *imageparam,
+const double *minmaxHeight, const double minX, const double maxY, const double Ortho_resolution, const long width, const long rows)
+{
+    grid->levels = (int)ceil((minmaxHeight[1] - minmaxHeight[0])/ORTHO_GRID_HEIGHT_STEP) + 1;
+    if(grid->levels < 2)
+        grid->levels = 2;
+    grid->height_start = minmaxHeight[0];
+    grid->height_step = ORTHO_GRID_HEIGHT_STEP;
+    
+    grid->cols = (width - 1)/ORTHO_GRID_SPACE + 2;
+    grid->rows = (rows - 1)/ORTHO_GRID_SPACE + 2;
+    const long num_nodes = grid->cols*grid->rows;
+    grid->image.resize(grid->levels*num_nodes);
+    grid->clamped.assign(num_nodes, 0);
+    
+#pragma omp parallel for schedule(guided)
+    for(long node = 0 ; node < grid->levels*num_nodes ; node++)
+    {
+        const int level = node/num_nodes;
+        const long n = node%num_nodes;
+        const double X = minX + (n%grid->cols)*ORTHO_GRID_SPACE*Ortho_resolution;
+        const double Y = maxY - (n/grid->cols)*ORTHO_GRID_SPACE*Ortho_resolution;
+        grid->image[node] = GetOrthoImageCoord_ortho(sensor_type, param, m_frameinfo, RPCs, imageparam, X, Y, grid->height_start + level*grid->height_step);
+    }
+    
+    if(sensor_type == SB)
+    {
+        const double max_line = RPCs[0][0] + RPCs[1][0]*1.2;
+        const double max_samp = RPCs[0][1] + RPCs[1][1]*1.2;
+        for(long node = 0 ; node < grid->levels*num_nodes ; node++)
+        {
+            const D2DPOINT &pt = grid->image[node];
+            if(pt.m_X <= 0 || pt.m_Y <= 0 || pt.m_X >= max_samp || pt.m_Y >= max_line)
+                grid->clamped[node%num_nodes] = 1;
+        }
+    }
+}
+
+//image window covering the grid nodes plus margin, clipped to the image. false when the band misses the image
+bool GetOrthoBandWindow_ortho(const OrthoBandGrid &grid, const CSize Imagesize, const int margin, long *cols, long *rows)
+{
+    double minmax[4] = {1.0e10, 1.0e10, -1.0e10, -1.0e10};
+    for(size_t n = 0 ; n < grid.image.size() ; n++)
+    {
+        const D2DPOINT &pt = grid.image[n];
+        if(minmax[0] > pt.m_X)
+            minmax[0] = pt.m_X;
+        if(minmax[1] > pt.m_Y)
+            minmax[1] = pt.m_Y;
+        if(minmax[2] < pt.m_X)
+            minmax[2] = pt.m_X;
+        if(minmax[3] < pt.m_Y)
+            minmax[3] = pt.m_Y;
+    }
+    
+    cols[0] = max(0.0, floor(minmax[0]) - margin);
+    rows[0] = max(0.0, floor(minmax[1]) - margin);
+    cols[1] = min((double)Imagesize.width, ceil(minmax[2]) + margin + 1);
+    rows[1] = min((double)Imagesize.height, ceil(minmax[3]) + margin + 1);
+    
+    return cols[0] < cols[1] && rows[0] < rows[1];
 }
 
 uint16 *Preprocessing_ortho(const uint8 py_level, CSize *data_size, uint16 *subimg)
@@ -10,11 +10,57 @@
 
 #include "SubFunctions.hpp"
 
+//the orthoimage is streamed in bands of GEOTIFF_TILE_SIZE rows; the blocks of a band are resampled in parallel.
+//image coordinates of RPC images are interpolated from a grid of ORTHO_GRID_SPACE pixels and ORTHO_GRID_HEIGHT_STEP meters
+#define ORTHO_BLOCK_SIZE 64
+#define ORTHO_GRID_SPACE 16
+#define ORTHO_GRID_HEIGHT_STEP 100.0
+#define ORTHO_IMAGE_MARGIN 4
+
+//image coordinates of the grid nodes of a band, one plane per height level over the DEM heights of the band.
+//nodes clamped to the image limits by the RPC are flagged, pixels next to them are projected directly
+typedef struct tagOrthoBandGrid {
+    long cols, rows;
+    int levels;
+    double height_start, height_step;
+    vector<D2DPOINT> image;
+    vector<uint8> clamped;
+} OrthoBandGrid;
+
+//one image of orthogeneration_multi with its output writer and the source data of the current band
+typedef struct tagOrthoImage {
+    char *ImageFilename;
+    char OrthoGEOTIFFFilename[500];
+    int sensor_type;
+    FrameInfo m_frameinfo;
+    double **RPCs;
+    double imageparam[2];
+    CSize Imagesize;
+    int impyramid_step, py_step, image_margin;
+    bool check_ortho;
+    GeotiffTileWriter writer;
+    uint16 *result_ortho;
+    
+    bool check_band;
+    OrthoBandGrid grid;
+    uint16 *subimage, *pyimg;
+    CSize Image_size;
+    D2DPOINT startpos;
+} OrthoImage;
+
 void orthogeneration(const TransParam _param, const ARGINFO args, char *ImageFilename, char *DEMFilename, const char *Outputpath, const int pair, const int DEM_divide, const double * const *Imageparams);
+void orthogeneration_multi(const TransParam _param, const ARGINFO args, char **ImageFilenames, const int *pairs, const int num_images, char *DEMFilename, const char *Outputpath, const int DEM_divide, const double * const *Imageparams);
+bool SetOrthoImage_ortho(OrthoImage *ortho, const TransParam _param, const ARGINFO args, char *ImageFilename, const char *Outputpath, const int pair, const int DEM_divide, const double * const *Imageparams,
+const CSize DEM_size, const double DEM_minX, const double DEM_maxY, const double DEM_resolution, const double Ortho_resolution);
+void LoadOrthoBand_ortho(OrthoImage *ortho, const TransParam param, const double *minmaxHeight, const double minX, const double maxY, const double Ortho_resolution, const long width, const long rows);
 bool SetOrthoBoundary_ortho(CSize *Imagesize, double *Boundary, const double * const *RPCs, const double gridspace, const CSize DEM_size, const double minX, const double maxY, const TransParam param, const double Ortho_resolution);
 bool SetDEMBoundary_ortho_photo(CSize *Imagesize, double *Boundary, const double gridspace, const CSize DEM_size, const double minX, const double maxY, const double Ortho_resolution, const EO Photo, const CAMERA_INFO m_Camera, const RM M);
 uint16 *subsetImage_ortho(int check_sensor_type,FrameInfo m_frameinfo, TransParam transparam, const double *Imageparam, double **RPCs, char *ImageFilename,
 double *subBoundary, double *minmaxHeight, D2DPOINT *startpos, CSize* subsetsize, bool *ret);
+D2DPOINT GetOrthoImageCoord_ortho(const int sensor_type, const TransParam param, const FrameInfo &m_frameinfo, const double * const *RPCs, const double *imageparam, const double X, const double Y, const double Z);
+void SetOrthoBandGrid_ortho(OrthoBandGrid *grid, const int sensor_type, const TransParam param, const FrameInfo &m_frameinfo, const double * const *RPCs, const double *imageparam,
+const double *minmaxHeight, const double minX, const double maxY, const double Ortho_resolution, const long width, const long rows);
+bool GetOrthoBandWindow_ortho(const OrthoBandGrid &grid, const CSize Imagesize, const int margin, long *cols, long *rows);
 uint16 *Preprocessing_ortho(const uint8 py_level, CSize *data_size, uint16 *subimg);
 
 #endif /* Orthogeneration_hpp */
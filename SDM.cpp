@@ -35,6 +35,8 @@ bool SDM_ortho(char* _filename, ARGINFO args, double** Coreg_param)
                 Rimageparam[1] = Coreg_param[1][1];
                 
                 proinfo.SDM_SS = args.SDM_SS;
+                proinfo.check_SDM_FFT = args.check_SDM_FFT;
+                proinfo.check_SDM_merge = args.check_SDM_merge;
                 proinfo.SDM_days = args.SDM_days;
                 proinfo.SDM_AS = args.SDM_AS;
                 
@@ -195,15 +197,12 @@ bool SDM_ortho(char* _filename, ARGINFO args, double** Coreg_param)
                 printf("proinfo res %f\n",proinfo.resolution);
                 int matching_number = 0;
                 Matching_SETSM_SDM(proinfo, param, Template_size, Rimageparam, Limagesize, Rimagesize, Boundary, GSD_image1, GSD_image2, &matching_number);
-                /*
-                int final_iteration = 3;
-                if(matching_number > 10)
+                if(proinfo.check_SDM_merge && matching_number > 10)
                 {
-                    printf("Tile merging start final iteration %d!!\n",final_iteration);
+                    printf("Tile merging start!!\n");
                     int buffer_tile = 0;
-                    double mt_grid_size = MergeTiles_SDM(proinfo,1,1,buffer_tile,final_iteration,param,pyramid_step);
+                    MergeTiles_SDM(proinfo,1,1,buffer_tile,param);
                 }
-                 */
                 fclose(pMetafile);
             }
         }
@@ -257,7 +256,7 @@ void Matching_SETSM_SDM(ProInfo proinfo, TransParam param, uint8 Template_size,
         
         printf("subsetimage level %d\n",proinfo.pyramid_level);
         
-        LevelInfo levelinfo = {NULL};
+        LevelInfo levelinfo = {};
         levelinfo.Boundary = subBoundary;
         levelinfo.Template_size = &Template_size;
         levelinfo.param = &param;
@@ -1151,9 +1150,19 @@ bool VerticalLineLocus_SDM(ProInfo proinfo, LevelInfo &plevelinfo, NCCresultSDM*
     printf("numofpts %d\t%d\t%d\tcoreg %f\t%f\n",numofpts,plevelinfo.Size_Grid2D->height,plevelinfo.Size_Grid2D->width,Coreg_param[0],Coreg_param[1]);
     const int reference_id = 0;
     const int target_id = 1;
+    
+    //the FFT search samples the target on its pixel grid, so it needs the target at the kernel resolution.
+    //its peak narrows the kernel search below to +-1 pixel, where the multi-scale NCC picks the final shift
+    const double im_resolution_mask = (gsd_image1.pro_GSD + gsd_image2.pro_GSD)/2.0;
+    const bool check_fft = proinfo.check_SDM_FFT && Pyramid_step >= SDM_FFT_LEVEL &&
+        fabs(im_resolution_mask/gsd_image2.col_GSD - 1.0) < 1e-3 && fabs(im_resolution_mask/gsd_image2.row_GSD - 1.0) < 1e-3;
+    if(check_fft)
+        printf("VerticalLineLocus_SDM : FFT shift search at level %d\n",Pyramid_step);
+    
 #pragma omp parallel
     {
         SetKernel rsetkernel(reference_id,target_id,Half_template_size);
+        SDMShiftFFT shift_fft;
 
 
 
@@ -1200,9 +1209,76 @@ bool VerticalLineLocus_SDM(ProInfo proinfo, LevelInfo &plevelinfo, NCCresultSDM*
                         plevelinfo.py_Images[rsetkernel.ti],
                         plevelinfo.py_MagImages[rsetkernel.ti]};
 
-                    for(int kernel_row = -kernel_size ; kernel_row <= kernel_size ; kernel_row++)
+                    int kernel_row_start = -kernel_size, kernel_row_end = kernel_size;
+                    int kernel_col_start = -kernel_size, kernel_col_end = kernel_size;
+                    if(check_fft)
+                    {
+                        const CSize LImagesize(plevelinfo.py_Sizes[reference_id][Pyramid_step]);
+                        const CSize RImagesize(plevelinfo.py_Sizes[target_id][Pyramid_step]);
+                        
+                        D2DPOINT temp_GP(plevelinfo.GridPts[pt_index]),temp_GP_R(plevelinfo.GridPts[pt_index]);
+                        
+                        D2DPOINT Left_Imagecoord        = GetObjectToImage_single(1,temp_GP,proinfo.LBoundary,proinfo.resolution);
+                        D2DPOINT Right_Imagecoord        = GetObjectToImage_single(1,temp_GP_R,proinfo.RBoundary,proinfo.resolution);
+                        
+                        D2DPOINT Left_Imagecoord_py     = OriginalToPyramid_single(Left_Imagecoord,plevelinfo.py_Startpos[reference_id],Pyramid_step);
+                        D2DPOINT Right_Imagecoord_py    = OriginalToPyramid_single(Right_Imagecoord,plevelinfo.py_Startpos[target_id],Pyramid_step);
+                        
+                        Right_Imagecoord_py.m_Y += (GridPT3[pt_index].row_shift + Coreg_param[0])/pwrtwo(Pyramid_step);
+                        Right_Imagecoord_py.m_X += (GridPT3[pt_index].col_shift + Coreg_param[1])/pwrtwo(Pyramid_step);
+                        
+                        shift_fft.Resize(Half_template_size, kernel_size);
+                        
+                        const int template_width = 2*Half_template_size + 1;
+                        for(int row = -Half_template_size; row <= Half_template_size ; row++)
+                        {
+                            for(int col = -Half_template_size; col <= Half_template_size ; col++)
+                            {
+                                D2DPOINT pos_left(Left_Imagecoord_py.m_X + col*im_resolution_mask/gsd_image1.col_GSD, Left_Imagecoord_py.m_Y + row*im_resolution_mask/gsd_image1.row_GSD);
+                                
+                                double left_patch = 0;
+                                if(pos_left.m_Y >= 0 && pos_left.m_Y + 1 < LImagesize.height && pos_left.m_X >= 0 && pos_left.m_X + 1 < LImagesize.width)
+                                {
+                                    const long int position = (long int) pos_left.m_X + (long int) pos_left.m_Y *(long int)LImagesize.width;
+                                    left_patch = InterpolatePatch(patch.left_image, position, LImagesize, pos_left.m_X - floor(pos_left.m_X), pos_left.m_Y - floor(pos_left.m_Y));
+                                }
+                                shift_fft.template_patch[(row + Half_template_size)*template_width + col + Half_template_size] = left_patch;
+                            }
+                        }
+                        
+                        const int half_search = Half_template_size + kernel_size;
+                        const int search_width = 2*half_search + 1;
+                        for(int row = -half_search; row <= half_search ; row++)
+                        {
+                            for(int col = -half_search; col <= half_search ; col++)
+                            {
+                                D2DPOINT pos_right(Right_Imagecoord_py.m_X + col, Right_Imagecoord_py.m_Y + row);
+                                
+                                double right_patch = 0;
+                                if(pos_right.m_Y >= 0 && pos_right.m_Y + 1 < RImagesize.height && pos_right.m_X >= 0 && pos_right.m_X + 1 < RImagesize.width)
+                                {
+                                    const long int position = (long int) pos_right.m_X + (long int) pos_right.m_Y *(long int)RImagesize.width;
+                                    right_patch = InterpolatePatch(patch.right_image, position, RImagesize, pos_right.m_X - floor(pos_right.m_X), pos_right.m_Y - floor(pos_right.m_Y));
+                                }
+                                shift_fft.search_patch[(row + half_search)*search_width + col + half_search] = right_patch;
+                            }
+                        }
+                        
+                        //incomplete patches keep the full search
+                        int shift_col, shift_row;
+                        double fft_ncc;
+                        if(shift_fft.FindShift(Half_template_size, kernel_size, shift_col, shift_row, fft_ncc))
+                        {
+                            kernel_row_start = max(-kernel_size, shift_row - 1);
+                            kernel_row_end = min(kernel_size, shift_row + 1);
+                            kernel_col_start = max(-kernel_size, shift_col - 1);
+                            kernel_col_end = min(kernel_size, shift_col + 1);
+                        }
+                    }
+
+                    for(int kernel_row = kernel_row_start ; kernel_row <= kernel_row_end ; kernel_row++)
                     {
-                        for(int kernel_col = -kernel_size ; kernel_col <= kernel_size ; kernel_col++)
+                        for(int kernel_col = kernel_col_start ; kernel_col <= kernel_col_end ; kernel_col++)
                         {
                             if(!check_false_h)
                             {
@@ -1229,8 +1305,6 @@ bool VerticalLineLocus_SDM(ProInfo proinfo, LevelInfo &plevelinfo, NCCresultSDM*
                                 double total_NCC = 0;
                                 double temp_INCC_roh = 0;
                                 
-                                double im_resolution_mask = (gsd_image1.pro_GSD + gsd_image2.pro_GSD)/2.0;
-                                
                                 for(int row = -Half_template_size; row <= Half_template_size ; row++)
                                 {
                                     for(int col = -Half_template_size; col <= Half_template_size ; col++)
@@ -1338,6 +1412,22 @@ long SelectMPs_SDM(ProInfo proinfo, LevelInfo &rlevelinfo, NCCresultSDM* roh_hei
     return count_MPs;
 }
 
+//final SDM products of a tile for MergeTiles_SDM: one raw float plane per product, north-up rows of the grid
+//described by the last line of headerinfo_row_%d_col_%d.txt
+static void SaveTilePlane_SDM(const char *save_filepath, const char *product, const int row, const int col, const float *plane, const CSize size)
+{
+    char t_str[500];
+    snprintf(t_str,sizeof(t_str),"%s/txt/tin_%s_row_%d_col_%d.bin",save_filepath,product,row,col);
+    FILE *pfile = fopen(t_str,"wb");
+    if(pfile)
+    {
+        fwrite(plane,sizeof(float),(long)size.width*(long)size.height,pfile);
+        fclose(pfile);
+    }
+    else
+        printf("cannot write %s\n",t_str);
+}
+
 void echoprint_Gridinfo_SDM(ProInfo proinfo, LevelInfo &rlevelinfo, int row, int col, int level, int iteration, UGRIDSDM *GridPT3)
 {
     uint8 prc_level = *rlevelinfo.Pyramid_step;
@@ -1384,6 +1474,8 @@ void echoprint_Gridinfo_SDM(ProInfo proinfo, LevelInfo &rlevelinfo, int row, int
     char DEM_str[500];
     sprintf(DEM_str, "%s/%s_roh.tif", proinfo.save_filepath, proinfo.Outputpath_name);
     WriteGeotiff(DEM_str, Roh, rlevelinfo.Size_Grid2D->width, rlevelinfo.Size_Grid2D->height, proinfo.DEM_resolution, rlevelinfo.Boundary[0], rlevelinfo.Boundary[3], rlevelinfo.param->projection, rlevelinfo.param->utm_zone, rlevelinfo.param->bHemisphere, 4);
+    if(proinfo.check_SDM_merge)
+        SaveTilePlane_SDM(proinfo.save_filepath, "roh", row, col, Roh, *rlevelinfo.Size_Grid2D);
     
     free(Roh);
 }
@@ -1483,6 +1575,12 @@ void echoprint_adjustXYZ(ProInfo proinfo, LevelInfo &rlevelinfo, int row, int co
         WriteGeotiff(DEM_str, VyShift, rlevelinfo.Size_Grid2D->width, rlevelinfo.Size_Grid2D->height, proinfo.DEM_resolution, rlevelinfo.Boundary[0], rlevelinfo.Boundary[3], rlevelinfo.param->projection, rlevelinfo.param->utm_zone, rlevelinfo.param->bHemisphere, 4);
         sprintf(DEM_str, "%s/%s_dmag.tif", proinfo.save_filepath, proinfo.Outputpath_name);
         WriteGeotiff(DEM_str, Mag, rlevelinfo.Size_Grid2D->width, rlevelinfo.Size_Grid2D->height, proinfo.DEM_resolution, rlevelinfo.Boundary[0], rlevelinfo.Boundary[3], rlevelinfo.param->projection, rlevelinfo.param->utm_zone, rlevelinfo.param->bHemisphere, 4);
+        
+        if(proinfo.check_SDM_merge)
+        {
+            SaveTilePlane_SDM(proinfo.save_filepath, "vx", row, col, VxShift, *rlevelinfo.Size_Grid2D);
+            SaveTilePlane_SDM(proinfo.save_filepath, "vy", row, col, VyShift, *rlevelinfo.Size_Grid2D);
+        }
     }
     
     free(VxShift);
@@ -1640,55 +1738,56 @@ void SetShiftFromTIN(const long numOfPts, const long numOfTri, UGRIDSDM *GridPT3
     
     uint8 *m_bHeight        = (uint8*)calloc(*rlevelinfo.Grid_length,sizeof(uint8));
     
-    for(long tcnt=0;tcnt<numOfTri;tcnt++)
+    TinTileBins bins;
+    SetTinTileBins(rlevelinfo, pts, numOfPts, tris, numOfTri, &bins, Total_Min_Z, Total_Max_Z);
+    
+#pragma omp parallel for schedule(dynamic,1)
+    for(long tile = 0 ; tile < (long)bins.tiles_x*(long)bins.tiles_y ; tile++)
     {
-        const UI3DPOINT t_tri(tris[tcnt]);
-        const int pdex0 = t_tri.m_X;
-        const int pdex1 = t_tri.m_Y;
-        const int pdex2 = t_tri.m_Z;
-        
-        if(pdex0 < numOfPts && pdex1 < numOfPts && pdex2 < numOfPts)
+        for(long k = bins.start[tile] ; k < bins.start[tile + 1] ; k++)
         {
-            D3DPOINT TriP1(pts[pdex0]);
-            D3DPOINT TriP2(pts[pdex1]);
-            D3DPOINT TriP3(pts[pdex2]);
+            const long tcnt = bins.tri_index[k];
             int PixelMinXY[2], PixelMaxXY[2];
-            double temp_MinZ, temp_MaxZ;
-            SetTinBoundary(rlevelinfo, TriP1, TriP2, TriP3, PixelMinXY, PixelMaxXY, Total_Min_Z, Total_Max_Z, temp_MinZ, temp_MaxZ);
+            if(!GetTinTileBox(bins, tile, tcnt, PixelMinXY, PixelMaxXY))
+                continue;
+            
+            const UI3DPOINT &t_tri = (tris[tcnt]);
+            const D3DPOINT &TriP1(pts[t_tri.m_X]);
+            const D3DPOINT &TriP2(pts[t_tri.m_Y]);
+            const D3DPOINT &TriP3(pts[t_tri.m_Z]);
+            const TinEdgeFunction edge(rlevelinfo, TriP1, TriP2, TriP3);
+            if(!edge.valid)
+                continue;
             
-            for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++)
+            for (long Row=PixelMinXY[1]; Row <= PixelMaxXY[1]; Row++)
             {
-                for (long Row=PixelMinXY[1]; Row <= PixelMaxXY[1]; Row++)
+                double E[3];
+                edge.SetRow(PixelMinXY[0], Row, E);
+                for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++, edge.NextCol(E))
                 {
                     long Index= (long)rlevelinfo.Size_Grid2D->width*Row + Col;
                     
-                    if(!m_bHeight[Index])
+                    if(!m_bHeight[Index] && edge.IsInside(E))
                     {
-                        float Z = -1000.0;
-                        bool rtn = false;
-                        
                         D3DPOINT CurGPXY((Col)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[0],(Row)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[1],0,0);
-                        rtn = IsTinInside(CurGPXY, TriP1, TriP2, TriP3, Z);
+                        float Z = edge.Height(CurGPXY.m_X, CurGPXY.m_Y);
                         
-                        if (rtn)
-                        {
-                            const double diff1 = SQRT(CurGPXY, TriP1, 2);
-                            const double diff2 = SQRT(CurGPXY, TriP2, 2);
-                            const double diff3 = SQRT(CurGPXY, TriP3, 2);
-                            
-                            if(diff1 == 0)
-                                Z    = TriP1.m_Z;
-                            else if(diff2 == 0)
-                                Z    = TriP2.m_Z;
-                            else if(diff3 == 0)
-                                Z    = TriP3.m_Z;
-                     
-                            m_bHeight[Index] = 1;
-                            if(!b_dir)
-                                GridPT3[Index].col_shift = Z;
-                            else
-                                GridPT3[Index].row_shift = Z;
-                        }
+                        const double diff1 = SQRT(CurGPXY, TriP1, 2);
+                        const double diff2 = SQRT(CurGPXY, TriP2, 2);
+                        const double diff3 = SQRT(CurGPXY, TriP3, 2);
+                        
+                        if(diff1 == 0)
+                            Z    = TriP1.m_Z;
+                        else if(diff2 == 0)
+                            Z    = TriP2.m_Z;
+                        else if(diff3 == 0)
+                            Z    = TriP3.m_Z;
+                 
+                        m_bHeight[Index] = 1;
+                        if(!b_dir)
+                            GridPT3[Index].col_shift = Z;
+                        else
+                            GridPT3[Index].row_shift = Z;
                     }
                 }
             }
@@ -1699,6 +1798,63 @@ void SetShiftFromTIN(const long numOfPts, const long numOfTri, UGRIDSDM *GridPT3
         free(m_bHeight);
 }
 
+//clipped (2*kernel_size+1)^2 box sums of a grid: running sums along each row, then running sums of those
+//down each band of rows
+static void BoxSum_SDM(const CSize size, const int kernel_size, const vector<double> &in, vector<double> &out)
+{
+    const long width = size.width;
+    const long height = size.height;
+    vector<double> row_sum(width*height);
+    out.resize(width*height);
+    
+#pragma omp parallel for schedule(static)
+    for(long r = 0 ; r < height ; r++)
+    {
+        const double *src = &in[r*width];
+        double *dst = &row_sum[r*width];
+        double sum = 0;
+        for(long c = 0 ; c <= kernel_size && c < width ; c++)
+            sum += src[c];
+        for(long c = 0 ; c < width ; c++)
+        {
+            dst[c] = sum;
+            if(c + kernel_size + 1 < width)
+                sum += src[c + kernel_size + 1];
+            if(c - kernel_size >= 0)
+                sum -= src[c - kernel_size];
+        }
+    }
+    
+    //each band pays one window initialization, so bands are kept well above the window height
+    const long band = max(64L, 4L*kernel_size);
+    const long num_bands = (height + band - 1)/band;
+#pragma omp parallel for schedule(static)
+    for(long b = 0 ; b < num_bands ; b++)
+    {
+        const long r_start = b*band;
+        const long r_end = min(height, r_start + band);
+        
+        vector<double> sum(width, 0);
+        for(long r = max(0L, r_start - kernel_size) ; r <= r_start + kernel_size && r < height ; r++)
+            for(long c = 0 ; c < width ; c++)
+                sum[c] += row_sum[r*width + c];
+        
+        for(long r = r_start ; r < r_end ; r++)
+        {
+            const double *add = r + kernel_size + 1 < height ? &row_sum[(r + kernel_size + 1)*width] : NULL;
+            const double *sub = r - kernel_size >= 0 ? &row_sum[(r - kernel_size)*width] : NULL;
+            for(long c = 0 ; c < width ; c++)
+            {
+                out[r*width + c] = sum[c];
+                if(add)
+                    sum[c] += add[c];
+                if(sub)
+                    sum[c] -= sub[c];
+            }
+        }
+    }
+}
+
 void shift_filtering(ProInfo proinfo, UGRIDSDM *GridPT3, LevelInfo &rlevelinfo)
 {
     const CSize gridsize(rlevelinfo.Size_Grid2D->width, rlevelinfo.Size_Grid2D->height);
@@ -1709,17 +1865,6 @@ void shift_filtering(ProInfo proinfo, UGRIDSDM *GridPT3, LevelInfo &rlevelinfo)
     float *temp_col_shift = (float*)malloc(sizeof(float)*data_length);
     float *temp_row_shift = (float*)malloc(sizeof(float)*data_length);
     
-    for(long r = 0 ; r < gridsize.height ; r ++)
-    {
-        for(long c = 0 ; c < gridsize.width; c++)
-        {
-            long ori_index = r*(long)gridsize.width + c;
-            
-            temp_col_shift[ori_index] = GridPT3[ori_index].col_shift;
-            temp_row_shift[ori_index] = GridPT3[ori_index].row_shift;
-        }
-    }
-    
     int da = 45;
     if(pyramid_step == 3)
         da = 30;
@@ -1731,6 +1876,7 @@ void shift_filtering(ProInfo proinfo, UGRIDSDM *GridPT3, LevelInfo &rlevelinfo)
     printf("angle step %d\t%d\n",slope_step,data_length);
     
     const int shift_max_pixel = (int)(((double)(proinfo.SDM_AS * proinfo.SDM_days) / (proinfo.resolution)) );
+    const int hist_size = 6000;
     
     int kernal_size = 1;
     if(DEM_resolution == 1)
@@ -1749,366 +1895,208 @@ void shift_filtering(ProInfo proinfo, UGRIDSDM *GridPT3, LevelInfo &rlevelinfo)
     if(kernal_size < (int)(t_Template_size/2.0))
         kernal_size = (int)(t_Template_size/2.0);
     
+    //per-cell terms shared by every window that covers the cell
+    vector<double> cell_roh(data_length);
+    vector<int> cell_slope(data_length);
+#pragma omp parallel for schedule(static)
+    for(long index = 0 ; index < data_length ; index++)
+    {
+        temp_col_shift[index] = GridPT3[index].col_shift;
+        temp_row_shift[index] = GridPT3[index].row_shift;
+        
+        cell_roh[index] = pow(3.0,GridPT3[index].ortho_ncc*10);
+        double slope = atan2((double)GridPT3[index].row_shift,(double)GridPT3[index].col_shift)*RadToDeg;
+        if(slope < 0)
+            slope += 360;
+        cell_slope[index] = (int)(slope/da);
+    }
+    
+    //IDW distance terms of the kernel offsets. neighbours that agree with a histogram mode get the 0.1 distance
+    const double p = 1.5;
+    const int kernel_width = 2*kernal_size + 1;
+    const double pow_near = pow(0.1,p);
+    vector<double> pow_diff(kernel_width*kernel_width);
+    for(long k = -kernal_size ; k <= kernal_size ; k++)
+        for(long j = -kernal_size ; j <= kernal_size ; j++)
+            pow_diff[(k + kernal_size)*kernel_width + j + kernal_size] = (k == 0 && j == 0) ? pow_near : pow(sqrt(k*k + j*j)*2.0,p);
+    
+    int th_count = (int)(((kernal_size*2+1)*(kernal_size*2+1))/10.0);
+    if(th_count < 3 )
+        th_count = 3;
+    
     printf("level %d\tshift_max_pixel %d\n",proinfo.pyramid_level,shift_max_pixel);
-#pragma omp parallel for schedule(guided)
-    for(long iter_count = 0 ; iter_count < data_length ; iter_count ++)
+#pragma omp parallel
     {
-        long r = (floor(iter_count/gridsize.width));
-        long c = iter_count % gridsize.width;
-        long ori_index = r*(long)gridsize.width + c;
-        if(ori_index >= 0 && r >= 0 && r < gridsize.height && c >= 0 && c < gridsize.width && ori_index < data_length)
+        vector<int> hist_slope(slope_step, 0);
+        vector<int> hist_col(hist_size, 0), hist_row(hist_size, 0);
+        vector<int> used_col, used_row;
+        
+#pragma omp for schedule(guided)
+        for(long iter_count = 0 ; iter_count < data_length ; iter_count ++)
         {
-            vector<double> save_col, save_row, save_diff, save_slope, save_roh;
-            double save_col_min = 10000.;
-            double save_col_max = -10000.;
-            double save_row_min = 10000.;
-            double save_row_max = -10000.;
-            
-            int* hist_slope = (int*)calloc(sizeof(int),slope_step);
-            
-            int hist_col[6000] = {0};
-            int hist_col_id[6000];
-            int hist_row[6000] = {0};
-            int hist_row_id[6000];
-            
-            for(int k=0;k<3000;k++)
-            {
-                hist_col_id[k] = k;
-                hist_row_id[k] = k;
-            }
-            
-            long save_count = 0;
-            for(long k = -kernal_size ; k <= kernal_size ; k++)
-            {
-                for(long j=-kernal_size ; j <= kernal_size ; j++)
-                {
-                    long index = (r+k)*(long)gridsize.width + (c+j);
-                    if(r+k >= 0 && r+k < gridsize.height && c+j >= 0 && c+j < gridsize.width && index >= 0 && index < data_length)
-                    {
-                        save_col.push_back(GridPT3[index].col_shift);
-                        save_row.push_back(GridPT3[index].row_shift);
-                        save_diff.push_back(sqrt(k*k + j*j));
-                        save_slope.push_back(atan2(save_row[save_count],save_col[save_count])*RadToDeg);
-                        save_roh.push_back(pow(3.0,GridPT3[index].ortho_ncc*10));
-                        
-                        if(save_col[save_count] < save_col_min)
-                            save_col_min = save_col[save_count];
-                        
-                        if(save_col[save_count] > save_col_max)
-                            save_col_max = save_col[save_count];
-                        
-                        if(save_col[save_count] < save_row_min)
-                            save_row_min = save_col[save_count];
-                        
-                        if(save_col[save_count] > save_row_max)
-                            save_row_max = save_col[save_count];
-                        
-                        if(save_slope[save_count] < 0)
-                            save_slope[save_count] += 360;
-                        
-                        int t_hist = (int)(save_slope[save_count]/da);
-                        if(t_hist < slope_step)
-                            hist_slope[t_hist]++;
-                        else
-                            hist_slope[t_hist-1]++;
-                        
-                        t_hist = (int)(save_col[save_count]);
-                        if(abs(t_hist) < shift_max_pixel)
-                            hist_col[t_hist+shift_max_pixel]++;
-                        
-                        t_hist = (int)(save_row[save_count]);
-                        if(abs(t_hist) < shift_max_pixel)
-                            hist_row[t_hist+shift_max_pixel]++;
-                        
-                        save_count++;
-                    }
-                }
-            }
-   
-            save_count = save_col.size();
-            int th_count = (int)(((kernal_size*2+1)*(kernal_size*2+1))/10.0);
-            if(th_count < 3 )
-                th_count = 3;
-            if(save_count > th_count)
+            long r = (floor(iter_count/gridsize.width));
+            long c = iter_count % gridsize.width;
+            long ori_index = r*(long)gridsize.width + c;
+            if(ori_index >= 0 && r >= 0 && r < gridsize.height && c >= 0 && c < gridsize.width && ori_index < data_length)
             {
-                int max_hist = -1;
-                int max_hist_col = -1;
-                int max_hist_row = -1;
-                int min_hist_col = 10000;
-                int min_hist_row = 10000;
-                int max_hist_pos;
-                int max_hist_col_pos, max_hist_row_pos;
-                int min_hist_col_pos, min_hist_row_pos;
+                const long k_start = max(-(long)kernal_size, -r);
+                const long k_end = min((long)kernal_size, gridsize.height - 1 - r);
+                const long j_start = max(-(long)kernal_size, -c);
+                const long j_end = min((long)kernal_size, gridsize.width - 1 - c);
+                const long save_count = (k_end - k_start + 1)*(j_end - j_start + 1);
                 
-                for(int k=0;k<6000;k++)
+                if(save_count > th_count)
                 {
-                    if(max_hist_col < hist_col[k])
-                    {
-                        max_hist_col = hist_col[k];
-                        max_hist_col_pos = k;
-                    }
-                    
-                    if(max_hist_row < hist_row[k])
+                    //histograms of the shift directions and of the integer col/row shifts in the window
+                    for(long k = k_start ; k <= k_end ; k++)
                     {
-                        max_hist_row = hist_row[k];
-                        max_hist_row_pos = k;
-                    }
-                    
-                    if(min_hist_col > hist_col[k])
-                    {
-                        min_hist_col = hist_col[k];
-                        min_hist_col_pos = k;
-                    }
-                    
-                    if(min_hist_row > hist_row[k])
-                    {
-                        min_hist_row = hist_row[k];
-                        min_hist_row_pos = k;
+                        for(long j = j_start ; j <= j_end ; j++)
+                        {
+                            long index = (r+k)*(long)gridsize.width + (c+j);
+                            
+                            int t_hist = cell_slope[index];
+                            if(t_hist < slope_step)
+                                hist_slope[t_hist]++;
+                            else
+                                hist_slope[t_hist-1]++;
+                            
+                            t_hist = (int)(GridPT3[index].col_shift);
+                            if(abs(t_hist) < shift_max_pixel && t_hist+shift_max_pixel < hist_size)
+                            {
+                                if(hist_col[t_hist+shift_max_pixel]++ == 0)
+                                    used_col.push_back(t_hist+shift_max_pixel);
+                            }
+                            
+                            t_hist = (int)(GridPT3[index].row_shift);
+                            if(abs(t_hist) < shift_max_pixel && t_hist+shift_max_pixel < hist_size)
+                            {
+                                if(hist_row[t_hist+shift_max_pixel]++ == 0)
+                                    used_row.push_back(t_hist+shift_max_pixel);
+                            }
+                        }
                     }
                     
-                    if(k<slope_step)
+                    //modes, lowest bin on ties. an empty histogram has its mode at bin 0
+                    int max_hist = -1;
+                    int max_hist_pos = 0;
+                    for(int k = 0 ; k < slope_step ; k++)
                     {
                         if(max_hist < hist_slope[k])
                         {
                             max_hist = hist_slope[k];
                             max_hist_pos = k;
                         }
+                        hist_slope[k] = 0;
                     }
-                }
-          
-                vector<double> selected_col, selected_row, selected_diff_col, selected_diff_row, selected_roh;
-                
-                int total_seleted_count_col = 0;
-                int total_seleted_count_row = 0;
-                const double p = 1.5;
-                
-                for(long k= 0; k<save_count ; k++)
-                {
-                    int t_hist_col = (int)(save_col[k]);
-                    int t_hist_row = (int)(save_row[k]);
-                    int t_hist_slope = (int)(save_slope[k]/da);
                     
-                    if(pyramid_step >= 0 )
+                    int max_hist_col = 0;
+                    int max_hist_col_pos = 0;
+                    for(size_t k = 0 ; k < used_col.size() ; k++)
                     {
-                        //column
-                        selected_col.push_back(save_col[k]);
-                        selected_roh.push_back(save_roh[k]);
-                        if( save_diff[k] == 0)
-                            selected_diff_col.push_back(0.1);
-                        else
-                        {
-                            if( t_hist_col+3000 == max_hist_col_pos)
-                                selected_diff_col.push_back(0.1);
-                            else
-                            {
-                                if(t_hist_slope == max_hist_pos)
-                                    selected_diff_col.push_back(0.1);
-                                else
-                                    selected_diff_col.push_back(save_diff[k]*2.0);
-                            }
-                        }
-                        total_seleted_count_col++;
-                        
-                        //row
-                        selected_row.push_back(save_row[k]);
-                        if( save_diff[k] == 0)
-                            selected_diff_row.push_back(0.1);
-                        else
+                        const int bin = used_col[k];
+                        if(hist_col[bin] > max_hist_col || (hist_col[bin] == max_hist_col && bin < max_hist_col_pos))
                         {
-                            if( t_hist_row+3000 == max_hist_row_pos)
-                                selected_diff_row.push_back(0.1);
-                            else
-                            {
-                                if(t_hist_slope == max_hist_pos)
-                                    selected_diff_row.push_back(0.1);
-                                else
-                                    selected_diff_row.push_back(save_diff[k]*2.0);
-                            }
+                            max_hist_col = hist_col[bin];
+                            max_hist_col_pos = bin;
                         }
-                        total_seleted_count_row++;
+                        hist_col[bin] = 0;
                     }
-                    else
+                    used_col.clear();
+                    
+                    int max_hist_row = 0;
+                    int max_hist_row_pos = 0;
+                    for(size_t k = 0 ; k < used_row.size() ; k++)
                     {
-                        if(min_hist_col_pos == max_hist_col_pos || min_hist_row_pos == max_hist_row_pos)
-                        {
-                            selected_col.push_back(save_col[k]);
-                            selected_row.push_back(save_row[k]);
-                            selected_roh.push_back(save_roh[k]);
-                            
-                            if( save_diff[k] == 0)
-                            {
-                                selected_diff_col.push_back(0.1);
-                                selected_diff_row.push_back(0.1);
-                            }
-                            else
-                            {
-                                selected_diff_col.push_back(save_diff[k]);
-                                selected_diff_row.push_back(save_diff[k]);
-                            }
-                            total_seleted_count_col ++;
-                            total_seleted_count_row ++;
-                        }
-                        else if((t_hist_col+3000 != min_hist_col_pos || t_hist_row+3000 != min_hist_row_pos) )
+                        const int bin = used_row[k];
+                        if(hist_row[bin] > max_hist_row || (hist_row[bin] == max_hist_row && bin < max_hist_row_pos))
                         {
-                            selected_col.push_back(save_col[k]);
-                            selected_row.push_back(save_row[k]);
-                            selected_roh.push_back(save_roh[k]);
-                            
-                            if( save_diff[k] == 0)
-                            {
-                                selected_diff_col.push_back(0.1);
-                                selected_diff_row.push_back(0.1);
-                            }
-                            else
-                            {
-                                selected_diff_col.push_back(save_diff[k]);
-                                selected_diff_row.push_back(save_diff[k]);
-                            }
-                            total_seleted_count_col ++;
-                            total_seleted_count_row ++;
+                            max_hist_row = hist_row[bin];
+                            max_hist_row_pos = bin;
                         }
+                        hist_row[bin] = 0;
                     }
-                }
-                
-                //col
-                if(total_seleted_count_col > 0)
-                {
+                    used_row.clear();
+                    
+                    //IDW when one shift dominates the window, ncc-weighted average otherwise
+                    const bool check_idw_col = max_hist_col > save_count*0.4;
+                    const bool check_idw_row = max_hist_row > save_count*0.4;
                     double sum1 = 0;
                     double sum2 = 0;
                     double sum1_r = 0;
                     double sum2_r = 0;
-                    
-                    if(pyramid_step >= 0)
+                    for(long k = k_start ; k <= k_end ; k++)
                     {
-                        if((max_hist_col > save_count*0.4))
-                        {
-                            //IDW
-                            for(int k=0;k<total_seleted_count_col;k++)
-                            {
-                                sum1 += (selected_col[k]/pow(selected_diff_col[k],p))*selected_roh[k];
-                                sum2 += (1.0/pow(selected_diff_col[k],p))*selected_roh[k];
-                            }
-                            temp_col_shift[ori_index] = sum1/sum2;
-                        }
-                        else
+                        for(long j = j_start ; j <= j_end ; j++)
                         {
-                            //Average
-                            for(int k=0;k<total_seleted_count_col;k++)
+                            long index = (r+k)*(long)gridsize.width + (c+j);
+                            const double col_shift = GridPT3[index].col_shift;
+                            const double row_shift = GridPT3[index].row_shift;
+                            const double roh = cell_roh[index];
+                            
+                            if(check_idw_col || check_idw_row)
                             {
-                                sum1 += selected_col[k]*selected_roh[k];
-                                sum2 += selected_roh[k];
+                                const double pow_far = pow_diff[(k + kernal_size)*kernel_width + j + kernal_size];
+                                const bool check_slope = cell_slope[index] == max_hist_pos;
+                                if(check_idw_col)
+                                {
+                                    const double pow_col = (check_slope || (int)col_shift+3000 == max_hist_col_pos) ? pow_near : pow_far;
+                                    sum1 += (col_shift/pow_col)*roh;
+                                    sum2 += (1.0/pow_col)*roh;
+                                }
+                                if(check_idw_row)
+                                {
+                                    const double pow_row = (check_slope || (int)row_shift+3000 == max_hist_row_pos) ? pow_near : pow_far;
+                                    sum1_r += (row_shift/pow_row)*roh;
+                                    sum2_r += (1.0/pow_row)*roh;
+                                }
                             }
-                            temp_col_shift[ori_index] = sum1/sum2;
-                        }
-                    }
-                    else
-                    {
-                        //Average
-                        for(int k=0;k<total_seleted_count_col;k++)
-                        {
-                            sum1 += selected_col[k]*selected_roh[k];
-                            sum2 += selected_roh[k];
-                        }
-                        temp_col_shift[ori_index] = sum1/sum2;
-                    }
-                }
-                
-                //row
-                if(total_seleted_count_row > 0)
-                {
-                    double sum1, sum2, sum1_r, sum2_r;;
-                    
-                    sum1 = 0;
-                    sum2 = 0;
-                    sum1_r = 0;
-                    sum2_r = 0;
-                    
-                    if((int)pyramid_step >= 0)
-                    {
-                        if((max_hist_row > save_count*0.4))
-                        {
-                            //IDW
-                            for(int k=0;k<total_seleted_count_row;k++)
+                            
+                            if(!check_idw_col)
                             {
-                                sum1_r += (selected_row[k]/pow(selected_diff_row[k],p))*selected_roh[k];
-                                sum2_r += (1.0/pow(selected_diff_row[k],p))*selected_roh[k];
+                                sum1 += col_shift*roh;
+                                sum2 += roh;
                             }
-                            temp_row_shift[ori_index] = sum1_r/sum2_r;
-                            
-                        }
-                        else
-                        {
-                            //Average
-                            for(int k=0;k<total_seleted_count_row;k++)
+                            if(!check_idw_row)
                             {
-                                sum1_r += selected_row[k]*selected_roh[k];
-                                sum2_r += selected_roh[k];
+                                sum1_r += row_shift*roh;
+                                sum2_r += roh;
                             }
-                            temp_row_shift[ori_index] = sum1_r/sum2_r;
                         }
                     }
-                    else
-                    {
-                        //Average
-                        for(int k=0;k<total_seleted_count_row;k++)
-                        {
-                            sum1_r += selected_row[k]*selected_roh[k];
-                            sum2_r += selected_roh[k];
-                        }
-                        temp_row_shift[ori_index] = sum1_r/sum2_r;
-                    }
+                    
+                    temp_col_shift[ori_index] = sum1/sum2;
+                    temp_row_shift[ori_index] = sum1_r/sum2_r;
                 }
-                selected_col.clear();
-                selected_row.clear();
-                selected_diff_col.clear();
-                selected_diff_row.clear();
-                selected_roh.clear();
-                
             }
-            save_col.clear();
-            save_row.clear();
-            save_diff.clear();
-            save_slope.clear();
-            save_roh.clear();
-            free(hist_slope);
         }
     }
     
     printf("start assign\n");
-#pragma omp parallel for schedule(guided)
+    //box mean of the filtered shifts, clipped at the grid edges
+    vector<double> shift_sum(data_length), box_col, box_row;
+    for(long index = 0 ; index < data_length ; index++)
+        shift_sum[index] = temp_col_shift[index];
+    BoxSum_SDM(gridsize, kernal_size, shift_sum, box_col);
+    for(long index = 0 ; index < data_length ; index++)
+        shift_sum[index] = temp_row_shift[index];
+    BoxSum_SDM(gridsize, kernal_size, shift_sum, box_row);
+    
+#pragma omp parallel for schedule(static)
     for(long iter_count = 0 ; iter_count < data_length ; iter_count ++)
     {
         long r = (floor(iter_count/gridsize.width));
         long c = iter_count % gridsize.width;
         long ori_index = r*(long)gridsize.width + c;
-    
-        double sum_c = 0;
-        double sum_r = 0;
-        int count_cr = 0;
-    
-        for(long k = -kernal_size ; k <= kernal_size ; k++)
-        {
-            for(long j=-kernal_size ; j <= kernal_size ; j++)
-            {
-                long index = (r+k)*(long)gridsize.width + (c+j);
-                if(r+k >= 0 && r+k < gridsize.height && c+j >= 0 && c+j < gridsize.width  && index >= 0 && index < data_length)
-                {
-                    sum_c += temp_col_shift[index];
-                    sum_r += temp_row_shift[index];
-                    count_cr ++;
-                }
-            }
-        }
         
-        GridPT3[ori_index].col_shift = sum_c/count_cr;
-        GridPT3[ori_index].row_shift = sum_r/count_cr;
+        const long count_cr = (min((long)kernal_size, gridsize.height - 1 - r) + min((long)kernal_size, r) + 1)*
+            (min((long)kernal_size, gridsize.width - 1 - c) + min((long)kernal_size, c) + 1);
+        
+        GridPT3[ori_index].col_shift = box_col[ori_index]/count_cr;
+        GridPT3[ori_index].row_shift = box_row[ori_index]/count_cr;
     }
     
-    printf("before free col_shift\n");
     free(temp_col_shift);
-    printf("free col_shift\n");
     free(temp_row_shift);
-    printf("free row_shift\n");
     printf("end updating grid set shift \n");
 }
 
@@ -2152,314 +2140,249 @@ bool average_filter_colrowshift(CSize Size_Grid2D, UGRIDSDM *GridPT3,uint8 Pyram
     else if(Pyramid_step == 0)
         kernel_size = 5;
     
+    //only cells above 0.5 contribute and only cells below 0.4 are updated, so the window sums
+    //can all be taken from the grid before the update
+    const long data_length = (long)Size_Grid2D.height*(long)Size_Grid2D.width;
+    vector<double> sum_col(data_length), sum_row(data_length), sum_weight(data_length), sum_count(data_length);
+#pragma omp parallel for schedule(static)
+    for(long index = 0 ; index < data_length ; index++)
+    {
+        const bool check_valid = GridPT3[index].ortho_ncc > 0.5;
+        sum_col[index] = check_valid ? GridPT3[index].col_shift*GridPT3[index].ortho_ncc : 0;
+        sum_row[index] = check_valid ? GridPT3[index].row_shift*GridPT3[index].ortho_ncc : 0;
+        sum_weight[index] = check_valid ? GridPT3[index].ortho_ncc : 0;
+        sum_count[index] = check_valid ? 1 : 0;
+    }
+    
+    vector<double> box_col, box_row, box_weight, box_count;
+    BoxSum_SDM(Size_Grid2D, kernel_size, sum_col, box_col);
+    BoxSum_SDM(Size_Grid2D, kernel_size, sum_row, box_row);
+    BoxSum_SDM(Size_Grid2D, kernel_size, sum_weight, box_weight);
+    BoxSum_SDM(Size_Grid2D, kernel_size, sum_count, box_count);
     
-#pragma omp parallel for schedule(guided)
-    for(int iter_count = 0 ; iter_count < Size_Grid2D.height*Size_Grid2D.width ; iter_count++)
+#pragma omp parallel for schedule(static)
+    for(long pt_index = 0 ; pt_index < data_length ; pt_index++)
     {
-        int pts_row = (int)(floor(iter_count/Size_Grid2D.width));
-        int pts_col = iter_count % Size_Grid2D.width;
-        int pt_index;
-        pt_index = pts_row*Size_Grid2D.width + pts_col;
-        
-        if(pt_index < Size_Grid2D.width * Size_Grid2D.height && pts_row < Size_Grid2D.height && pts_col < Size_Grid2D.width && pts_row >= 0 && pts_col >= 0)
+        if(GridPT3[pt_index].ortho_ncc < 0.4 && box_count[pt_index] > 1.5)
         {
-            double sum_c = 0;
-            double sum_r = 0;
-            double weight = 0;
-            int count_cr=0;
-            
-            if(GridPT3[pt_index].ortho_ncc < 0.4)
-            {
-                for(int k = -kernel_size ; k <= kernel_size ; k++)
-                {
-                    for(int j=-kernel_size ; j <= kernel_size ; j++)
-                    {
-                        int index = (pts_row+k)*Size_Grid2D.width + (pts_col+j);
-                        
-                        if(pts_row+k >= 0 && pts_row+k < Size_Grid2D.height && pts_col+j >= 0 && pts_col+j < Size_Grid2D.width && index >= 0 && index < Size_Grid2D.height*Size_Grid2D.width)
-                        {
-                            if(GridPT3[index].ortho_ncc > 0.5)
-                            {
-                                sum_c += GridPT3[index].col_shift*GridPT3[index].ortho_ncc;
-                                sum_r += GridPT3[index].row_shift*GridPT3[index].ortho_ncc;
-                                count_cr ++;
-                                weight += GridPT3[index].ortho_ncc;
-                            }
-                        }
-                    }
-                }
-                
-                if(count_cr > 1)
-                {
-                    GridPT3[pt_index].col_shift = sum_c/weight;
-                    GridPT3[pt_index].row_shift = sum_r/weight;
-                }
-            }
-            
+            GridPT3[pt_index].col_shift = box_col[pt_index]/box_weight[pt_index];
+            GridPT3[pt_index].row_shift = box_row[pt_index]/box_weight[pt_index];
         }
     }
     
-    
     return true;
 }
 
-double MergeTiles_SDM(ProInfo info,int iter_row_end,int t_col_end, int buffer,int final_iteration,TransParam _param, uint8 pyramid_step)
+//tile of the final SDM grid as described by its headerinfo file, with the product planes of SaveTilePlane_SDM
+struct SDMTileHeader {
+    int row, col;
+    double boundary[4];
+    int col_size, row_size;
+};
+
+//output bands filled in parallel before they are written in order
+#define SDM_MERGE_BANDS 4
+
+double MergeTiles_SDM(ProInfo info,int iter_row_end,int t_col_end, int buffer,TransParam _param)
 {
-    FILE *poutDEM;
-    FILE *poutMatchtag;
-    FILE *poutheader;
-    FILE *poutrowshift;
-    FILE *poutcolshift;
-    FILE *poutvxshift;
-    FILE *poutvyshift;
-    
-    int header_line = pyramid_step+3;
-    int row,col;
+    const char *products[3] = {"vx", "vy", "roh"};
     int row_end = iter_row_end;
     int col_end = t_col_end;
-    int find_level = 0;
-    int find_iter  = final_iteration;
-    long int size;
-    double grid_size;
+    double grid_size = 0;
     
-    CSize DEM_size, DEMinter_size;
+    CSize DEM_size;
     
     double boundary[4];
-    
-    //double *DEM, *DEMinter;
-    //float *ColShift, *RowShift, *VxShift, *VyShift, *Roh;
-    float *Mag, *VxShift, *VyShift, *Roh;
-    //bool *Matchtag;
     char DEM_str[500];
     
-    bool check_gs = false;
-    
     //find boundary of DEM
     boundary[0] = 10000000.0;
     boundary[1] = 10000000.0;
     boundary[2] = -10000000.0;
     boundary[3] = -10000000.0;
     
+    vector<SDMTileHeader> tiles;
     for(long index_file = 0 ; index_file < row_end*col_end ; index_file++)
     {
         int row,col;
         
-        row = (int)(floor(index_file/col_end));
-        col = index_file%col_end;
+        row = (int)(floor(index_file/col_end)) + 1;
+        col = index_file%col_end + 1;
         
-        FILE *pfile;
         char t_str[500];
+        bool check_planes = true;
+        for(int p = 0 ; p < 3 ; p++)
+        {
+            snprintf(t_str,sizeof(t_str),"%s/txt/tin_%s_row_%d_col_%d.bin",info.save_filepath,products[p],row,col);
+            FILE *pfile = fopen(t_str,"rb");
+            if(pfile)
+                fclose(pfile);
+            else
+                check_planes = false;
+        }
         
-        sprintf(t_str,"%s/txt/tin_xshift_level_1_1_0_iter_3_final.txt",info.save_filepath);
-        printf("%s\n",t_str);
-        //sprintf(t_str,"%s/txt/matched_pts_%d_%d_%d_%d.txt",info.save_filepath,row,col,find_level,find_iter);
-        //sprintf(t_str,"%s/txt/col_shift_%d_%d_%d_%d.txt",info.save_filepath,find_level,find_iter,row,col);
-        pfile    = fopen(t_str,"r");
-        if(pfile)
+        char h_t_str[500];
+        snprintf(h_t_str,sizeof(h_t_str),"%s/txt/headerinfo_row_%d_col_%d.txt",info.save_filepath,row,col);
+        FILE *p_hfile = check_planes ? fopen(h_t_str,"r") : NULL;
+        if(p_hfile)
         {
-            fseek(pfile,0,SEEK_END);
-            size = ftell(pfile);
-            if(size > 0)
+            printf("%s\n",h_t_str);
+            SDMTileHeader tile;
+            int t_row,t_col,t_level;
+            double t_grid_size;
+            while(!feof(p_hfile))
             {
-                char h_t_str[500];
-                FILE *p_hfile;
-                //sprintf(h_t_str,"%s/txt/headerinfo_row_%d_col_%d.txt",info.save_filepath,row,col,find_level,find_iter);
-                sprintf(h_t_str,"%s/txt/headerinfo_row_%d_col_%d.txt",info.save_filepath,row,col);
-                
-                p_hfile        = fopen(h_t_str,"r");
-                if(p_hfile)
-                {
-                    printf("%s\n",h_t_str);
-                    int t_row,t_col,t_level,t_col_size,t_row_size;
-                    double t_grid_size;
-                    double t_boundary[4];
-                    while(!feof(p_hfile))
-                    {
-                        fscanf(p_hfile,"%d\t%d\t%d\t%lf\t%lf\t%lf\t%d\t%d\n", &t_row,&t_col,&t_level,&t_boundary[0],&t_boundary[1],&t_grid_size,&t_col_size,&t_row_size);
-                    }
-                    
-                    grid_size = t_grid_size;
-                    t_boundary[2] = t_boundary[0] + t_grid_size*t_col_size;
-                    t_boundary[3] = t_boundary[1] + t_grid_size*t_row_size;
-                    
-                    {
-                        if(boundary[0] > t_boundary[0])
-                            boundary[0]        = t_boundary[0];
-                        if(boundary[1] > t_boundary[1])
-                            boundary[1]        = t_boundary[1];
-                        
-                        if(boundary[2] < t_boundary[2])
-                            boundary[2]        = t_boundary[2];
-                        if(boundary[3] < t_boundary[3])
-                            boundary[3]        = t_boundary[3];
-                    }
-                    
-                    fclose(p_hfile);
-                }
+                fscanf(p_hfile,"%d\t%d\t%d\t%lf\t%lf\t%lf\t%d\t%d\n", &t_row,&t_col,&t_level,&tile.boundary[0],&tile.boundary[1],&t_grid_size,&tile.col_size,&tile.row_size);
             }
-            fclose(pfile);
+            fclose(p_hfile);
+            
+            grid_size = t_grid_size;
+            tile.row = row;
+            tile.col = col;
+            tile.boundary[2] = tile.boundary[0] + t_grid_size*tile.col_size;
+            tile.boundary[3] = tile.boundary[1] + t_grid_size*tile.row_size;
+            tiles.push_back(tile);
+            
+            if(boundary[0] > tile.boundary[0])
+                boundary[0]        = tile.boundary[0];
+            if(boundary[1] > tile.boundary[1])
+                boundary[1]        = tile.boundary[1];
+            
+            if(boundary[2] < tile.boundary[2])
+                boundary[2]        = tile.boundary[2];
+            if(boundary[3] < tile.boundary[3])
+                boundary[3]        = tile.boundary[3];
         }
     }
     
+    if(tiles.size() == 0)
+    {
+        printf("no SDM tile to merge\n");
+        return grid_size;
+    }
+    
     printf("boundary %f\t%f\t%f\t%f\n",boundary[0],boundary[1],boundary[2],boundary[3]);
-    check_gs = false;
     
     buffer    = (int)(floor(buffer/grid_size));
     
     DEM_size.width        = (int)(ceil( (double)(boundary[2] - boundary[0]) /grid_size ));
     DEM_size.height        = (int)(ceil( (double)(boundary[3] - boundary[1]) /grid_size ));
     
-    //ColShift = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    //RowShift = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    Mag = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    VxShift = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    VyShift = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    Roh = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
+    printf("dem size %d\t%d\n",DEM_size.width,DEM_size.height);
     
-    float *Vxsigma = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
-    float *Vysigma = (float*)calloc(DEM_size.height*DEM_size.width,sizeof(float));
+    //dx, dy, dmag, roh
+    const char *out_names[4] = {"dx", "dy", "dmag", "roh"};
+    GeotiffTileWriter writers[4];
+    bool check_open = true;
+    for(int p = 0 ; p < 4 ; p++)
+    {
+        snprintf(DEM_str,sizeof(DEM_str), "%s/%s_%s.tif", info.save_filepath, info.Outputpath_name, out_names[p]);
+        writers[p].tif = NULL;
+        writers[p].gtif = NULL;
+        if(!OpenGeotiffTileWriter(DEM_str, &writers[p], DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4))
+            check_open = false;
+    }
     
-    printf("dem size %d\t%d\n",DEM_size.width,DEM_size.height);
+    //the output is assembled one band of tile rows at a time, each band reading only the tile rows it covers
+    const long width = DEM_size.width;
+    const long band_rows = GEOTIFF_TILE_SIZE;
+    const long band_length = band_rows*width;
+    const long num_bands = (DEM_size.height + band_rows - 1)/band_rows;
+    vector<float> band_data(check_open ? (size_t)SDM_MERGE_BANDS*4*band_length : 0);
     
-    //setting DEM value
-    for(long index_file = 0 ; index_file < row_end*col_end ; index_file++)
+    for(long band_start = 0 ; band_start < num_bands && check_open ; band_start += SDM_MERGE_BANDS)
     {
-        int row,col;
-        FILE *pfile;
-        char t_str[500];
-        
-        row = (int)(floor(index_file/col_end));
-        col = index_file%col_end;
+        const long band_end = min(num_bands, band_start + SDM_MERGE_BANDS);
         
-        sprintf(t_str,"%s/txt/tin_xshift_level_1_1_0_iter_3_final.txt",info.save_filepath);
-        printf("%s\n",t_str);
-        //sprintf(t_str,"%s/txt/col_shift_%d_%d_%d_%d.txt",info.save_filepath,find_level,find_iter,row,col);
-        pfile    = fopen(t_str,"r");
-        if(pfile)
+#pragma omp parallel for schedule(dynamic,1)
+        for(long b = band_start ; b < band_end ; b++)
         {
-            fseek(pfile,0,SEEK_END);
-            size = ftell(pfile);
-            fseek(pfile,0L,SEEK_SET);
-            if(size > 0)
+            float *VxShift = &band_data[(b - band_start)*4*band_length];
+            float *VyShift = VxShift + band_length;
+            float *Mag = VyShift + band_length;
+            float *Roh = Mag + band_length;
+            for(long i = 0 ; i < 4*band_length ; i++)
+                VxShift[i] = 0;
+            
+            const long r_start = b*band_rows;
+            const long r_end = min((long)DEM_size.height, r_start + band_rows);
+            
+            vector<float> planes;
+            for(size_t t = 0 ; t < tiles.size() ; t++)
             {
-                char h_t_str[500];
-                FILE *p_hfile, *p_hvfile, *p_cshift, *p_rshift, *p_vxshift, *p_vyshift, *p_roh, *p_mag;
+                const SDMTileHeader &tile = tiles[t];
+                const long tile_top = (long)((boundary[3] - tile.boundary[3])/grid_size + 0.5);
+                const long tile_left = (long)((tile.boundary[0] - boundary[0])/grid_size + 0.5);
+                const long pr_start = max(0L, r_start - tile_top);
+                const long pr_end = min((long)tile.row_size, r_end - tile_top);
+                if(pr_start >= pr_end)
+                    continue;
                 
-                sprintf(h_t_str,"%s/txt/headerinfo_row_%d_col_%d.txt",info.save_filepath,row,col);
-                p_hfile        = fopen(h_t_str,"r");
-                printf("%s\n",h_t_str);
-                //if(p_hfile)
+                const long read_length = (pr_end - pr_start)*(long)tile.col_size;
+                planes.resize(3*read_length);
+                bool check_read = true;
+                for(int p = 0 ; p < 3 ; p++)
                 {
-                    int iter;
-                    char hv_t_str[500];
-                    int row_size,col_size;
-                    double t_boundary[4];
-                    int t_row,t_col,t_level;
-                    double t_grid_size;
-                    
-                    while(!feof(p_hfile))
+                    char t_str[500];
+                    snprintf(t_str,sizeof(t_str),"%s/txt/tin_%s_row_%d_col_%d.bin",info.save_filepath,products[p],tile.row,tile.col);
+                    FILE *pfile = fopen(t_str,"rb");
+                    if(pfile)
                     {
-                        fscanf(p_hfile,"%d\t%d\t%d\t%lf\t%lf\t%lf\t%d\t%d\n",  &t_row,&t_col,&t_level,&t_boundary[0],&t_boundary[1],&t_grid_size,&col_size,&row_size);
+                        fseek(pfile,sizeof(float)*pr_start*(long)tile.col_size,SEEK_SET);
+                        if(fread(&planes[p*read_length],sizeof(float),read_length,pfile) != (size_t)read_length)
+                            check_read = false;
+                        fclose(pfile);
                     }
+                    else
+                        check_read = false;
+                }
+                if(!check_read)
+                {
+                    printf("incomplete SDM tile %d\t%d\n",tile.row,tile.col);
+                    continue;
+                }
+                
+                for(long pr = pr_start ; pr < pr_end ; pr++)
+                {
+                    //buffer is counted from the tile edges, rows from the south like the header
+                    const long iter_row = tile.row_size - 1 - pr;
+                    if(iter_row <= buffer || iter_row >= tile.row_size - buffer)
+                        continue;
                     
-                    
-                    sprintf(hv_t_str,"%s/txt/tin_xshift_level_%d_%d_%d_iter_3_final.txt",info.save_filepath,row,col,find_level);
-                    p_vxshift    = fopen(hv_t_str,"r");
-                    sprintf(hv_t_str,"%s/txt/tin_yshift_level_%d_%d_%d_iter_3_final.txt",info.save_filepath,row,col,find_level);
-                    p_vyshift    = fopen(hv_t_str,"r");
-                    /*
-                    sprintf(hv_t_str,"%s/txt/tin_xsigma_level_%d_%d_%d_iter_3_final.txt",info.save_filepath,row,col,find_level);
-                    p_cshift    = fopen(hv_t_str,"r");
-                    sprintf(hv_t_str,"%s/txt/tin_ysigma_level_%d_%d_%d_iter_3_final.txt",info.save_filepath,row,col,find_level);
-                    p_rshift    = fopen(hv_t_str,"r");
-                    */
-                    sprintf(hv_t_str,"%s/txt/tin_roh_level_%d_%d_%d_iter_3_final.txt",info.save_filepath,row,col,find_level);
-                    p_roh    = fopen(hv_t_str,"r");
-                    //if(p_hvfile)
+                    for(long iter_col = buffer + 1 ; iter_col < tile.col_size - buffer ; iter_col++)
                     {
-                        int index_total;
-                        for(index_total = 0; index_total < row_size*col_size ; index_total++)
-                        {
-                            int iter_row,iter_col;
-                            iter_row = floor(index_total/col_size);
-                            iter_col = index_total%col_size;
-                            {
-                                
-                                double t_col = ( (double)(t_boundary[0] + grid_size*iter_col - boundary[0])  /grid_size);
-                                double t_row = ( (double)(boundary[3] - (t_boundary[1] + grid_size*iter_row))/grid_size);
-                                int index = (int)(t_row*DEM_size.width + t_col + 0.01);
-                                
-                                double DEM_value;
-                                double Col_value, Row_value, Vx_value, Vy_value, Roh_value;
-                                
-                                //fscanf(p_cshift,"%lf\t",&Col_value);
-                                //fscanf(p_rshift,"%lf\t",&Row_value);
-                                
-                                fscanf(p_vxshift,"%lf\t",&Vx_value);
-                                fscanf(p_vyshift,"%lf\t",&Vy_value);
-                                fscanf(p_roh,"%lf\t",&Roh_value);
-                                
-                                
-                                if(index >= 0 && index < DEM_size.width*DEM_size.height &&
-                                   iter_row > buffer && iter_row < row_size - buffer &&
-                                   iter_col > buffer && iter_col < col_size - buffer)
-                                {
-                                    
-                                    //if(fabs(Col_value) < 1000)
-                                    //    Vxsigma[index] = Col_value;
-                                    //if(fabs(Row_value) < 1000)
-                                     //   Vysigma[index] = Row_value;
-                                    
-                                    //if(fabs(Vx_value) < 1000)
-                                        VxShift[index] = Vx_value;
-                                    //if(fabs(Vy_value) < 1000)
-                                        VyShift[index] = Vy_value;
-                                    Roh[index] = Roh_value;
-                                    Mag[index] = sqrt(Vx_value*Vx_value + Vy_value*Vy_value);
-                                }
-                            }
-                            //fscanf(p_cshift,"\n");
-                            //fscanf(p_rshift,"\n");
-                            fscanf(p_vxshift,"\n");
-                            fscanf(p_vyshift,"\n");
-                            fscanf(p_roh,"\n");
-                        }
-                 
-                        //fclose(p_cshift);
-                        //fclose(p_rshift);
-                        fclose(p_vxshift);
-                        fclose(p_vyshift);
-                        fclose(p_roh);
+                        const long out_col = tile_left + iter_col;
+                        if(out_col < 0 || out_col >= width)
+                            continue;
+                        
+                        const long plane_index = (pr - pr_start)*(long)tile.col_size + iter_col;
+                        const long index = (tile_top + pr - r_start)*width + out_col;
+                        const double Vx_value = planes[plane_index];
+                        const double Vy_value = planes[read_length + plane_index];
+                        
+                        VxShift[index] = Vx_value;
+                        VyShift[index] = Vy_value;
+                        Roh[index] = planes[2*read_length + plane_index];
+                        Mag[index] = sqrt(Vx_value*Vx_value + Vy_value*Vy_value);
                     }
-                    
-                    fclose(p_hfile);
                 }
             }
-            fclose(pfile);
+        }
+        
+        for(long b = band_start ; b < band_end ; b++)
+        {
+            const long rows = min((long)DEM_size.height, (b + 1)*band_rows) - b*band_rows;
+            const float *band = &band_data[(b - band_start)*4*band_length];
+            //dx, dy, dmag, roh follow the band layout above
+            WriteGeotiffTileBand(&writers[0], band, rows);
+            WriteGeotiffTileBand(&writers[1], band + band_length, rows);
+            WriteGeotiffTileBand(&writers[2], band + 2*band_length, rows);
+            WriteGeotiffTileBand(&writers[3], band + 3*band_length, rows);
         }
     }
-    /*
-    sprintf(DEM_str, "%s/%s_dx_sigma.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, Vxsigma, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-    sprintf(DEM_str, "%s/%s_dy_sigma.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, Vysigma, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-     */
-    sprintf(DEM_str, "%s/%s_dx.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, VxShift, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-    sprintf(DEM_str, "%s/%s_dy.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, VyShift, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-    sprintf(DEM_str, "%s/%s_dmag.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, Mag, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-    sprintf(DEM_str, "%s/%s_roh.tif", info.save_filepath, info.Outputpath_name);
-    WriteGeotiff(DEM_str, Roh, DEM_size.width, DEM_size.height, grid_size, boundary[0], boundary[3], _param.projection, _param.utm_zone, _param.bHemisphere, 4);
-    
-    //free(Vxsigma);
-    //free(Vysigma);
     
-    free(VxShift);
-    free(VyShift);
-    free(Mag);
-    free(Roh);
+    for(int p = 0 ; p < 4 ; p++)
+        CloseGeotiffTileWriter(&writers[p]);
     
     return grid_size;
 }
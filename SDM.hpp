@@ -46,6 +46,6 @@ void echo_print_nccresults_SDM(char *save_path,int row,int col,int level, int it
 
 bool average_filter_colrowshift(CSize Size_Grid2D, UGRIDSDM *GridPT3,uint8 Pyramid_step);
 
-double MergeTiles_SDM(ProInfo info,int iter_row_end,int t_col_end, int buffer,int final_iteration,TransParam _param, uint8 pyramid_step);
+double MergeTiles_SDM(ProInfo info,int iter_row_end,int t_col_end, int buffer,TransParam _param);
 
 #endif /* SDM_hpp */
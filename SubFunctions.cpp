@@ -989,6 +989,181 @@ double Correlate(const double *L, const double *R, const int N)
     return rho;
 }
 
+// Correlate with the mean and sum of squared deviations of L already known
+double Correlate_ref(const double *L, const double *R, const int N, const double Lmean, const double SumL2)
+{
+    double rho;
+    
+    if(N > 0)
+    {
+        double Rmean = 0;
+        for (int i=0; i<N; i++)
+            Rmean += R[i];
+        Rmean = Rmean / N;
+        
+        double SumLR = 0;
+        double SumR2 = 0;
+        
+        for (int i=0; i<N; i++)
+        {
+            SumLR += (L[i]-Lmean)*(R[i]-Rmean);
+            SumR2 += (R[i]-Rmean)*(R[i]-Rmean);
+        }
+        
+        if (SumL2 > 1e-8  &&  SumR2 > 1e-8)
+            rho = SumLR / (sqrt(SumL2*SumR2));
+        else
+            rho = (double) -99;
+    }
+    else
+        rho = (double) -99;
+    
+    return rho;
+}
+
+//in-place radix-2 FFT of n (power of two) samples spaced stride apart
+void FFT_1D(std::complex<double> *data, const int n, const int stride, const bool inverse)
+{
+    for(int i = 1, j = 0 ; i < n ; i++)
+    {
+        int bit = n >> 1;
+        for( ; j & bit ; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        
+        if(i < j)
+            std::swap(data[i*stride], data[j*stride]);
+    }
+    
+    for(int len = 2 ; len <= n ; len <<= 1)
+    {
+        const double angle = 2*PI/len*(inverse ? 1 : -1);
+        const std::complex<double> wlen(cos(angle), sin(angle));
+        for(int i = 0 ; i < n ; i += len)
+        {
+            std::complex<double> w(1, 0);
+            for(int j = 0 ; j < len/2 ; j++)
+            {
+                const std::complex<double> u = data[(i + j)*stride];
+                const std::complex<double> v = data[(i + j + len/2)*stride]*w;
+                data[(i + j)*stride] = u + v;
+                data[(i + j + len/2)*stride] = u - v;
+                w *= wlen;
+            }
+        }
+    }
+    
+    if(inverse)
+    {
+        for(int i = 0 ; i < n ; i++)
+            data[i*stride] /= n;
+    }
+}
+
+//n x n row-major
+void FFT_2D(std::complex<double> *data, const int n, const bool inverse)
+{
+    for(int row = 0 ; row < n ; row++)
+        FFT_1D(data + row*n, n, 1, inverse);
+    for(int col = 0 ; col < n ; col++)
+        FFT_1D(data + col, n, n, inverse);
+}
+
+void SDMShiftFFT::Resize(const int Half_template_size, const int kernel_size)
+{
+    const int template_width = 2*Half_template_size + 1;
+    const int search_width = template_width + 2*kernel_size;
+    template_patch.resize(template_width*template_width);
+    search_patch.resize(search_width*search_width);
+}
+
+bool SDMShiftFFT::FindShift(const int Half_template_size, const int kernel_size, int &shift_col, int &shift_row, double &max_ncc)
+{
+    const int template_width = 2*Half_template_size + 1;
+    const int search_width = template_width + 2*kernel_size;
+    const int N = template_width*template_width;
+    
+    int fft_size = 1;
+    while(fft_size < search_width)
+        fft_size <<= 1;
+    
+    double mean = 0;
+    for(int i = 0 ; i < N ; i++)
+    {
+        if(template_patch[i] <= 0)
+            return false;
+        mean += template_patch[i];
+    }
+    mean /= N;
+    
+    double sum_T2 = 0;
+    for(int i = 0 ; i < N ; i++)
+        sum_T2 += (template_patch[i] - mean)*(template_patch[i] - mean);
+    if(sum_T2 < 1e-8)
+        return false;
+    
+    //integral images of the search area for the window mean and variance
+    const int sum_width = search_width + 1;
+    sum.assign(sum_width*sum_width, 0);
+    sum2.assign(sum_width*sum_width, 0);
+    for(int row = 0 ; row < search_width ; row++)
+    {
+        for(int col = 0 ; col < search_width ; col++)
+        {
+            const double value = search_patch[row*search_width + col];
+            if(value <= 0)
+                return false;
+            
+            const int index = (row + 1)*sum_width + col + 1;
+            sum[index] = value + sum[index - 1] + sum[index - sum_width] - sum[index - sum_width - 1];
+            sum2[index] = value*value + sum2[index - 1] + sum2[index - sum_width] - sum2[index - sum_width - 1];
+        }
+    }
+    
+    //cross-correlation of the zero-mean template with the search area. fft_size >= search_width, so no shift wraps
+    fft_template.assign(fft_size*fft_size, std::complex<double>(0, 0));
+    fft_search.assign(fft_size*fft_size, std::complex<double>(0, 0));
+    for(int row = 0 ; row < template_width ; row++)
+        for(int col = 0 ; col < template_width ; col++)
+            fft_template[row*fft_size + col] = template_patch[row*template_width + col] - mean;
+    for(int row = 0 ; row < search_width ; row++)
+        for(int col = 0 ; col < search_width ; col++)
+            fft_search[row*fft_size + col] = search_patch[row*search_width + col];
+    
+    FFT_2D(&fft_template[0], fft_size, false);
+    FFT_2D(&fft_search[0], fft_size, false);
+    for(int i = 0 ; i < fft_size*fft_size ; i++)
+        fft_search[i] *= std::conj(fft_template[i]);
+    FFT_2D(&fft_search[0], fft_size, true);
+    
+    bool check_find = false;
+    max_ncc = -1.0;
+    for(int row = 0 ; row <= 2*kernel_size ; row++)
+    {
+        for(int col = 0 ; col <= 2*kernel_size ; col++)
+        {
+            const int t_index = row*sum_width + col;
+            const int b_index = (row + template_width)*sum_width + col;
+            const double S = sum[b_index + template_width] - sum[b_index] - sum[t_index + template_width] + sum[t_index];
+            const double S2 = sum2[b_index + template_width] - sum2[b_index] - sum2[t_index + template_width] + sum2[t_index];
+            const double var = S2 - S*S/N;
+            if(var > 1e-8)
+            {
+                const double ncc = fft_search[row*fft_size + col].real()/sqrt(sum_T2*var);
+                if(ncc > max_ncc)
+                {
+                    max_ncc = ncc;
+                    shift_col = col - kernel_size;
+                    shift_row = row - kernel_size;
+                    check_find = true;
+                }
+            }
+        }
+    }
+    
+    return check_find;
+}
+
 double Correlate(const vector<double> &L, const vector<double> &R, const int N)
 {
     double Lmean = 0;
@@ -1586,6 +1761,55 @@ double** OpenXMLFile(ProInfo *proinfo, int ImageID, double* gsd_r, double* gsd_c
     return out;
 }
 
+//days since 0000-03-01 of a proleptic Gregorian date
+long int GetDayNumber(const int year, const int month, const int date)
+{
+    const int y = month <= 2 ? year - 1 : year;
+    const int m = month <= 2 ? month + 9 : month - 3;
+    return 365L*y + y/4 - y/100 + y/400 + (153*m + 2)/5 + date - 1;
+}
+
+//angle between two viewing (or sun) directions given as azimuth/elevation in degree
+double GetDirectionAngle(const double azimuth_1, const double elevation_1, const double azimuth_2, const double elevation_2)
+{
+    double cos_angle = sin(elevation_1*DegToRad)*sin(elevation_2*DegToRad) + cos(elevation_1*DegToRad)*cos(elevation_2*DegToRad)*cos((azimuth_1 - azimuth_2)*DegToRad);
+    if(cos_angle > 1.0)
+        cos_angle = 1.0;
+    else if(cos_angle < -1.0)
+        cos_angle = -1.0;
+    
+    return acos(cos_angle)*RadToDeg;
+}
+
+//pair quality in [0, 1] from convergence angle, acquisition date and sun angle difference
+double GetImagePairScore(const ImageInfo &ref_info, const ImageInfo &tar_info)
+{
+    const double convergence_angle = GetDirectionAngle(ref_info.Mean_sat_azimuth_angle, ref_info.Mean_sat_elevation, tar_info.Mean_sat_azimuth_angle, tar_info.Mean_sat_elevation);
+    const double sun_angle = GetDirectionAngle(ref_info.Mean_sun_azimuth_angle, ref_info.Mean_sun_elevation, tar_info.Mean_sun_azimuth_angle, tar_info.Mean_sun_elevation);
+    
+    //weak geometry below 10 degree, occlusion above 45 degree
+    double score_convergence;
+    if(convergence_angle < 10)
+        score_convergence = convergence_angle/10.0;
+    else if(convergence_angle <= 45)
+        score_convergence = 1.0;
+    else
+        score_convergence = max(0.1, 1.0 - (convergence_angle - 45)/45.0);
+    
+    //surface changes with time, unknown dates are not penalized
+    double score_date = 1.0;
+    if(ref_info.year > 0 && tar_info.year > 0)
+    {
+        const long int days = labs(GetDayNumber(ref_info.year, ref_info.month, ref_info.date) - GetDayNumber(tar_info.year, tar_info.month, tar_info.date));
+        score_date = max(0.1, exp(-(double)days/365.0));
+    }
+    
+    //shadow and illumination differences
+    const double score_sun = max(0.1, 1.0 - sun_angle/90.0);
+    
+    return score_convergence*score_date*score_sun;
+}
+
 double** OpenXMLFile_Pleiades(char* _filename)
 {
     double** out = NULL;
@@ -2053,6 +2277,14 @@ void OpenXMLFile_orientation(char* _filename, ImageInfo *Iinfo)
         sprintf(Iinfo->imagetime,"%s",imagetime);
         sprintf(Iinfo->SatID,"%s",SatID);
         
+        //FIRSTLINETIME is ISO 8601, e.g. 2015-06-12T21:30:45.123456Z
+        if(sscanf(imagetime,"%d-%d-%d",&Iinfo->year,&Iinfo->month,&Iinfo->date) != 3)
+        {
+            Iinfo->year = 0;
+            Iinfo->month = 0;
+            Iinfo->date = 0;
+        }
+        
         if(pos1)
             pos1 = NULL;
         if(pos2)
@@ -2970,6 +3202,155 @@ bool IsTinInside(const D3DPOINT &CurGPXY, const D3DPOINT &TriP1, const D3DPOINT
     return rtn;
 }
 
+void SetTinTileBins(LevelInfo &rlevelinfo, const D3DPOINT *pts, const long numOfPts, const UI3DPOINT *tris, const long numOfTri, TinTileBins *bins, double &Total_Min_Z, double &Total_Max_Z)
+{
+    bins->tiles_x = (rlevelinfo.Size_Grid2D->width + TIN_TILE_SIZE - 1)/TIN_TILE_SIZE;
+    bins->tiles_y = (rlevelinfo.Size_Grid2D->height + TIN_TILE_SIZE - 1)/TIN_TILE_SIZE;
+    const long total_tiles = (long)bins->tiles_x*(long)bins->tiles_y;
+    
+    bins->start.assign(total_tiles + 1, 0);
+    bins->pixel_box.assign(numOfTri*4, -1);
+    
+    //bounding boxes and tile counts
+    for(long tcnt = 0 ; tcnt < numOfTri ; tcnt++)
+    {
+        const UI3DPOINT &t_tri = tris[tcnt];
+        if(t_tri.m_X < numOfPts && t_tri.m_Y < numOfPts && t_tri.m_Z < numOfPts)
+        {
+            int *box = &bins->pixel_box[tcnt*4];
+            double temp_MinZ, temp_MaxZ;
+            SetTinBoundary(rlevelinfo, pts[t_tri.m_X], pts[t_tri.m_Y], pts[t_tri.m_Z], box, box + 2, Total_Min_Z, Total_Max_Z, temp_MinZ, temp_MaxZ);
+            
+            for(long ty = box[1]/TIN_TILE_SIZE ; ty <= box[3]/TIN_TILE_SIZE ; ty++)
+                for(long tx = box[0]/TIN_TILE_SIZE ; tx <= box[2]/TIN_TILE_SIZE ; tx++)
+                    bins->start[ty*bins->tiles_x + tx + 1]++;
+        }
+    }
+    
+    for(long tile = 0 ; tile < total_tiles ; tile++)
+        bins->start[tile + 1] += bins->start[tile];
+    
+    //triangle lists per tile, in input order
+    bins->tri_index.resize(bins->start[total_tiles]);
+    vector<long> fill(bins->start.begin(), bins->start.end() - 1);
+    for(long tcnt = 0 ; tcnt < numOfTri ; tcnt++)
+    {
+        const int *box = &bins->pixel_box[tcnt*4];
+        if(box[0] < 0)
+            continue;
+        
+        for(long ty = box[1]/TIN_TILE_SIZE ; ty <= box[3]/TIN_TILE_SIZE ; ty++)
+            for(long tx = box[0]/TIN_TILE_SIZE ; tx <= box[2]/TIN_TILE_SIZE ; tx++)
+                bins->tri_index[fill[ty*bins->tiles_x + tx]++] = tcnt;
+    }
+}
+
+bool GetTinTileBox(const TinTileBins &bins, const long tile, const long tcnt, int *PixelMinXY, int *PixelMaxXY)
+{
+    const int *box = &bins.pixel_box[tcnt*4];
+    const int tile_col = (tile % bins.tiles_x)*TIN_TILE_SIZE;
+    const int tile_row = (tile / bins.tiles_x)*TIN_TILE_SIZE;
+    
+    PixelMinXY[0] = max(box[0], tile_col);
+    PixelMinXY[1] = max(box[1], tile_row);
+    PixelMaxXY[0] = min(box[2], tile_col + TIN_TILE_SIZE - 1);
+    PixelMaxXY[1] = min(box[3], tile_row + TIN_TILE_SIZE - 1);
+    
+    return PixelMinXY[0] <= PixelMaxXY[0] && PixelMinXY[1] <= PixelMaxXY[1];
+}
+
+TinEdgeFunction::TinEdgeFunction(LevelInfo &rlevelinfo, const D3DPOINT &TriP1, const D3DPOINT &TriP2, const D3DPOINT &TriP3)
+{
+    const double gridspace = *rlevelinfo.grid_resolution;
+    const D3DPOINT *Tri[3] = {&TriP1, &TriP2, &TriP3};
+    
+    //vertices in grid units. matched points sit on grid nodes, so snapping keeps the incremental edge values exact
+    double u[3], v[3];
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        u[k] = (Tri[k]->m_X - rlevelinfo.Boundary[0])/gridspace;
+        v[k] = (Tri[k]->m_Y - rlevelinfo.Boundary[1])/gridspace;
+        if(fabs(u[k] - floor(u[k] + 0.5)) < 1e-6)
+            u[k] = floor(u[k] + 0.5);
+        if(fabs(v[k] - floor(v[k] + 0.5)) < 1e-6)
+            v[k] = floor(v[k] + 0.5);
+    }
+    
+    //edge k from vertex k to k+1, E = (u1-u0)*(row-v0) - (v1-v0)*(col-u0)
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        const int k1 = (k + 1)%3;
+        a[k] = -(v[k1] - v[k]);
+        b[k] = u[k1] - u[k];
+        c[k] = -b[k]*v[k] - a[k]*u[k];
+    }
+    
+    D3DPOINT v12(TriP2 - TriP1);
+    D3DPOINT v13(TriP3 - TriP1);
+    D3DPOINT Normal(v12.m_Y*v13.m_Z - v12.m_Z*v13.m_Y, v12.m_Z*v13.m_X - v12.m_X*v13.m_Z, v12.m_X*v13.m_Y - v12.m_Y*v13.m_X);
+    
+    const double Len = SQRT(Normal);
+    valid = false;
+    A = B = C = D = 0;
+    if(Len > 0)
+    {
+        A = Normal.m_X/Len;
+        B = Normal.m_Y/Len;
+        C = Normal.m_Z/Len;
+        D = -(A*TriP1.m_X+B*TriP1.m_Y+C*TriP1.m_Z);
+        valid = (C != 0);
+    }
+}
+
+void SetTinAdjacency(const UI3DPOINT *tris, const long num_triangles, const long num_points, TinAdjacency *adj)
+{
+    adj->start.assign(num_points + 1, 0);
+    
+    //triangles with an index outside of the point list are not linked to any vertex
+#pragma omp parallel for schedule(static)
+    for(long tcnt = 0 ; tcnt < num_triangles ; tcnt++)
+    {
+        const UI3DPOINT &t_tri = tris[tcnt];
+        if(t_tri.m_X < num_points && t_tri.m_Y < num_points && t_tri.m_Z < num_points)
+        {
+#pragma omp atomic
+            adj->start[t_tri.m_X + 1]++;
+#pragma omp atomic
+            adj->start[t_tri.m_Y + 1]++;
+#pragma omp atomic
+            adj->start[t_tri.m_Z + 1]++;
+        }
+    }
+    
+    for(long index = 0 ; index < num_points ; index++)
+        adj->start[index + 1] += adj->start[index];
+    
+    adj->tri_index.resize(adj->start[num_points]);
+    vector<long> fill(adj->start.begin(), adj->start.end() - 1);
+    
+#pragma omp parallel for schedule(static)
+    for(long tcnt = 0 ; tcnt < num_triangles ; tcnt++)
+    {
+        const UI3DPOINT &t_tri = tris[tcnt];
+        if(t_tri.m_X < num_points && t_tri.m_Y < num_points && t_tri.m_Z < num_points)
+        {
+            const uint32 vertex[3] = {t_tri.m_X, t_tri.m_Y, t_tri.m_Z};
+            for(int k = 0 ; k < 3 ; k++)
+            {
+                long pos;
+#pragma omp atomic capture
+                pos = fill[vertex[k]]++;
+                adj->tri_index[pos] = tcnt;
+            }
+        }
+    }
+    
+    //slots were taken in thread order, sort to make the lists deterministic
+#pragma omp parallel for schedule(dynamic,1024)
+    for(long index = 0 ; index < num_points ; index++)
+        std::sort(adj->tri_index.begin() + adj->start[index], adj->tri_index.begin() + adj->start[index + 1]);
+}
+
 double SetNormalAngle(const D3DPOINT &pts0, const D3DPOINT &pts1, const D3DPOINT &pts2)
 {
     double angle;
@@ -3222,6 +3603,43 @@ FullTriangulation *TINCreate(D3DPOINT *ptslists, int numofpts, UI3DPOINT* trilis
 */
 
 
+//kernel scale k covers the template shrunk by size pixels on each side
+static inline bool CheckKernelScale(const int Half_template_size, const int size, const int row, const int col, const int radius2)
+{
+    return radius2 <= (Half_template_size - size + 1)*(Half_template_size - size + 1) &&
+        row >= -Half_template_size + size && row <= Half_template_size - size &&
+        col >= -Half_template_size + size && col <= Half_template_size - size;
+}
+
+static inline void PushKernelValue(SetKernel &rkernel, const int row, const int col, const int radius2, const double left_patch, const double left_mag_patch, const double right_patch, const double right_mag_patch, int *Count_N)
+{
+    rkernel.left_patch_vecs(0, Count_N[0]) = left_patch;
+    rkernel.left_mag_patch_vecs(0, Count_N[0]) = left_mag_patch;
+    rkernel.right_patch_vecs(0, Count_N[0]) = right_patch;
+    rkernel.right_mag_patch_vecs(0, Count_N[0]) = right_mag_patch;
+    Count_N[0]++;
+    
+    const int size_1        = (int)(rkernel.Half_template_size/2);
+    if(CheckKernelScale(rkernel.Half_template_size, size_1, row, col, radius2))
+    {
+        rkernel.left_patch_vecs(1, Count_N[1]) = left_patch;
+        rkernel.left_mag_patch_vecs(1, Count_N[1]) = left_mag_patch;
+        rkernel.right_patch_vecs(1, Count_N[1]) = right_patch;
+        rkernel.right_mag_patch_vecs(1, Count_N[1]) = right_mag_patch;
+        Count_N[1]++;
+    }
+    
+    const int size_2        = size_1 + (int)((size_1/2.0) + 0.5);
+    if(CheckKernelScale(rkernel.Half_template_size, size_2, row, col, radius2))
+    {
+        rkernel.left_patch_vecs(2, Count_N[2]) = left_patch;
+        rkernel.left_mag_patch_vecs(2, Count_N[2]) = left_mag_patch;
+        rkernel.right_patch_vecs(2, Count_N[2]) = right_patch;
+        rkernel.right_mag_patch_vecs(2, Count_N[2]) = right_mag_patch;
+        Count_N[2]++;
+    }
+}
+
 void SetVecKernelValue(const KernelPatchArg &patch, const int row, const int col, const D2DPOINT &pos_left, const D2DPOINT &pos_right, const int radius2, int *Count_N)
 {
 
@@ -3245,51 +3663,127 @@ void SetVecKernelValue(const KernelPatchArg &patch, const int row, const int col
         right_patch = InterpolatePatch(patch.right_image, position_right,patch.RImagesize, dx_r, dy_r);
         right_mag_patch = InterpolatePatch(patch.right_mag_image, position_right,patch.RImagesize, dx_r, dy_r);
 
-        auto &rkernel = patch.rkernel;
-            
         if(left_patch > 0 && right_patch > 0)
+            PushKernelValue(patch.rkernel, row, col, radius2, left_patch, left_mag_patch, right_patch, right_mag_patch, Count_N);
+    }
+}
+
+void RefPatchStack::Resize(const int NumOfHeights, const bool check_next)
+{
+    valid.assign(NumOfHeights, 0);
+    slot.assign(NumOfHeights, -1);
+    Imagecoord.resize(NumOfHeights);
+    Imagecoord_py.resize(NumOfHeights);
+    patch.resize((size_t)NumOfHeights*patch_size);
+    mag_patch.resize((size_t)NumOfHeights*patch_size);
+    stat.resize((size_t)NumOfHeights*3);
+    if(check_next)
+    {
+        Imagecoord_py_next.resize(NumOfHeights);
+        patch_next.resize((size_t)NumOfHeights*patch_size);
+        mag_patch_next.resize((size_t)NumOfHeights*patch_size);
+        stat_next.resize((size_t)NumOfHeights*3);
+    }
+}
+
+//dense reference template around pos_ref, laid out row by row like the kernel loops in VerticalLineLocus
+void SetRefPatchValue(const uint16 *image, const uint16 *mag_image, const CSize Imagesize, const D2DPOINT &pos_ref, const int Half_template_size, double *patch, double *mag_patch)
+{
+    const int patch_width = 2*Half_template_size + 1;
+    for(int row = -Half_template_size; row <= Half_template_size ; row++)
+    {
+        for(int col = -Half_template_size; col <= Half_template_size ; col++)
         {
-            rkernel.left_patch_vecs(0, Count_N[0]) = left_patch;
-            rkernel.left_mag_patch_vecs(0, Count_N[0]) = left_mag_patch;
-            rkernel.right_patch_vecs(0, Count_N[0]) = right_patch;
-            rkernel.right_mag_patch_vecs(0, Count_N[0]) = right_mag_patch;
-            Count_N[0]++;
+            const int index = (row + Half_template_size)*patch_width + col + Half_template_size;
+            const D2DPOINT pos_left(pos_ref.m_X + col, pos_ref.m_Y + row);
+            
+            patch[index] = 0;
+            mag_patch[index] = 0;
             
-            const int size_1        = (int)(rkernel.Half_template_size/2);
-            if(radius2 <= (rkernel.Half_template_size - size_1 + 1)*(rkernel.Half_template_size - size_1 + 1))
+            if(pos_left.m_Y >= 0 && pos_left.m_Y + 1 < Imagesize.height && pos_left.m_X >= 0 && pos_left.m_X + 1  < Imagesize.width)
             {
-                if(row >= -rkernel.Half_template_size + size_1 && row <= rkernel.Half_template_size - size_1)
+                const long int position = (long int) pos_left.m_X + (long int) pos_left.m_Y *(long int)Imagesize.width;
+                const double dx = pos_left.m_X - floor(pos_left.m_X);
+                const double dy = pos_left.m_Y - floor(pos_left.m_Y);
+                
+                patch[index] = InterpolatePatch(image, position, Imagesize, dx, dy);
+                mag_patch[index] = InterpolatePatch(mag_image, position, Imagesize, dx, dy);
+            }
+        }
+    }
+}
+
+//mean and sum of squared deviations of the reference template for each kernel scale
+void SetRefPatchStat(const double *patch, const double *mag_patch, const int Half_template_size, RefPatchStat *stat)
+{
+    const int patch_width = 2*Half_template_size + 1;
+    const int size_1 = (int)(Half_template_size/2);
+    const int sizes[3] = {0, size_1, size_1 + (int)((size_1/2.0) + 0.5)};
+    
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        int count = 0;
+        double sum = 0, sum_mag = 0;
+        for(int row = -Half_template_size; row <= Half_template_size ; row++)
+        {
+            for(int col = -Half_template_size; col <= Half_template_size ; col++)
+            {
+                const int radius2 = row*row + col*col;
+                const int index = (row + Half_template_size)*patch_width + col + Half_template_size;
+                if(patch[index] > 0 && CheckKernelScale(Half_template_size, sizes[k], row, col, radius2))
                 {
-                    if(col >= -rkernel.Half_template_size + size_1 && col <= rkernel.Half_template_size - size_1)
-                    {
-                        rkernel.left_patch_vecs(1, Count_N[1]) = left_patch;
-                        rkernel.left_mag_patch_vecs(1, Count_N[1]) = left_mag_patch;
-                        rkernel.right_patch_vecs(1, Count_N[1]) = right_patch;
-                        rkernel.right_mag_patch_vecs(1, Count_N[1]) = right_mag_patch;
-                        Count_N[1]++;
-                    }
+                    sum += patch[index];
+                    sum_mag += mag_patch[index];
+                    count++;
                 }
             }
-            
-            const int size_2        = size_1 + (int)((size_1/2.0) + 0.5);
-            if(radius2 <= (rkernel.Half_template_size - size_2 + 1)*(rkernel.Half_template_size - size_2 + 1))
+        }
+        
+        stat[k].count = count;
+        stat[k].mean = count > 0 ? sum/count : 0;
+        stat[k].mean_mag = count > 0 ? sum_mag/count : 0;
+        stat[k].sum2 = 0;
+        stat[k].sum2_mag = 0;
+        
+        for(int row = -Half_template_size; row <= Half_template_size ; row++)
+        {
+            for(int col = -Half_template_size; col <= Half_template_size ; col++)
             {
-                if(row >= -rkernel.Half_template_size + size_2 && row <= rkernel.Half_template_size - size_2)
+                const int radius2 = row*row + col*col;
+                const int index = (row + Half_template_size)*patch_width + col + Half_template_size;
+                if(patch[index] > 0 && CheckKernelScale(Half_template_size, sizes[k], row, col, radius2))
                 {
-                    if(col >= -rkernel.Half_template_size + size_2 && col <= rkernel.Half_template_size - size_2)
-                    {
-                        rkernel.left_patch_vecs(2, Count_N[2]) = left_patch;
-                        rkernel.left_mag_patch_vecs(2, Count_N[2]) = left_mag_patch;
-                        rkernel.right_patch_vecs(2, Count_N[2]) = right_patch;
-                        rkernel.right_mag_patch_vecs(2, Count_N[2]) = right_mag_patch;
-                        Count_N[2]++;
-                    }
+                    stat[k].sum2 += (patch[index] - stat[k].mean)*(patch[index] - stat[k].mean);
+                    stat[k].sum2_mag += (mag_patch[index] - stat[k].mean_mag)*(mag_patch[index] - stat[k].mean_mag);
                 }
             }
         }
     }
 }
 
+//same packing as SetVecKernelValue, with the left side read from a precomputed reference template
+void SetVecKernelValue_ref(const KernelPatchArg &patch, const double *ref_patch, const double *ref_mag_patch, const int row, const int col, const D2DPOINT &pos_right, const int radius2, int *Count_N)
+{
+    const int Half_template_size = patch.rkernel.Half_template_size;
+    const int index = (row + Half_template_size)*(2*Half_template_size + 1) + col + Half_template_size;
+    const double left_patch = ref_patch[index];
+    
+    if(left_patch > 0 && pos_right.m_Y >= 0 && pos_right.m_Y + 1 < patch.RImagesize.height && pos_right.m_X  >= 0 && pos_right.m_X + 1 < patch.RImagesize.width)
+    {
+        const long int position_right = (long int) pos_right.m_X + (long int) pos_right.m_Y *(long int)patch.RImagesize.width;
+        const double dx_r = pos_right.m_X - floor(pos_right.m_X);
+        const double dy_r = pos_right.m_Y - floor(pos_right.m_Y);
+        
+        const double right_patch = InterpolatePatch(patch.right_image, position_right,patch.RImagesize, dx_r, dy_r);
+        
+        if(right_patch > 0)
+        {
+            const double right_mag_patch = InterpolatePatch(patch.right_mag_image, position_right,patch.RImagesize, dx_r, dy_r);
+            PushKernelValue(patch.rkernel, row, col, radius2, left_patch, ref_mag_patch[index], right_patch, right_mag_patch, Count_N);
+        }
+    }
+}
+
 double InterpolatePatch(const uint16 *Image, const long int position, const CSize Imagesize, const double dx, const double dy)
 {
     double patch =
@@ -3336,6 +3830,127 @@ void ComputeMultiNCC(SetKernel &rsetkernel, const int Th_rho, const int *Count_N
 
 
 
+//row-major offsets within max_radius, same order and rotation as the per-pixel loops they replace
+KernelOffsetLUT::KernelOffsetLUT(const int Half_template_size, const int max_radius, const double bin_angle)
+{
+    max_diff = (int)(360.0/bin_angle + 0.5);
+    offsets.resize(4*max_diff + 1);
+    
+    for(int index = 0 ; index <= 4*max_diff ; index++)
+    {
+        const double diff_theta = (index - 2*max_diff)/2.0;
+        const double rot_theta = (double)(diff_theta*bin_angle*PI/180.0);
+        const double cos0 = cos(-rot_theta);
+        const double sin0 = sin(-rot_theta);
+        
+        for(int row = -Half_template_size; row <= Half_template_size ; row++)
+        {
+            for(int col = -Half_template_size; col <= Half_template_size ; col++)
+            {
+                const int radius2 = row*row + col*col;
+                if(radius2 <= max_radius*max_radius)
+                {
+                    KernelOffset offset;
+                    offset.row = row;
+                    offset.col = col;
+                    offset.radius2 = radius2;
+                    offset.pos.m_X = cos0*col - sin0*row;
+                    offset.pos.m_Y = sin0*col + cos0*row;
+                    offsets[index].push_back(offset);
+                }
+            }
+        }
+    }
+}
+
+//intensity NCC over every second template pixel at the full kernel scale only, for the coarse height sweep
+double ComputeCoarseNCC(const KernelPatchArg &patch, const D2DPOINT &pos_ref, const D2DPOINT &pos_tar, const int Half_template_size, const double cos0, const double sin0)
+{
+    double sum_L = 0, sum_R = 0, sum_LL = 0, sum_RR = 0, sum_LR = 0;
+    int N = 0;
+    
+    for(int row = -Half_template_size; row <= Half_template_size ; row += 2)
+    {
+        for(int col = -Half_template_size; col <= Half_template_size ; col += 2)
+        {
+            if(row*row + col*col > (Half_template_size + 1)*(Half_template_size + 1))
+                continue;
+            
+            const D2DPOINT pos_left(pos_ref.m_X + col, pos_ref.m_Y + row);
+            const D2DPOINT pos_right(pos_tar.m_X + cos0*col - sin0*row, pos_tar.m_Y + sin0*col + cos0*row);
+            
+            if( pos_right.m_Y >= 0 && pos_right.m_Y + 1 < patch.RImagesize.height && pos_right.m_X  >= 0 && pos_right.m_X + 1 < patch.RImagesize.width && pos_left.m_Y >= 0 && pos_left.m_Y + 1 < patch.LImagesize.height && pos_left.m_X >= 0 && pos_left.m_X + 1  < patch.LImagesize.width)
+            {
+                const long int position = (long int) pos_left.m_X + (long int) pos_left.m_Y *(long int)patch.LImagesize.width;
+                const long int position_right = (long int) pos_right.m_X + (long int) pos_right.m_Y *(long int)patch.RImagesize.width;
+                
+                const double L = InterpolatePatch(patch.left_image, position, patch.LImagesize, pos_left.m_X - floor(pos_left.m_X), pos_left.m_Y - floor(pos_left.m_Y));
+                const double R = InterpolatePatch(patch.right_image, position_right, patch.RImagesize, pos_right.m_X - floor(pos_right.m_X), pos_right.m_Y - floor(pos_right.m_Y));
+                
+                if(L > 0 && R > 0)
+                {
+                    sum_L += L;
+                    sum_R += R;
+                    sum_LL += L*L;
+                    sum_RR += R*R;
+                    sum_LR += L*R;
+                    N++;
+                }
+            }
+        }
+    }
+    
+    if(N < 4)
+        return -1.0;
+    
+    const double var_L = N*sum_LL - sum_L*sum_L;
+    const double var_R = N*sum_RR - sum_R*sum_R;
+    if(var_L <= 0 || var_R <= 0)
+        return -1.0;
+    
+    return (N*sum_LR - sum_L*sum_R)/sqrt(var_L*var_R);
+}
+
+//ComputeMultiNCC with reference statistics reused whenever the target covered the whole reference template
+void ComputeMultiNCC_ref(SetKernel &rsetkernel, const RefPatchStat *stat, const int Th_rho, const int *Count_N, double &count_NCC, double &sum_NCC_multi)
+{
+    if(Count_N[0] > Th_rho && Count_N[1] > Th_rho && Count_N[2] > Th_rho)
+    {
+        double temp_roh = 0;
+        double count_roh = 0;
+        double temp_NCC_roh;
+        
+        for (int k=0; k<3; k++)
+        {
+            const bool check_full = Count_N[k] == stat[k].count;
+            
+            const double ncc = check_full ?
+                Correlate_ref(rsetkernel.left_patch_vecs.row(k), rsetkernel.right_patch_vecs.row(k), Count_N[k], stat[k].mean, stat[k].sum2) :
+                Correlate(rsetkernel.left_patch_vecs.row(k), rsetkernel.right_patch_vecs.row(k), Count_N[k]);
+            if (ncc != -99)
+            {
+                count_roh++;
+                temp_roh += ncc;
+            }
+            
+            const double ncc_mag = check_full ?
+                Correlate_ref(rsetkernel.left_mag_patch_vecs.row(k), rsetkernel.right_mag_patch_vecs.row(k), Count_N[k], stat[k].mean_mag, stat[k].sum2_mag) :
+                Correlate(rsetkernel.left_mag_patch_vecs.row(k), rsetkernel.right_mag_patch_vecs.row(k), Count_N[k]);
+            if (ncc_mag != -99)
+            {
+                count_roh++;
+                temp_roh += ncc_mag;
+            }
+        }
+        if (count_roh > 0)
+        {
+            temp_NCC_roh = temp_roh/count_roh;
+            sum_NCC_multi += temp_NCC_roh;
+            count_NCC ++;
+        }
+    }
+}
+
 D2DPOINT *SetDEMGrid(const double *Boundary, const double Grid_x, const double Grid_y, CSize *Size_2D)
 {
     D2DPOINT *GridPT = NULL;
@@ -18,6 +18,7 @@
 
 #include <algorithm>
 #include <iostream>
+#include <complex>
 
 #include "Typedefine.hpp"
 #include "CoordConversion.hpp"
@@ -66,6 +67,9 @@ double** OpenXMLFile(ProInfo *proinfo, int ImageID, double* gsd_r, double* gsd_c
 double** OpenXMLFile_Pleiades(char* _filename);
 double** OpenXMLFile_Planet(char* _filename);
 void OpenXMLFile_orientation(char* _filename, ImageInfo *Iinfo);
+long int GetDayNumber(const int year, const int month, const int date);
+double GetDirectionAngle(const double azimuth_1, const double elevation_1, const double azimuth_2, const double elevation_2);
+double GetImagePairScore(const ImageInfo &ref_info, const ImageInfo &tar_info);
 
 float median(int n, float* x,float min, float max);
 float binmedian(int n, float *x);
@@ -94,6 +98,95 @@ struct KernelPatchArg {
 void SetVecKernelValue(const KernelPatchArg &kernel_patch, const int row, const int col, const D2DPOINT &pos_left, const D2DPOINT &pos_right, const int radius2, int *Count_N);
 
 void ComputeMultiNCC(SetKernel &rsetkernel, const int Th_rho, const int *Count_N, double &count_NCC, double &sum_NCC_multi);
+double ComputeCoarseNCC(const KernelPatchArg &kernel_patch, const D2DPOINT &pos_ref, const D2DPOINT &pos_tar, const int Half_template_size, const double cos0, const double sin0);
+
+//circular kernel offsets rotated by each orientation difference, built once per level instead of per voxel.
+//diff_theta is looked up in half bins because the combined kernel averages two integer bin differences
+struct KernelOffset {
+    int row;
+    int col;
+    int radius2;
+    D2DPOINT pos; //rotated (col, row)
+};
+
+struct KernelOffsetLUT {
+    int max_diff;
+    vector<vector<KernelOffset> > offsets;
+
+    KernelOffsetLUT(const int Half_template_size, const int max_radius, const double bin_angle);
+
+    const vector<KernelOffset> &Get(const double diff_theta) const
+    {
+        return offsets[(int)floor(diff_theta*2.0 + 0.5) + 2*max_diff];
+    }
+};
+
+//reference side of the INCC kernel, computed once per (grid point, height) and shared by all target images.
+//heights whose reference position moved less than REF_PATCH_REUSE_TH pyramid pixels share one patch
+#define REF_PATCH_REUSE_TH 0.05
+
+struct RefPatchStat {
+    int count;
+    double mean;
+    double sum2;
+    double mean_mag;
+    double sum2_mag;
+};
+
+struct RefPatchStack {
+    const int Half_template_size;
+    const int patch_size;
+    
+    vector<char> valid;
+    vector<int> slot;   //patch and stat slot of each height
+    vector<D2DPOINT> Imagecoord;
+    vector<D2DPOINT> Imagecoord_py;
+    vector<D2DPOINT> Imagecoord_py_next;
+    
+    //dense template per height, 0 where the reference is not available
+    vector<double> patch;
+    vector<double> mag_patch;
+    vector<double> patch_next;
+    vector<double> mag_patch_next;
+    
+    //3 kernel scales per height
+    vector<RefPatchStat> stat;
+    vector<RefPatchStat> stat_next;
+    
+    RefPatchStack(const int Half_template_size):
+        Half_template_size(Half_template_size),
+        patch_size((2*Half_template_size+1) * (2*Half_template_size+1))
+    {
+    }
+    
+    void Resize(const int NumOfHeights, const bool check_next);
+};
+
+void SetRefPatchValue(const uint16 *image, const uint16 *mag_image, const CSize Imagesize, const D2DPOINT &pos_ref, const int Half_template_size, double *patch, double *mag_patch);
+void SetRefPatchStat(const double *patch, const double *mag_patch, const int Half_template_size, RefPatchStat *stat);
+void SetVecKernelValue_ref(const KernelPatchArg &kernel_patch, const double *ref_patch, const double *ref_mag_patch, const int row, const int col, const D2DPOINT &pos_right, const int radius2, int *Count_N);
+void ComputeMultiNCC_ref(SetKernel &rsetkernel, const RefPatchStat *stat, const int Th_rho, const int *Count_N, double &count_NCC, double &sum_NCC_multi);
+double Correlate_ref(const double *L, const double *R, const int N, const double Lmean, const double SumL2);
+
+//shift search of the coarse SDM levels. the square-window NCC of a template over every kernel shift of the
+//search area comes from one FFT cross-correlation, with the search window statistics from integral images.
+//patches are filled row by row by the caller, <= 0 marks a sample that isn't available
+#define SDM_FFT_LEVEL 1
+
+struct SDMShiftFFT {
+    vector<double> template_patch;  //(2*Half_template_size+1)^2
+    vector<double> search_patch;    //(2*(Half_template_size+kernel_size)+1)^2
+    
+    vector<std::complex<double> > fft_template;
+    vector<std::complex<double> > fft_search;
+    vector<double> sum, sum2;
+    
+    void Resize(const int Half_template_size, const int kernel_size);
+    bool FindShift(const int Half_template_size, const int kernel_size, int &shift_col, int &shift_row, double &max_ncc);
+};
+
+void FFT_1D(std::complex<double> *data, const int n, const int stride, const bool inverse);
+void FFT_2D(std::complex<double> *data, const int n, const bool inverse);
 
 D2DPOINT *SetDEMGrid(const double *Boundary, const double Grid_x, const double Grid_y, CSize *Size_2D);
 void SetPyramidImages(const ProInfo *proinfo, const int py_level_set, const CSize * const *data_size_lr, uint16 ***SubImages, uint16 ***SubMagImages, uint8 ***SubOriImages);
@@ -122,6 +215,65 @@ void SetTinBoundary(LevelInfo &rlevelinfo, const D3DPOINT &TriP1, const D3DPOINT
 
 bool IsTinInside(const D3DPOINT &CurGPXY, const D3DPOINT &TriP1, const D3DPOINT &TriP2, const D3DPOINT &TriP3, float &Z);
 
+//triangles binned into square tiles of grid cells, so one thread owns all cells of a tile.
+//triangles keep the input order inside a tile, and "first triangle wins" rules give the serial result
+#define TIN_TILE_SIZE 64
+
+struct TinTileBins {
+    int tiles_x;
+    int tiles_y;
+    vector<long> start;     //tiles_x*tiles_y + 1 offsets into tri_index
+    vector<long> tri_index;
+    vector<int> pixel_box;  //PixelMinXY[2], PixelMaxXY[2] per triangle
+};
+
+void SetTinTileBins(LevelInfo &rlevelinfo, const D3DPOINT *pts, const long numOfPts, const UI3DPOINT *tris, const long numOfTri, TinTileBins *bins, double &Total_Min_Z, double &Total_Max_Z);
+bool GetTinTileBox(const TinTileBins &bins, const long tile, const long tcnt, int *PixelMinXY, int *PixelMaxXY);
+
+//incremental edge functions of a triangle in grid units, and the plane of IsTinInside for the height
+struct TinEdgeFunction {
+    bool valid;
+    double a[3];
+    double b[3];
+    double c[3];
+    double A, B, C, D;
+    
+    TinEdgeFunction(LevelInfo &rlevelinfo, const D3DPOINT &TriP1, const D3DPOINT &TriP2, const D3DPOINT &TriP3);
+    
+    void SetRow(const long Col, const long Row, double *E) const
+    {
+        for(int k = 0 ; k < 3 ; k++)
+            E[k] = a[k]*Col + b[k]*Row + c[k];
+    }
+    
+    void NextCol(double *E) const
+    {
+        E[0] += a[0];
+        E[1] += a[1];
+        E[2] += a[2];
+    }
+    
+    //same inside rule as IsTinInside: all edges positive or all edges non-positive
+    bool IsInside(const double *E) const
+    {
+        const int Sum = (E[0] > 0) + (E[1] > 0) + (E[2] > 0);
+        return Sum == 0 || Sum == 3;
+    }
+    
+    float Height(const double X, const double Y) const
+    {
+        return -1.0 * ((A * X) + (B * Y) + D) / C;
+    }
+};
+
+//triangles around each vertex in compressed sparse row form, in ascending triangle order
+struct TinAdjacency {
+    vector<long> start;     //num_points + 1 offsets into tri_index
+    vector<long> tri_index;
+};
+
+void SetTinAdjacency(const UI3DPOINT *tris, const long num_triangles, const long num_points, TinAdjacency *adj);
+
 double SetNormalAngle(const D3DPOINT &pts0, const D3DPOINT &pts1, const D3DPOINT &pts2);
 void SetAngle(double &angle);
 
@@ -20,7 +20,9 @@ T *Readtiff_T(const char *filename, CSize *Imagesize,long int *cols,long int *ro
 template <typename T>
 void CoregParam_Image(ProInfo *proinfo, int ti, uint8 Pyramid_step, double *ImageAdjust, uint8 Template_size, T *Image_ref, CSize Imagesizes_ref, T *Image_tar, CSize Imagesizes_tar, double *Boundary_ref, double *Boundary_tar, D2DPOINT grid_dxy_ref, D2DPOINT grid_dxy_tar, int grid_space, double *over_Boundary, double* avg_rho, int* iter_count, D2DPOINT *adjust_std, vector<D2DPOINT> &matched_MPs, vector<D2DPOINT> &matched_MPs_ref, vector<D2DPOINT> &MPs);
 template <typename T>
-bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, double subA[][6],double TsubA[][9],double InverseSubA[][6], uint8 Template_size, CSize leftsize, CSize rightsize, T* _leftimage, T* _rightimage, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, D2DPOINT *peak_pos);
+bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, uint8 Template_size, CSize leftsize, CSize rightsize, T* _leftimage, T* _rightimage, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, D2DPOINT *peak_pos, const NCCSumTable *table_left, const NCCSumTable *table_right);
+template <typename T>
+double BoxNCC(const NCCSumTable &table_left, const NCCSumTable &table_right, const T *_leftimage, const T *_rightimage, const long col_left, const long row_left, const long col_right, const long row_right, const int half);
 
 
 inline double SQRT(D2DPOINT a);
@@ -34,13 +36,17 @@ inline double SignedCharToDouble_result(short val);
 inline short DoubleToSignedChar_grid(double val);
 inline double SignedCharToDouble_grid(short val);
 
+inline long int OrthoNCCIndex(const long int Grid_length, const int ti, const long int pt_index);
+inline D3DPOINT GridToMapPoint(const D3DPOINTGRID &pt, const double *Boundary, const double grid_resolution);
+inline D3DPOINTGRID MapToGridPoint(const D3DPOINT &pt, const double *Boundary, const double grid_resolution);
+
 inline short DoubleToSignedChar_voxel(double val);
 inline double SignedCharToDouble_voxel(short val);
 
 inline signed char FloatToSignedChar(float val);
 inline float SignedCharToFloat(signed char val);
 
-inline void Set6by6Matrix(double subA[][6], double TsubA[][9], double InverseSubA[][6]);
+inline bool FitPeak3x3(const double *rho, double &max_X, double &max_Y, double &max_roh);
 
 static Matrix CreateGaussianFilter(int filter_size, double sigma) {
 
@@ -524,12 +530,6 @@ T *Readtiff_T(const char *filename, CSize *Imagesize,long int *cols,long int *ro
 template <typename T>
 void CoregParam_Image(ProInfo *proinfo, int ti, uint8 Pyramid_step, double *ImageAdjust, uint8 Template_size, T *Image_ref, CSize Imagesizes_ref, T *Image_tar, CSize Imagesizes_tar, double *Boundary_ref, double *Boundary_tar, D2DPOINT grid_dxy_ref, D2DPOINT grid_dxy_tar, int grid_space, double *over_Boundary, double* avg_rho, int* iter_count, D2DPOINT *adjust_std, vector<D2DPOINT> &matched_MPs, vector<D2DPOINT> &matched_MPs_ref, vector<D2DPOINT> &MPs)
 {
-    double subA[9][6] = {0};
-    double TsubA[6][9] = {0};
-    double InverseSubA[6][6] = {0};
-    
-    Set6by6Matrix(subA, TsubA, InverseSubA);
-    
     double GridSize_width = over_Boundary[2] - over_Boundary[0];
     double GridSize_height = over_Boundary[3] - over_Boundary[1];
     CSize grid_size(floor(GridSize_width/grid_space), floor(GridSize_height/grid_space));
@@ -565,6 +565,18 @@ void CoregParam_Image(ProInfo *proinfo, int ti, uint8 Pyramid_step, double *Imag
     D3DPOINT* save_pts = (D3DPOINT*)calloc(sizeof(D3DPOINT),total_grid_counts);
     int* mps_index_save = (int*)calloc(sizeof(int),total_grid_counts);
     
+    //images don't change over the iterations, so the sum tables are built once per level
+    NCCSumTable *table_ref = NULL;
+    NCCSumTable *table_tar = NULL;
+    if(proinfo->check_box_NCC && Pyramid_step >= BOX_NCC_LEVEL)
+    {
+        table_ref = new NCCSumTable;
+        table_tar = new NCCSumTable;
+        table_ref->Set(Image_ref, Imagesizes_ref, 1);
+        table_tar->Set(Image_tar, Imagesizes_tar, 1);
+        printf("box NCC at level %d\n",Pyramid_step);
+    }
+    
     bool check_stop = false;
     const int max_iteration = 100;
     *iter_count = 1;
@@ -609,7 +621,7 @@ void CoregParam_Image(ProInfo *proinfo, int ti, uint8 Pyramid_step, double *Imag
                     double t_sum_weight_X       = 0;
                     double t_sum_weight_Y       = 0;
                     double t_sum_max_roh        = 0;
-                    if(postNCC_ortho(Pyramid_step, Left, Right, subA, TsubA, InverseSubA, Template_size, Imagesizes_ref, Imagesizes_tar, Image_ref, Image_tar, &t_sum_weight_X, &t_sum_weight_Y, &t_sum_max_roh, &peak_pos))
+                    if(postNCC_ortho(Pyramid_step, Left, Right, Template_size, Imagesizes_ref, Imagesizes_tar, Image_ref, Image_tar, &t_sum_weight_X, &t_sum_weight_Y, &t_sum_max_roh, &peak_pos, table_ref, table_tar))
                     {
                         sum_weight_X += t_sum_weight_X;
                         sum_weight_Y += t_sum_weight_Y;
@@ -682,28 +694,114 @@ void CoregParam_Image(ProInfo *proinfo, int ti, uint8 Pyramid_step, double *Imag
     }
     free(save_pts);
     free(mps_index_save);
+    delete table_ref;
+    delete table_tar;
     
     MPs.clear();
 }
 
 template <typename T>
-bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, double subA[][6],double TsubA[][9],double InverseSubA[][6], uint8 Template_size, CSize leftsize, CSize rightsize, T* _leftimage, T* _rightimage, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, D2DPOINT *peak_pos)
+bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, uint8 Template_size, CSize leftsize, CSize rightsize, T* _leftimage, T* _rightimage, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, D2DPOINT *peak_pos, const NCCSumTable *table_left, const NCCSumTable *table_right)
 {
     bool check_pt = false;
     
     const int Half_template_size  = (int)(Template_size/2);
     const int half_mask_size      = 1;
     
-    double *result_rho  = (double*)calloc(9,sizeof(double));
-    double *XX          = (double*)calloc(6,sizeof(double));
-    double *ATLT        = (double*)calloc(6,sizeof(double));
-    int i, j, k;
+    double result_rho[9];
+    int j;
     uint8 cell_count = 0;
     
     for(j=0;j<9;j++)
         result_rho[j]       = -1.00;
     
-    for(long mask_row = - half_mask_size ; mask_row <= half_mask_size ; mask_row++)
+    //box mode: both windows snap to whole pixels and the three scales become squares read from the sum tables.
+    //the fitted peak is moved back by the snapping offset, and any incomplete window falls back to the exact path
+    D2DPOINT snap_offset(0,0);
+    if(table_left && table_right)
+    {
+        const long col_left = (long)(Left.m_X + 0.5);
+        const long row_left = (long)(Left.m_Y + 0.5);
+        const long col_right = (long)(Right.m_X + 0.5);
+        const long row_right = (long)(Right.m_Y + 0.5);
+        
+        const int size_1 = (int)(Half_template_size/2);
+        const int size_2 = size_1 + (int)((size_1/2.0) + 0.5);
+        const int half_scale[3] = {Half_template_size - 1, Half_template_size - size_1, Half_template_size - size_2};
+        
+        for(long mask_row = - half_mask_size ; mask_row <= half_mask_size ; mask_row++)
+        {
+            for(long mask_col = - half_mask_size ; mask_col <= half_mask_size ; mask_col++)
+            {
+                double sum_rho = 0;
+                int count_scale = 0;
+                bool check_window = true;
+                for(int s = 0 ; s < 3 && check_window ; s++)
+                {
+                    if(half_scale[s] < 1)
+                        continue;
+                    
+                    double ncc = BoxNCC(*table_left, *table_right, _leftimage, _rightimage, col_left, row_left, col_right + mask_col, row_right + mask_row, half_scale[s]);
+                    if(ncc > -2)
+                    {
+                        sum_rho += ncc;
+                        count_scale++;
+                    }
+                    else
+                        check_window = false;
+                }
+                
+                if(check_window && count_scale > 0)
+                {
+                    result_rho[(mask_row+1)*3 + (mask_col+1)] = sum_rho/count_scale;
+                    cell_count++;
+                }
+            }
+        }
+        
+        if(cell_count == 9)
+        {
+            snap_offset.m_X = (col_right - Right.m_X) - (col_left - Left.m_X);
+            snap_offset.m_Y = (row_right - Right.m_Y) - (row_left - Left.m_Y);
+        }
+        else
+        {
+            cell_count = 0;
+            for(j=0;j<9;j++)
+                result_rho[j]       = -1.00;
+        }
+    }
+    
+    //the left window doesn't move with the mask, so it is interpolated once for all 9 cells.
+    //0 marks pixels outside the left image, which the (left_patch > 1) test below rejects
+    const int template_width = 2*Half_template_size + 1;
+    vector<double> left_patches;
+    if(cell_count < 9)
+    {
+        left_patches.assign(template_width*template_width, 0);
+        for(long row = -Half_template_size; row <= Half_template_size ; row++)
+        {
+            for(long col = -Half_template_size; col <= Half_template_size ; col++)
+            {
+                double pos_row_left      = Left.m_Y + row;
+                double pos_col_left      = Left.m_X + col;
+                
+                if(pos_row_left-3 >= 0 && pos_row_left+3 < leftsize.height && pos_col_left-3 >= 0 && pos_col_left+3 < leftsize.width)
+                {
+                    double dx = pos_col_left - (int) (pos_col_left);
+                    double dy = pos_row_left - (int) (pos_row_left);
+                    double dxdy = dx * dy;
+                    long position = (long) (pos_col_left) + (long) (pos_row_left) * leftsize.width;
+                    
+                    left_patches[(row + Half_template_size)*template_width + col + Half_template_size] =
+                        (double) (_leftimage[position]) * (1 - dx - dy + dxdy) + (double) (_leftimage[position + 1]) * (dx - dxdy) +
+                        (double) (_leftimage[position + leftsize.width]) * (dy - dxdy) + (double) (_leftimage[position + 1 + leftsize.width]) * (dxdy);
+                }
+            }
+        }
+    }
+    
+    for(long mask_row = - half_mask_size ; mask_row <= half_mask_size && cell_count < 9 ; mask_row++)
     {
         for(long mask_col = - half_mask_size ; mask_col <= half_mask_size ; mask_col++)
         {
@@ -731,31 +829,19 @@ bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, double sub
                     double radius  = sqrt((double)(row*row + col*col));
                     if(radius <= Half_template_size-1)
                     {
-                        double pos_row_left      = Left.m_Y + row;
-                        double pos_col_left      = Left.m_X + col;
-                        
                         double pos_row_right     = Right.m_Y + row + mask_row;
                         double pos_col_right     = Right.m_X + col + mask_col;
                         
-                        if(pos_row_right-3 >= 0 && pos_row_right+3 < rightsize.height && pos_col_right-3 >= 0 && pos_col_right+3 < rightsize.width &&
-                           pos_row_left-3 >= 0 && pos_row_left+3 < leftsize.height && pos_col_left-3 >= 0 && pos_col_left+3 < leftsize.width)
+                        if(pos_row_right-3 >= 0 && pos_row_right+3 < rightsize.height && pos_col_right-3 >= 0 && pos_col_right+3 < rightsize.width)
                         {
-                            //interpolate left_patch
-                            double dx = pos_col_left - (int) (pos_col_left);
-                            double dy = pos_row_left - (int) (pos_row_left);
-                            double left_patch;
+                            double left_patch = left_patches[(row + Half_template_size)*template_width + col + Half_template_size];
                             double right_patch;
-                            double dxdy = dx * dy;
-                            long position = (long) (pos_col_left) + (long) (pos_row_left) * leftsize.width;
-                            
-                            left_patch = (double) (_leftimage[position]) * (1 - dx - dy + dxdy) + (double) (_leftimage[position + 1]) * (dx - dxdy) +
-                                (double) (_leftimage[position + leftsize.width]) * (dy - dxdy) + (double) (_leftimage[position + 1 + leftsize.width]) * (dxdy);
                            
                             //interpolate right_patch
-                            dx = pos_col_right - (int) (pos_col_right);
-                            dy = pos_row_right - (int) (pos_row_right);
-                            dxdy = dx * dy;
-                            position = (long) (pos_col_right) + (long) (pos_row_right) * rightsize.width;
+                            double dx = pos_col_right - (int) (pos_col_right);
+                            double dy = pos_row_right - (int) (pos_row_right);
+                            double dxdy = dx * dy;
+                            long position = (long) (pos_col_right) + (long) (pos_row_right) * rightsize.width;
                             
                             right_patch = (double) (_rightimage[position]) * (1 - dx - dy + dxdy) + (double) (_rightimage[position + 1]) * (dx - dxdy) +
                                 (double) (_rightimage[position + rightsize.width]) * (dy - dxdy) + (double) (_rightimage[position + 1 + rightsize.width]) * (dxdy);
@@ -862,66 +948,36 @@ bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, double sub
         }
     }
     
-    if(cell_count == 9)
+    double max_X, max_Y, max_roh;
+    if(cell_count == 9 && FitPeak3x3(result_rho, max_X, max_Y, max_roh))
     {
-        for(i=0;i<6;i++)
-        {
-            for(j=0;j<1;j++)
-            {
-                double sum = 0.0;
-                for(k=0;k<9;k++)
-                    sum += TsubA[i][k]*result_rho[k*1 + j];
-                ATLT[i*1 + j] = sum;
-            }
-        }
+        max_X += snap_offset.m_X;
+        max_Y += snap_offset.m_Y;
         
-        for(i=0;i<6;i++)
-        {
-            for(j=0;j<1;j++)
-            {
-                double sum = 0.0;
-                for(k=0;k<6;k++)
-                    sum += InverseSubA[i][k]*ATLT[k*1 + j];
-                XX[i*1 + j] = sum;
-            }
-        }
+        bool find_index_1   = false;
+        bool find_index_2   = false;
+        bool find_index     = false;
+        if(fabs(max_X) <= 1.0)
+            find_index_1 = true;
+        if(fabs(max_Y) <= 1.0)
+            find_index_2 = true;
+        if (Pyramid_step >= 2)
+            find_index  = find_index_1 & find_index_2 & (max_roh > 0.80);
+        else
+            find_index  = find_index_1 & find_index_2 & (max_roh > 0.60);
         
-        double demnum      = -pow(XX[4],2.0) + 4*XX[3]*XX[5];
-        if(demnum > 0 && XX[3] < 0)
+        if(find_index)
         {
-            double max_X = (- 2*XX[5]*XX[1] + XX[2]*XX[4])/demnum;
-            double max_Y = (- 2*XX[2]*XX[3] + XX[1]*XX[4])/demnum;
-            double max_roh =  XX[0]                + XX[1]*max_X           + XX[2]*max_Y
-            + XX[3]*max_X*max_X + XX[4]*max_X*max_Y + XX[5]*max_Y*max_Y;
+            *sum_weight_X  = max_X*max_roh;
+            *sum_weight_Y  = max_Y*max_roh;
+            *sum_max_roh   = max_roh;
             
-            bool find_index_1   = false;
-            bool find_index_2   = false;
-            bool find_index     = false;
-            if(fabs(max_X) <= 1.0)
-                find_index_1 = true;
-            if(fabs(max_Y) <= 1.0)
-                find_index_2 = true;
-            if (Pyramid_step >= 2)
-                find_index  = find_index_1 & find_index_2 & (max_roh > 0.80);
-            else
-                find_index  = find_index_1 & find_index_2 & (max_roh > 0.60);
+            peak_pos->m_X = max_X;
+            peak_pos->m_Y = max_Y;
             
-            if(find_index)
-            {
-                *sum_weight_X  = max_X*max_roh;
-                *sum_weight_Y  = max_Y*max_roh;
-                *sum_max_roh   = max_roh;
-                
-                peak_pos->m_X = max_X;
-                peak_pos->m_Y = max_Y;
-                
-                check_pt = true;
-            }
+            check_pt = true;
         }
     }
-    free(result_rho);
-    free(ATLT);
-    free(XX);
     
     if(!check_pt)
     {
@@ -933,6 +989,35 @@ bool postNCC_ortho(uint8 Pyramid_step, D2DPOINT Left, D2DPOINT Right, double sub
     return check_pt;
 }
 
+//NCC of two (2*half+1)^2 windows at integer positions. means and variances come from the sum tables,
+//so only the cross product is summed here. -99 when either window is incomplete
+template <typename T>
+double BoxNCC(const NCCSumTable &table_left, const NCCSumTable &table_right, const T *_leftimage, const T *_rightimage, const long col_left, const long row_left, const long col_right, const long row_right, const int half)
+{
+    double Sum_L, Sum_L2, Sum_R, Sum_R2;
+    if(!table_left.GetWindowSum(col_left, row_left, half, Sum_L, Sum_L2) || !table_right.GetWindowSum(col_right, row_right, half, Sum_R, Sum_R2))
+        return -99;
+    
+    const long width_left = table_left.size.width;
+    const long width_right = table_right.size.width;
+    double Sum_LR = 0;
+    for(long row = -half ; row <= half ; row++)
+    {
+        const T *left = _leftimage + (row_left + row)*width_left + col_left - half;
+        const T *right = _rightimage + (row_right + row)*width_right + col_right - half;
+        for(long col = 0 ; col <= 2*half ; col++)
+            Sum_LR += (double)left[col]*(double)right[col];
+    }
+    
+    const double N = (2*half + 1)*(2*half + 1);
+    const double val1 = Sum_L2 - Sum_L*Sum_L/N;
+    const double val2 = Sum_R2 - Sum_R*Sum_R/N;
+    if(val1*val2 > 0)
+        return (Sum_LR - Sum_L*Sum_R/N)/sqrt(val1*val2);
+    else
+        return -1.0;
+}
+
 inline double SQRT(D2DPOINT a)
 {
     return sqrt( SQ(a.m_X) + SQ(a.m_Y) );
@@ -979,6 +1064,22 @@ inline double SignedCharToDouble_grid(short val)
     return (double)(val)/1000.0;
 }
 
+inline long int OrthoNCCIndex(const long int Grid_length, const int ti, const long int pt_index)
+{
+    return (long int)(ti - 1)*Grid_length + pt_index;
+}
+
+//same node coordinates as SetDEMGrid
+inline D3DPOINT GridToMapPoint(const D3DPOINTGRID &pt, const double *Boundary, const double grid_resolution)
+{
+    return D3DPOINT(Boundary[0] + pt.col*grid_resolution, Boundary[1] + pt.row*grid_resolution, pt.m_Z, pt.flag);
+}
+
+inline D3DPOINTGRID MapToGridPoint(const D3DPOINT &pt, const double *Boundary, const double grid_resolution)
+{
+    return D3DPOINTGRID((int)((pt.m_X - Boundary[0])/grid_resolution + 0.5), (int)((pt.m_Y - Boundary[1])/grid_resolution + 0.5), (float)pt.m_Z, pt.flag);
+}
+
 inline short DoubleToSignedChar_voxel(double val)
 {
     return (short)(val*1000.0);
@@ -1000,31 +1101,44 @@ inline float SignedCharToFloat(signed char val)
     return (float)(val/100.0);
 }
 
-inline void Set6by6Matrix(double subA[][6], double TsubA[][9], double InverseSubA[][6])
+//quadratic surface z = XX[0] + XX[1]*x + XX[2]*y + XX[3]*x^2 + XX[4]*xy + XX[5]*y^2 fitted to a 3x3 correlation grid
+//(rho[(y+1)*3 + (x+1)]). on this fixed grid the normal equations have a closed-form inverse, so the least-squares
+//coefficients are plain weighted sums. false when the surface has no maximum
+inline bool FitPeak3x3(const double *rho, double &max_X, double &max_Y, double &max_roh)
 {
-    for(int ii=0;ii<9;ii++)
-        subA[ii][0]   = 1.0;
+    double S = 0, Sx = 0, Sy = 0, Sxy = 0, Sx2 = 0, Sy2 = 0;
+    for(int y = -1 ; y <= 1 ; y++)
+    {
+        for(int x = -1 ; x <= 1 ; x++)
+        {
+            const double z = rho[(y+1)*3 + (x+1)];
+            S   += z;
+            Sx  += x*z;
+            Sy  += y*z;
+            Sxy += x*y*z;
+            Sx2 += x*x*z;
+            Sy2 += y*y*z;
+        }
+    }
+    
+    double XX[6];
+    XX[0] = 5.0/9.0*S - (Sx2 + Sy2)/3.0;
+    XX[1] = Sx/6.0;
+    XX[2] = Sy/6.0;
+    XX[3] = Sx2/2.0 - S/3.0;
+    XX[4] = Sxy/4.0;
+    XX[5] = Sy2/2.0 - S/3.0;
     
-    subA[0][1] = -1.0; subA[0][2] = -1.0; subA[0][3] =  1.0; subA[0][4] =  1.0; subA[0][5] =  1.0;
-    subA[1][1] =  0.0; subA[1][2] = -1.0; subA[1][3] =  0.0; subA[1][4] =  0.0; subA[1][5] =  1.0;
-    subA[2][1] =  1.0; subA[2][2] = -1.0; subA[2][3] =  1.0; subA[2][4] = -1.0; subA[2][5] =  1.0;
-    subA[3][1] = -1.0; subA[3][2] =  0.0; subA[3][3] =  1.0; subA[3][4] =  0.0; subA[3][5] =  0.0;
-    subA[4][1] =  0.0; subA[4][2] =  0.0; subA[4][3] =  0.0; subA[4][4] =  0.0; subA[4][5] =  0.0;
-    subA[5][1] =  1.0; subA[5][2] =  0.0; subA[5][3] =  1.0; subA[5][4] =  0.0; subA[5][5] =  0.0;
-    subA[6][1] = -1.0; subA[6][2] =  1.0; subA[6][3] =  1.0; subA[6][4] = -1.0; subA[6][5] =  1.0;
-    subA[7][1] =  0.0; subA[7][2] =  1.0; subA[7][3] =  0.0; subA[7][4] =  0.0; subA[7][5] =  1.0;
-    subA[8][1] =  1.0; subA[8][2] =  1.0; subA[8][3] =  1.0; subA[8][4] =  1.0; subA[8][5] =  1.0;
+    const double demnum = -XX[4]*XX[4] + 4*XX[3]*XX[5];
+    if(demnum <= 0 || XX[3] >= 0)
+        return false;
     
-    for(int ii=0;ii<6;ii++)
-        for(int kk=0;kk<9;kk++)
-            TsubA[ii][kk]       = subA[kk][ii];
+    max_X = (- 2*XX[5]*XX[1] + XX[2]*XX[4])/demnum;
+    max_Y = (- 2*XX[2]*XX[3] + XX[1]*XX[4])/demnum;
+    max_roh =  XX[0]                + XX[1]*max_X           + XX[2]*max_Y
+        + XX[3]*max_X*max_X + XX[4]*max_X*max_Y + XX[5]*max_Y*max_Y;
     
-    InverseSubA[0][0] =  0.555556; InverseSubA[0][1] =  0.000000; InverseSubA[0][2] =  0.000000; InverseSubA[0][3] = -0.333333; InverseSubA[0][4] =  0.000000; InverseSubA[0][5] = -0.333333;
-    InverseSubA[1][0] =  0.000000; InverseSubA[1][1] =  0.166667; InverseSubA[1][2] =  0.000000; InverseSubA[1][3] =  0.000000; InverseSubA[1][4] =  0.000000; InverseSubA[1][5] =  0.000000;
-    InverseSubA[2][0] =  0.000000; InverseSubA[2][1] =  0.000000; InverseSubA[2][2] =  0.166667; InverseSubA[2][3] =  0.000000; InverseSubA[2][4] =  0.000000; InverseSubA[2][5] =  0.000000;
-    InverseSubA[3][0] = -0.333333; InverseSubA[3][1] =  0.000000; InverseSubA[3][2] =  0.000000; InverseSubA[3][3] =  0.500000; InverseSubA[3][4] =  0.000000; InverseSubA[3][5] =  0.000000;
-    InverseSubA[4][0] =  0.000000; InverseSubA[4][1] =  0.000000; InverseSubA[4][2] =  0.000000; InverseSubA[4][3] =  0.000000; InverseSubA[4][4] =  0.250000; InverseSubA[4][5] =  0.000000;
-    InverseSubA[5][0] = -0.333333; InverseSubA[5][1] =  0.000000; InverseSubA[5][2] =  0.000000; InverseSubA[5][3] =  0.000000; InverseSubA[5][4] =  0.000000; InverseSubA[5][5] =  0.500000;
+    return true;
 }
 
 #endif /* Template_h */
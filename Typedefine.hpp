@@ -200,6 +200,22 @@ typedef struct tagD3DPointSave
     float m_Z;
 } D3DPOINTSAVE;
 
+//matched point on a grid node of the current level, 16 bytes instead of 32 for D3DPOINT
+typedef struct tagD3DPointGrid
+{
+    int col;
+    int row;
+    float m_Z;
+    uint8 flag;
+    
+    tagD3DPointGrid():col(0),row(0),m_Z(0),flag(0)
+    {
+    }
+    tagD3DPointGrid(int col, int row, float m_Z, uint8 flag = 0):col(col),row(row),m_Z(m_Z),flag(flag)
+    {
+    }
+} D3DPOINTGRID;
+
 typedef struct tagTransParam
 {
 	double t_c, m_c;
@@ -245,29 +261,77 @@ typedef struct tagNCCflag
 	uint8 weight_flag;
 } NCCflag;
 
+//one cell of NCCresult, bound by reference to the column entries so nccresult[i].field reads and writes in place
+typedef struct tagNCCresultCell
+{
+    float &result2; //first peak height
+    float &result3; //second peak height
+    short &minHeight;
+    short &maxHeight;
+    
+	short &result0; //first peak roh
+	short &result1; //second peak roh
+	short &max_WNCC;
+    
+    short &GNCC;
+    unsigned short &NumOfHeight;
+	unsigned char &result4; //peak count
+    bool &check_height_change;
+} NCCresultCell;
+
+//per-cell matching state as structure-of-arrays columns in one block (24 bytes per cell).
+//each pass streams only the columns it touches; nccresult[i] gives the NCCresultCell view
 typedef struct tagNCCresult
 {
-    float result2; //first peak height
-    float result3; //second peak height
-    short minHeight;
-    short maxHeight;
-    
-	short result0; //first peak roh
-	short result1; //second peak roh
-	short max_WNCC;
-    
-    short GNCC;
-    unsigned short NumOfHeight;
-    //float *GNCC_multi;
-	unsigned char result4; //peak count
+    float *result2;
+    float *result3;
+    short *minHeight;
+    short *maxHeight;
+    short *result0;
+    short *result1;
+    short *max_WNCC;
+    short *GNCC;
+    unsigned short *NumOfHeight;
+    unsigned char *result4;
+    bool *check_height_change;
+    
+    static size_t CellBytes()
+    {
+        return 2*sizeof(float) + 6*sizeof(short) + sizeof(unsigned short) + sizeof(unsigned char) + sizeof(bool);
+    }
     
-    //int max_WNCC_pos;
-	
+    //zero-filled, like the calloc of the struct array it replaces
+    bool Alloc(const long int length)
+    {
+        char *block = (char*)calloc(CellBytes(),length);
+        result2             = (float*)block;
+        result3             = result2 + length;
+        minHeight           = (short*)(result3 + length);
+        maxHeight           = minHeight + length;
+        result0             = maxHeight + length;
+        result1             = result0 + length;
+        max_WNCC            = result1 + length;
+        GNCC                = max_WNCC + length;
+        NumOfHeight         = (unsigned short*)(GNCC + length);
+        result4             = (unsigned char*)(NumOfHeight + length);
+        check_height_change = (bool*)(result4 + length);
+        return block != NULL;
+    }
+    
+    void Free()
+    {
+        free(result2);
+        result2 = NULL;
+    }
     
-    bool check_height_change;
-	//int roh_count;
+    NCCresultCell operator[](const long int i) const
+    {
+        NCCresultCell cell = {result2[i], result3[i], minHeight[i], maxHeight[i], result0[i], result1[i], max_WNCC[i], GNCC[i], NumOfHeight[i], result4[i], check_height_change[i]};
+        return cell;
+    }
 } NCCresult;
 
+//16 bytes per cell; per-image ortho NCC lives in the LevelInfo::ortho_ncc planes
 typedef struct UpdateGrid{
     float Height; //after blunder detection
 	short minHeight;
@@ -275,7 +339,6 @@ typedef struct UpdateGrid{
 	
 	
 	short roh;
-	short ortho_ncc[MaxNCC];
     short Mean_ortho_ncc;
 
     unsigned char Matched_flag;
@@ -283,6 +346,13 @@ typedef struct UpdateGrid{
     
 }UGRID;
 
+//UGRID buffer kept between pyramid levels and tiles instead of calloc/free per level
+typedef struct tagUGRIDArena
+{
+    UGRID *buffer;
+    long int length;
+} UGRIDArena;
+
 typedef struct tagVoxelinfo
 {
     //float ANCC;
@@ -375,6 +445,8 @@ typedef struct ProjectInfo{
     uint8 SDM_SS;
     double SDM_AS;
     double SDM_days;
+    bool check_SDM_FFT; //FFT shift search in VerticalLineLocus_SDM from SDM_FFT_LEVEL up
+    bool check_SDM_merge; //tile products are kept as raw planes for MergeTiles_SDM
     uint8 image_bits;
     
 	char Imagefilename[MaxImages][500];
@@ -384,6 +456,7 @@ typedef struct ProjectInfo{
 	char tmpdir[500];
 	char tile_info[500];
 	char priori_DEM_tif[500];
+	char seedDEMsigma_map[500];
 	char metafilename[500];
 	
 	bool check_minH;
@@ -401,6 +474,12 @@ typedef struct ProjectInfo{
     bool check_selected_image[MaxImages];
     bool check_full_cal;
     
+    int max_pairs; //number of targets matched against the reference per tile, 0 uses all
+    double pair_score[MaxImages];
+    int seedDEMsigma_mode; //0 uses seedDEMsigma everywhere, 1 per-cell sigma raster, 2 sigma from seed DEM relief
+    double height_sweep_th; //coarse-to-fine height sweep in VerticalLineLocus, 0 evaluates every height
+    bool check_box_NCC; //sum-table NCC on axis-aligned windows from BOX_NCC_LEVEL up
+    
     //SGM test flag
     bool check_SNCC;
     bool check_updateheight;
@@ -453,14 +532,21 @@ typedef struct ArgumentInfo{
     int ortho_count;
     int RA_only;
     int number_of_images; // 2 is for stereo (default), n is for multi more than 3
+    int max_pairs;
+    int seedDEMsigma_mode;
+    double height_sweep_th;
+    bool check_box_NCC;
     uint8 pyramid_level;
     uint8 SDM_SS;
+    bool check_SDM_FFT;
+    bool check_SDM_merge;
     int DS_kernel;
     
     char Image[MaxImages][500];
 	char Outputpath[500];
 	char Outputpath_name[500];
 	char seedDEMfilename[500];
+	char seedDEMsigma_map[500];
 	char metafilename[500];
     char EO_Path[500];
     char DEM_input_file[500];
@@ -500,6 +586,7 @@ typedef struct ArgumentInfo{
     int check_coreg;
     int check_sdm_ortho;
     int check_DEM_coreg_output;
+    int coreg_batch_threads; //targets (images or DEMs) coregistered concurrently against one reference
     
     //SGM test flag
     bool check_SNCC;
@@ -598,6 +685,19 @@ typedef struct tagConformalparam
     float Tz;
 } Conformalparam;
 
+//reference side of a DEM coregistration control point. it depends only on the point and the normalization,
+//not on the conformal parameters, so it is set once before the adjustment iterations
+typedef struct tagRefSurfacePoint
+{
+    D3DPOINT normal;
+    D3DPOINT normal_ori;
+    double height;
+    double roh_array[9];
+    double slope;
+    double aspect;
+    bool check_valid;
+} RefSurfacePoint;
+
 typedef struct taglevelinfo
 {
     const uint16 * const *py_Images;
@@ -637,6 +737,7 @@ typedef struct taglevelinfo
     const int *Py_combined_level;
     const unsigned char *iteration;
     bool *check_matching_rate;
+    short *ortho_ncc; //one plane of Grid_length per target image, see OrthoNCCIndex
 } LevelInfo;
 
 class Matrix {
@@ -749,5 +850,69 @@ typedef struct tagSetKernel
     ~tagSetKernel() {
     }
 } SetKernel;
+
+//integral images of an integer image for NCC over axis-aligned windows at integer positions.
+//window sum, sum of squares and valid pixel count are O(1) lookups. pixels <= min_value are invalid
+#define BOX_NCC_LEVEL 3
+
+typedef struct tagNCCSumTable
+{
+    CSize size;
+    vector<uint64> sum;
+    vector<uint64> sum2;
+    vector<uint32> count;
+
+    template <typename T>
+    void Set(const T *image, const CSize &image_size, const double min_value)
+    {
+        size = image_size;
+        const long width = (long)size.width + 1;
+        const long total = width*((long)size.height + 1);
+        sum.assign(total,0);
+        sum2.assign(total,0);
+        count.assign(total,0);
+
+        for(long row = 0 ; row < size.height ; row++)
+        {
+            uint64 row_sum = 0, row_sum2 = 0;
+            uint32 row_count = 0;
+            for(long col = 0 ; col < size.width ; col++)
+            {
+                const T value = image[row*(long)size.width + col];
+                if(value > min_value)
+                {
+                    row_sum += (uint64)value;
+                    row_sum2 += (uint64)value*(uint64)value;
+                    row_count++;
+                }
+                const long index = (row + 1)*width + col + 1;
+                sum[index] = sum[index - width] + row_sum;
+                sum2[index] = sum2[index - width] + row_sum2;
+                count[index] = count[index - width] + row_count;
+            }
+        }
+    }
+
+    //false when the (2*half+1)^2 window leaves the image or holds invalid pixels
+    bool GetWindowSum(const long col, const long row, const int half, double &S, double &S2) const
+    {
+        if(col - half < 0 || row - half < 0 || col + half >= size.width || row + half >= size.height)
+            return false;
+
+        const long width = (long)size.width + 1;
+        const long i00 = (row - half)*width + col - half;
+        const long i01 = (row - half)*width + col + half + 1;
+        const long i10 = (row + half + 1)*width + col - half;
+        const long i11 = (row + half + 1)*width + col + half + 1;
+
+        const uint32 N = count[i11] - count[i01] - count[i10] + count[i00];
+        if(N != (uint32)((2*half + 1)*(2*half + 1)))
+            return false;
+
+        S = (double)(sum[i11] - sum[i01] - sum[i10] + sum[i00]);
+        S2 = (double)(sum2[i11] - sum2[i01] - sum2[i10] + sum2[i00]);
+        return true;
+    }
+} NCCSumTable;
 #endif
 
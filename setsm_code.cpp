@@ -14,7 +14,6 @@
  * limitations under the License.
  */
 
-#include <atomic>
 #include <memory>
 
 #include "setsm_code.hpp"
@@ -63,7 +62,14 @@ int main(int argc,char *argv[])
     args.SDM_SS = 3;
     args.SDM_AS = 20.0;
     args.SDM_days = 1;
+    args.check_SDM_FFT = false;
+    args.check_SDM_merge = false;
     args.number_of_images = 2;
+    args.max_pairs = 0;
+    args.seedDEMsigma_mode = 0;
+    args.seedDEMsigma_map[0] = '\0';
+    args.height_sweep_th = 0;
+    args.check_box_NCC = false;
     args.check_arg = 0;
     args.check_DEM_space = false;
     args.check_Threads_num = false;
@@ -97,6 +103,7 @@ int main(int argc,char *argv[])
     args.check_sdm_ortho = 0; //no coreg = 1 , with coreg = 2
     args.check_DEM_coreg_output = false;
     args.check_txt_input = 0; //no txt input = 0, DEM coregistration txt input = 1;
+    args.coreg_batch_threads = 1;
     args.check_downsample = false;
     args.check_DS_txy = false;
     
@@ -187,6 +194,13 @@ int main(int argc,char *argv[])
             printf("\t[-seed filepath sigma]\t: Seed DEM(tif or binary format with envi header file for reducing computation loads with a height accuracy[m] of seed dem\n");
             printf("\t\t(if this option is set, setsm defines serach-spaces between + 1*sigma and - 1*sigma for calculating a height of grid position.\n");
             printf("\t\tThis option is not recommended on very changeable area. setsm can reconstruct 3D surface information without any seed dem\n");
+            printf("\t[-seedsigmamap filepath or auto]\t: Per-pixel height accuracy[m] of the seed dem as a tif raster, or auto to derive it from local seed dem relief.\n");
+            printf("\t\tSearch-spaces shrink on flat terrain, and the -seed sigma is the upper limit for auto\n");
+            printf("\t[-heightsweep value]\t: Coarse-to-fine height search. A cheap NCC every 4th height keeps only heights near the best peaks within value (e.g. 0.2) of the maximum. Default is 0 (full search)\n");
+            printf("\t[-boxncc value]\t: 1 uses sum-table NCC on pixel-aligned square windows at coarse pyramid levels (coarse height sweep, image coregistration). Default is 0\n");
+            printf("\t[-coreg_batch value]\t: Number of targets coregistered at the same time against the once-loaded reference (first image, or first DEM of a -txt_input list). Default is 1\n");
+            printf("\t[-sdm_fft value]\t: 1 finds the SDM shifts at coarse pyramid levels from an FFT cross-correlation of each grid point, then checks the peak with the multi-scale NCC. Default is 0\n");
+            printf("\t[-sdm_merge value]\t: 1 rewrites the SDM dx, dy, dmag and roh rasters as tiled, compressed GeoTIFFs merged from the raw tile planes in row bands. Default is 0\n");
             printf("\t[-boundary_min_X value1 -boundary_min_Y value2 -boundary_max_X value3 -boundary_max_Y value4]\t: Define specific DEM area to generate. The X and Y coordinate values should be Polar Stereographic or UTM\n");
             printf("\t[-tilesize value]\t: Set a tilesize for one time processing. Default is 8,000 pixels\n");
             printf("\t[-projection value]\t: Set planemetric coordinate projection. The value is 'ps' or 'utm'. Default projection is automatically defined by latitude of the input information of xml (between 60N and 60S is utm, and other is ps\n");
@@ -351,6 +365,21 @@ int main(int argc,char *argv[])
                 }
             }
             
+            if (strcmp("-coreg_batch",argv[i]) == 0)
+            {
+                if (argc == i+1) {
+                    printf("Please input the number of target DEMs to coregister at the same time (default is 1)\n");
+                    cal_flag = false;
+                }
+                else
+                {
+                    args.coreg_batch_threads = atoi(argv[i+1]);
+                    if(args.coreg_batch_threads < 1)
+                        args.coreg_batch_threads = 1;
+                    printf("Coregistration batch threads %d\n",args.coreg_batch_threads);
+                }
+            }
+            
             if (strcmp("-coreg_output",argv[i]) == 0)
             {
                 if (argc == i+1) {
@@ -720,6 +749,32 @@ int main(int argc,char *argv[])
                     }
                 }
                 
+                if (strcmp("-SDM_FFT",argv[i]) == 0 || strcmp("-sdm_fft",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input 1 to use the FFT shift search at coarse SDM levels (default is 0)\n");
+                        cal_flag = false;
+                    }
+                    else
+                    {
+                        args.check_SDM_FFT = atoi(argv[i+1]) > 0;
+                        printf("SDM FFT shift search %d\n",args.check_SDM_FFT);
+                    }
+                }
+                
+                if (strcmp("-SDM_MERGE",argv[i]) == 0 || strcmp("-sdm_merge",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input 1 to merge the SDM products into tiled GeoTIFFs (default is 0)\n");
+                        cal_flag = false;
+                    }
+                    else
+                    {
+                        args.check_SDM_merge = atoi(argv[i+1]) > 0;
+                        printf("SDM tile merge %d\n",args.check_SDM_merge);
+                    }
+                }
+                
                 if (strcmp("-SDM_DAYS",argv[i]) == 0 || strcmp("-sdm_days",argv[i]) == 0)
                 {
                     if (argc == i+1) {
@@ -795,6 +850,45 @@ int main(int argc,char *argv[])
                     }
                 }
                 
+                if (strcmp("-maxpairs",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input the number of target images matched with the reference per tile (default is 0 for all)\n");
+                        cal_flag = false;
+                    }
+                    else
+                    {
+                        args.max_pairs = atoi(argv[i+1]);
+                        printf("Max pairs per tile %d\n",args.max_pairs);
+                    }
+                }
+                
+                if (strcmp("-heightsweep",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input the NCC threshold of the coarse height sweep (default is 0 for the full sweep)\n");
+                        cal_flag = false;
+                    }
+                    else
+                    {
+                        args.height_sweep_th = atof(argv[i+1]);
+                        printf("Height sweep threshold %f\n",args.height_sweep_th);
+                    }
+                }
+                
+                if (strcmp("-boxncc",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input 1 to use the sum-table NCC at coarse levels (default is 0)\n");
+                        cal_flag = false;
+                    }
+                    else
+                    {
+                        args.check_box_NCC = atoi(argv[i+1]) > 0;
+                        printf("Box NCC %d\n",args.check_box_NCC);
+                    }
+                }
+                
                 if (strcmp("-FL",argv[i]) == 0)
                 {
                     if (argc == i+1) {
@@ -1166,6 +1260,25 @@ int main(int argc,char *argv[])
                     }
                 }
                 
+                if (strcmp("-seedsigmamap",argv[i]) == 0)
+                {
+                    if (argc == i+1) {
+                        printf("Please input the seed DEM sigma raster, or auto to derive it from the seed DEM\n");
+                        cal_flag = false;
+                    }
+                    else if (strcmp("auto",argv[i+1]) == 0)
+                    {
+                        args.seedDEMsigma_mode = 2;
+                        printf("Seed DEM sigma from seed DEM relief\n");
+                    }
+                    else
+                    {
+                        sprintf(args.seedDEMsigma_map,"%s",argv[i+1]);
+                        args.seedDEMsigma_mode = 1;
+                        printf("Seed DEM sigma raster %s\n",args.seedDEMsigma_map);
+                    }
+                }
+                
                 if (strcmp("-tilesSR",argv[i]) == 0) 
                 {
                     if (argc == i+1) {
@@ -1536,8 +1649,9 @@ int main(int argc,char *argv[])
                                 
                                 if(!args.check_Matchtag)
                                 {
-                                    orthogeneration(param,args,args.Image[0], DEMFilename, Outputpath,1,DEM_divide,Imageparams);
-                                    orthogeneration(param,args,args.Image[1], DEMFilename, Outputpath,2,DEM_divide,Imageparams);
+                                    char *ortho_images[2] = {args.Image[0], args.Image[1]};
+                                    const int ortho_pairs[2] = {1, 2};
+                                    orthogeneration_multi(param,args,ortho_images,ortho_pairs,2, DEMFilename, Outputpath,DEM_divide,Imageparams);
                                 }
                                 //else if(args.ortho_count == 2)
                                 //    orthogeneration(param,args,args.Image[1], DEMFilename, Outputpath,2,DEM_divide,Imageparams);
@@ -1552,8 +1666,9 @@ int main(int argc,char *argv[])
                                     sprintf(DEMFilename, "%s/%s_%d_dem.tif", save_filepath,args.Outputpath_name,iter);
                                     if(!args.check_Matchtag)
                                     {
-                                        orthogeneration(param,args,args.Image[0], DEMFilename, Outputpath,1,iter,Imageparams);
-                                        orthogeneration(param,args,args.Image[1], DEMFilename, Outputpath,2,iter,Imageparams);
+                                        char *ortho_images[2] = {args.Image[0], args.Image[1]};
+                                        const int ortho_pairs[2] = {1, 2};
+                                        orthogeneration_multi(param,args,ortho_images,ortho_pairs,2, DEMFilename, Outputpath,iter,Imageparams);
                                     }
                                     //else if(args.ortho_count == 2)
                                     //    orthogeneration(param,args,args.Image[1], DEMFilename, Outputpath,2,iter,Imageparams);
@@ -1710,6 +1825,13 @@ int SETSMmainfunction(TransParam *return_param, char* _filename, ARGINFO args, c
     }
     ProInfo *proinfo = new ProInfo;
     proinfo->number_of_images = args.number_of_images;
+    proinfo->max_pairs = args.max_pairs;
+    proinfo->seedDEMsigma_mode = args.seedDEMsigma_mode;
+    proinfo->height_sweep_th = args.height_sweep_th;
+    proinfo->check_box_NCC = args.check_box_NCC;
+    sprintf(proinfo->seedDEMsigma_map,"%s",args.seedDEMsigma_map);
+    for(int ti = 0 ; ti < MaxImages ; ti++)
+        proinfo->pair_score[ti] = 1.0;
     proinfo->sensor_type = args.sensor_type;
     proinfo->System_memory = args.System_memory;
     proinfo->pyramid_level = args.pyramid_level;
@@ -1761,8 +1883,16 @@ int SETSMmainfunction(TransParam *return_param, char* _filename, ARGINFO args, c
                 printf("param projection %d\tzone %d\n",param.projection,param.utm_zone);
                 char DEMFilename[500];
                 sprintf(DEMFilename, "%s", args.seedDEMfilename);
+                char **ortho_images = (char**)malloc(sizeof(char*)*proinfo->number_of_images);
+                int *ortho_pairs = (int*)malloc(sizeof(int)*proinfo->number_of_images);
                 for(int ti = 0 ; ti < proinfo->number_of_images ; ti++)
-                    orthogeneration(param,args,args.Image[ti], DEMFilename, Outputpath,1,0,Imageparams);
+                {
+                    ortho_images[ti] = args.Image[ti];
+                    ortho_pairs[ti] = 1;
+                }
+                orthogeneration_multi(param,args,ortho_images,ortho_pairs,proinfo->number_of_images, DEMFilename, Outputpath,0,Imageparams);
+                free(ortho_images);
+                free(ortho_pairs);
 
                 for(int ti = 0 ; ti < proinfo->number_of_images ; ti++)
                     RPCsFree(RPCs[ti]);
@@ -1927,6 +2057,15 @@ int SETSMmainfunction(TransParam *return_param, char* _filename, ARGINFO args, c
                             convergence_angle = 40;
                         }
                     }
+                    
+                    if(args.sensor_provider == DG && proinfo->number_of_images > 2)
+                    {
+                        for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
+                        {
+                            proinfo->pair_score[ti] = GetImagePairScore(image_info[0], image_info[ti]);
+                            printf("pair 1-%d score %f\n",ti+1,proinfo->pair_score[ti]);
+                        }
+                    }
                 }
                 
                 if(!args.check_imageresolution)
@@ -3017,6 +3156,9 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
     }
 #endif
 
+    //UGRID buffer reused by ResizeGirdPT3 across levels and tiles
+    UGRIDArena grid_arena = {NULL, 0};
+    
     int tile_iter, i;
     while((tile_iter = tile_indices->next()) != -1)
     {
@@ -3142,7 +3284,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
             time_t PreST = 0, PreET = 0;
             double Pregab = 0;
             
-            LevelInfo levelinfo = {NULL};
+            LevelInfo levelinfo = {};
             levelinfo.RPCs = RPCs;
             levelinfo.Boundary = subBoundary;
             levelinfo.Template_size = &Template_size;
@@ -3159,6 +3301,9 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                     count_available_images++;
             }
             
+            if(count_available_images > 2 && proinfo->max_pairs > 0 && !proinfo->IsRA)
+                count_available_images = SelectImagePairs(proinfo, levelinfo, minmaxHeight, SourceImages);
+            
             if(count_available_images >= 2)
             {
                 printf("Completion of subsetImage!!\n");
@@ -3183,6 +3328,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                     CSize Size_Grid2D(0,0), pre_Size_Grid2D(0,0);
                     CSize **data_size_lr = (CSize**)malloc(sizeof(CSize*)*proinfo->number_of_images);
                     UGRID *GridPT3 = NULL, *Pre_GridPT3 = NULL;
+                    short *GridPT3_ortho_ncc = NULL;
                      
                     if(!proinfo->check_Matchtag)
                     {
@@ -3506,7 +3652,10 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                             printf("GridPT3 start\t seed flag %d\t filename %s\timage_resolution %f minmax %f %f\n", proinfo->pre_DEMtif, proinfo->priori_DEM_tif, Image_res[0], minmaxHeight[0], minmaxHeight[1]);
                             if (GridPT3)
                                 free(GridPT3);
+                            if (GridPT3_ortho_ncc)
+                                free(GridPT3_ortho_ncc);
                             GridPT3 = SetGrid3PT(proinfo, levelinfo, Th_roh, minmaxHeight);
+                            GridPT3_ortho_ncc = SetOrthoNCCPlanes(proinfo, Grid_length);
                         }
                         
                         if(flag_start)
@@ -3515,7 +3664,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                             {
                                 if(check_new_subBoundary_RA)
                                 {
-                                    GridPT3 = ResizeGirdPT3_RA(proinfo, pre_Size_Grid2D, Size_Grid2D, preBoundary,subBoundary, GridPT, Pre_GridPT3, pre_grid_resolution,minmaxHeight);
+                                    GridPT3 = ResizeGirdPT3_RA(proinfo, pre_Size_Grid2D, Size_Grid2D, preBoundary,subBoundary, GridPT, Pre_GridPT3, &GridPT3_ortho_ncc, &grid_arena, pre_grid_resolution, grid_resolution, minmaxHeight);
                                     
                                     check_new_subBoundary_RA = false;
                                     
@@ -3524,18 +3673,20 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                 else
                                 {
                                     printf("start ResizeGridPT3 pre size %d %d size %d %d pre_resol %f\n",pre_Size_Grid2D.width,pre_Size_Grid2D.height,Size_Grid2D.width,Size_Grid2D.height,pre_grid_resolution);
-                                    GridPT3 = ResizeGirdPT3(proinfo, pre_Size_Grid2D, Size_Grid2D, subBoundary, GridPT, Pre_GridPT3, pre_grid_resolution,minmaxHeight);
+                                    GridPT3 = ResizeGirdPT3(proinfo, pre_Size_Grid2D, Size_Grid2D, subBoundary, GridPT, Pre_GridPT3, &GridPT3_ortho_ncc, &grid_arena, pre_grid_resolution, grid_resolution, minmaxHeight);
                                 }
                             }
                             else
                             {
                                 printf("start ResizeGridPT3 pre size %d %d size %d %d pre_resol %f\n",pre_Size_Grid2D.width,pre_Size_Grid2D.height,Size_Grid2D.width,Size_Grid2D.height,pre_grid_resolution);
-                                GridPT3 = ResizeGirdPT3(proinfo, pre_Size_Grid2D, Size_Grid2D, subBoundary, GridPT, Pre_GridPT3, pre_grid_resolution,minmaxHeight);
+                                GridPT3 = ResizeGirdPT3(proinfo, pre_Size_Grid2D, Size_Grid2D, subBoundary, GridPT, Pre_GridPT3, &GridPT3_ortho_ncc, &grid_arena, pre_grid_resolution, grid_resolution, minmaxHeight);
                             }
                         }
                         
                         printf("end start ResizeGridPT3 minmax height %f\t%f\n",minmaxHeight[0],minmaxHeight[1]);
                         
+                        levelinfo.ortho_ncc = GridPT3_ortho_ncc;
+                        
                         pre_Size_Grid2D.width = Size_Grid2D.width;
                         pre_Size_Grid2D.height = Size_Grid2D.height;
                         pre_grid_resolution = grid_resolution;
@@ -3619,7 +3770,8 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                         
                         printf("final MPP %f\t%f\n",MPP_simgle_image,MPP_stereo_angle);
                         
-                        NCCresult *nccresult = (NCCresult*)calloc(sizeof(NCCresult),Grid_length);
+                        NCCresult nccresult;
+                        nccresult.Alloc(Grid_length);
                         
                         levelinfo.check_matching_rate = &check_matching_rate;
                         
@@ -3710,7 +3862,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                             else
                                 MPP = MPP_simgle_image;
                             
-                            vector<D3DPOINT> MatchedPts_list;
+                            vector<D3DPOINTGRID> MatchedPts_list;
                             
                             count_MPs = SelectMPs(proinfo, levelinfo, nccresult, GridPT3, Th_roh, Th_roh_min, Th_roh_start, Th_roh_next, iteration, MPP, final_level_iteration, MPP_stereo_angle, &MatchedPts_list);
                             
@@ -3718,10 +3870,9 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                             
                             D3DPOINT *ptslists = NULL;
                             
-                            vector<D3DPOINT>::iterator it;
-                            vector<D3DPOINT> MatchedPts_list_mps;
-                            vector<D3DPOINT> MatchedPts_list_blunder;
-                            vector<D3DPOINT> MatchedPts_list_anchor;
+                            vector<D3DPOINTGRID> MatchedPts_list_mps;
+                            vector<D3DPOINTGRID> MatchedPts_list_blunder;
+                            vector<D3DPOINTGRID> MatchedPts_list_anchor;
                             
                             if(count_MPs > 10)
                             {
@@ -3732,7 +3883,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     ptslists = (D3DPOINT*)malloc(sizeof(D3DPOINT)*MatchedPts_list.size());
                                     
                                     for(long count_pt = 0 ; count_pt < MatchedPts_list.size() ; count_pt ++)
-                                        ptslists[count_pt] = MatchedPts_list[count_pt];
+                                        ptslists[count_pt] = GridToMapPoint(MatchedPts_list[count_pt], subBoundary, grid_resolution);
                                     
                                     DecisionMPs(proinfo, levelinfo, false,count_MPs,GridPT3, iteration, Hinterval,count_results_anchor, &minH_mps,&maxH_mps,minmaxHeight, ptslists);
                                     
@@ -3742,7 +3893,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     {
                                         if(ptslists[tcnt].flag != 1 && ptslists[tcnt].m_X >= subBoundary[0] && ptslists[tcnt].m_X <= subBoundary[2] && ptslists[tcnt].m_Y >= subBoundary[1] && ptslists[tcnt].m_Y <= subBoundary[3])
                                         {
-                                            MatchedPts_list_anchor.push_back(ptslists[tcnt]);
+                                            MatchedPts_list_anchor.push_back(MapToGridPoint(ptslists[tcnt], subBoundary, grid_resolution));
                                             count_results_anchor[0]++;
                                         }
                                         ptslists[tcnt].flag = 0;
@@ -3759,7 +3910,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     {
                                         if(ptslists[tcnt].flag != 1 && ptslists[tcnt].m_X >= subBoundary[0] && ptslists[tcnt].m_X <= subBoundary[2] && ptslists[tcnt].m_Y >= subBoundary[1] && ptslists[tcnt].m_Y <= subBoundary[3])
                                         {
-                                            MatchedPts_list_blunder.push_back(ptslists[tcnt]);
+                                            MatchedPts_list_blunder.push_back(MapToGridPoint(ptslists[tcnt], subBoundary, grid_resolution));
                                             count_results[0]++;
                                             
                                             if(minH_mps > ptslists[tcnt].m_Z)
@@ -3777,7 +3928,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     printf("blunder detection for all points\n");
                                     ptslists = (D3DPOINT*)malloc(sizeof(D3DPOINT)*MatchedPts_list.size());
                                     for(long count_pt = 0 ; count_pt < MatchedPts_list.size() ; count_pt ++)
-                                        ptslists[count_pt] = MatchedPts_list[count_pt];
+                                        ptslists[count_pt] = GridToMapPoint(MatchedPts_list[count_pt], subBoundary, grid_resolution);
                                     
                                     DecisionMPs(proinfo, levelinfo, true,count_MPs,GridPT3, iteration, Hinterval,count_results, &minH_mps,&maxH_mps,minmaxHeight, ptslists);
                                     
@@ -3786,7 +3937,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     {
                                         if(ptslists[tcnt].flag != 1 && ptslists[tcnt].m_X >= subBoundary[0] && ptslists[tcnt].m_X <= subBoundary[2] && ptslists[tcnt].m_Y >= subBoundary[1] && ptslists[tcnt].m_Y <= subBoundary[3])
                                         {
-                                            MatchedPts_list_mps.push_back(ptslists[tcnt]);
+                                            MatchedPts_list_mps.push_back(MapToGridPoint(ptslists[tcnt], subBoundary, grid_resolution));
                                             count_results[0]++;
                                             
                                             if(minH_mps > ptslists[tcnt].m_Z)
@@ -3806,7 +3957,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                 lower_level_match = false;
                             
                             MatchedPts_list.clear();
-                            vector<D3DPOINT>().swap(MatchedPts_list);
+                            vector<D3DPOINTGRID>().swap(MatchedPts_list);
                             
                             fprintf(fid,"row = %d\tcol = %d\tlevel = %d\titeration = %d\tcheck = %d(%d)\tEnd blunder detection\n",row,col,level,iteration,lower_level_match,count_MPs);
                             
@@ -3820,9 +3971,9 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     printf("settingflag %d\t%d\n",MatchedPts_list_anchor.size(),MatchedPts_list_blunder.size());
                                     count_MPs = SetttingFlagOfGrid(levelinfo, GridPT3, MatchedPts_list_anchor, MatchedPts_list_blunder, &MatchedPts_list_mps);
                                     MatchedPts_list_anchor.clear();
-                                    vector<D3DPOINT>().swap(MatchedPts_list_anchor);
+                                    vector<D3DPOINTGRID>().swap(MatchedPts_list_anchor);
                                     MatchedPts_list_blunder.clear();
-                                    vector<D3DPOINT>().swap(MatchedPts_list_blunder);
+                                    vector<D3DPOINTGRID>().swap(MatchedPts_list_blunder);
                                 }
                                 
                                 printf("count_MPs %d\t%d\n",count_MPs,MatchedPts_list_mps.size());
@@ -3839,9 +3990,10 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     int i = 0;
                                     for( i = 0 ; i < MatchedPts_list_mps.size() ; i++)
                                     {
-                                        ptslists_save[i].m_X = MatchedPts_list_mps[i].m_X;
-                                        ptslists_save[i].m_Y = MatchedPts_list_mps[i].m_Y;
-                                        ptslists_save[i].m_Z = MatchedPts_list_mps[i].m_Z;
+                                        const D3DPOINT temp_pts = GridToMapPoint(MatchedPts_list_mps[i], subBoundary, grid_resolution);
+                                        ptslists_save[i].m_X = temp_pts.m_X;
+                                        ptslists_save[i].m_Y = temp_pts.m_Y;
+                                        ptslists_save[i].m_Z = temp_pts.m_Z;
                                         
                                         if(minmaxBR[0] > ptslists_save[i].m_X)
                                             minmaxBR[0]     = ptslists_save[i].m_X;
@@ -3859,7 +4011,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                     }
                                     
                                     MatchedPts_list_mps.clear();
-                                    vector<D3DPOINT>().swap(MatchedPts_list_mps);
+                                    vector<D3DPOINTGRID>().swap(MatchedPts_list_mps);
                                     
                                     FILE *pFile = fopen(filename_mps,"wb");
                                     fwrite(ptslists_save,sizeof(D3DPOINTSAVE),count_MPs,pFile);
@@ -3903,13 +4055,13 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                         
                                         for( i = 0 ; i < MatchedPts_list_mps.size() ; i++)
                                         {
-                                            ptslists[i] = MatchedPts_list_mps[i];
+                                            ptslists[i] = GridToMapPoint(MatchedPts_list_mps[i], subBoundary, grid_resolution);
                                             if(level == 4)
                                                 ptslists[i].flag = 1; //temporary blunders flag for ortho blunder
                                         }
                                         
                                         MatchedPts_list_mps.clear();
-                                        vector<D3DPOINT>().swap(MatchedPts_list_mps);
+                                        vector<D3DPOINTGRID>().swap(MatchedPts_list_mps);
                        
                                         double min_max[4] = {subBoundary[0], subBoundary[1], subBoundary[2], subBoundary[3]};
                                         UI3DPOINT *trilists;
@@ -4098,10 +4250,10 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                                         ptslists = (D3DPOINT*)malloc(sizeof(D3DPOINT)*count_MPs);
                                         
                                         for( i = 0 ; i < MatchedPts_list_mps.size() ; i++)
-                                            ptslists[i] = MatchedPts_list_mps[i];
+                                            ptslists[i] = GridToMapPoint(MatchedPts_list_mps[i], subBoundary, grid_resolution);
                                 
                                         MatchedPts_list_mps.clear();
-                                        vector<D3DPOINT>().swap(MatchedPts_list_mps);
+                                        vector<D3DPOINTGRID>().swap(MatchedPts_list_mps);
                                         
                                         UI3DPOINT *trilists;
                                         
@@ -4453,7 +4605,7 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                         if(!check_matching_rate)
                             check_matching_rate = level_check_matching_rate;
                         
-                        free(nccresult);
+                        nccresult.Free();
                         free(Startpos);
                         free(BStartpos);
                         
@@ -4496,7 +4648,8 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
                     }
                     free(data_size_lr);
                     
-                    free(GridPT3);
+                    ReleaseArenaGrid(&grid_arena, GridPT3, (long)Size_Grid2D.width*(long)Size_Grid2D.height);
+                    free(GridPT3_ortho_ncc);
                     
                     printf("release GridTP3\n");
                     PreET = time(0);
@@ -4535,6 +4688,9 @@ int Matching_SETSM(ProInfo *proinfo,const uint8 pyramid_step, const uint8 Templa
     }
     
     free(iterations);
+    if(grid_arena.buffer)
+        free(grid_arena.buffer);
+    
     if(proinfo->IsRA)
     {
         for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
@@ -4587,9 +4743,10 @@ double CalMemorySize(const ProInfo *info,LevelInfo &plevelinfo,const UGRID *Grid
     Memory += (GridPT)*3;
     //printf("memory 2 %f\n",Memory);
     long int GridPT3_size = (double)(sizeof(UGRID)*(*(plevelinfo.Grid_length)));
+    GridPT3_size += (double)(sizeof(short)*(info->number_of_images - 1)*(*(plevelinfo.Grid_length)));
     Memory += (GridPT3_size);
     //printf("memory 3 %f\n",Memory);
-    long int nccresult_size = (double)(sizeof(NCCresult)*(*(plevelinfo.Grid_length)));
+    long int nccresult_size = (double)(NCCresult::CellBytes()*(*(plevelinfo.Grid_length)));
     Memory += (nccresult_size);
     //printf("memory 4 %f\n",Memory);
     
@@ -5061,6 +5218,12 @@ D2DPOINT *SetGrids(const ProInfo *info, const int level, const int final_level_i
     return GridPT;
 }
 
+short *SetOrthoNCCPlanes(const ProInfo *proinfo, const long int Grid_length)
+{
+    const int num_planes = proinfo->number_of_images > 1 ? proinfo->number_of_images - 1 : 1;
+    return (short*)calloc(sizeof(short),(long)num_planes*Grid_length);
+}
+
 UGRID *SetGrid3PT(const ProInfo *proinfo, LevelInfo &rlevelinfo, const double Th_roh, double *minmaxHeight)
 {
     UGRID *GridPT3 = NULL;
@@ -5074,8 +5237,6 @@ UGRID *SetGrid3PT(const ProInfo *proinfo, LevelInfo &rlevelinfo, const double Th
         GridPT3[i].Matched_flag     = 0;
         GridPT3[i].roh              = DoubleToSignedChar_grid(Th_roh);
         GridPT3[i].anchor_flag      = 0;
-        for(int ti=0;ti<MaxNCC;ti++)
-            GridPT3[i].ortho_ncc[ti]        = 0;
         GridPT3[i].Mean_ortho_ncc   = 0;
 
         GridPT3[i].minHeight        = floor(minmaxHeight[0] - 0.5);
@@ -5137,16 +5298,15 @@ void SetHeightWithSeedDEM(const ProInfo *proinfo, LevelInfo &rlevelinfo, UGRID *
     printf("oriminmaxH %f\t%f\n",oriminH,orimaxH);
 
     double seedDEM_sigma = proinfo->seedDEMsigma;
+    double sigma_min = 0;
     if(!proinfo->check_Matchtag)
     {
-        if(seedDEM_sigma < 10)
-            seedDEM_sigma = 10;
-
+        sigma_min = 10;
         if(IsRA == 1)
-        {
-            if(seedDEM_sigma < 50)
-                seedDEM_sigma = 50;
-        }
+            sigma_min = 50;
+
+        if(seedDEM_sigma < sigma_min)
+            seedDEM_sigma = sigma_min;
     }
 
     printf("ttt1 %f\n",seedDEM_sigma);
@@ -5236,46 +5396,124 @@ void SetHeightWithSeedDEM(const ProInfo *proinfo, LevelInfo &rlevelinfo, UGRID *
     {
         printf("seeddem cal %f\n",seedDEM_sigma);
 
+        //only the seed DEM blocks under the grid boundary are read
+        DEMAccessor seeddem_accessor;
+        bool check_open;
         if(check_ftype == 2)
-        {
-            FILE *bin = fopen(GIMP_path,"rb");
-            float *seeddem = (float*)malloc(sizeof(float)*(long int)seeddem_size.width*(long int)seeddem_size.height);
-            fread(seeddem,sizeof(float),(long int)seeddem_size.width*(long int)seeddem_size.height,bin);
-
-            SetGridHeightFromSeed(rlevelinfo, Grid, seeddem, seeddem_size, grid_size, minX, maxY, seedDEM_sigma, minmaxHeight);
-            
-            free(seeddem);
-        }
+            check_open = OpenDEMAccessor_raw(GIMP_path, seeddem_size, minX, maxY, grid_size, &seeddem_accessor, 16);
         else
+            check_open = OpenDEMAccessor(GIMP_path, &seeddem_accessor, 16);
+
+        if(check_open)
         {
             long int cols[2];
             long int rows[2];
             CSize data_size;
 
-            CSize *LImagesize = (CSize*)malloc(sizeof(CSize));
-            LImagesize->width = seeddem_size.width;
-            LImagesize->height = seeddem_size.height;
+            float *seeddem = GetDEMAccessorWindow(&seeddem_accessor, rlevelinfo.Boundary, cols, rows, &data_size);
+            CloseDEMAccessor(&seeddem_accessor);
 
-            cols[0] = 0;
-            cols[1] = seeddem_size.width;
+            if(seeddem)
+            {
+                printf("Grid size %d\t%d\tcols rows %d\t%d\t%d\t%d\n",rlevelinfo.Size_Grid2D->width,rlevelinfo.Size_Grid2D->height,cols[0],cols[1],rows[0],rows[1]);
 
-            rows[0] = 0;
-            rows[1] = seeddem_size.height;
+                float *seeddem_sigma = NULL;
+                if(proinfo->seedDEMsigma_mode > 0)
+                    seeddem_sigma = SetSeedDEMSigma(proinfo, seeddem, data_size, cols, rows, grid_size, minX, maxY, *rlevelinfo.grid_resolution, sigma_min, seedDEM_sigma);
 
-            float type(0);
-            float *seeddem = Readtiff_T(GIMP_path,LImagesize,cols,rows,&data_size, type);
-            printf("Grid size %d\t%d\tcols rows %d\t%d\t%d\t%d\n",rlevelinfo.Size_Grid2D->width,rlevelinfo.Size_Grid2D->height,cols[0],cols[1],rows[0],rows[1]);
+                SetGridHeightFromSeed(rlevelinfo, Grid, seeddem, seeddem_sigma, data_size, cols, rows, grid_size, minX, maxY, seedDEM_sigma, minmaxHeight);
 
-            SetGridHeightFromSeed(rlevelinfo, Grid, seeddem, seeddem_size, grid_size, minX, maxY, seedDEM_sigma, minmaxHeight);
-            
-            free(seeddem);
+                free(seeddem);
+                if(seeddem_sigma)
+                    free(seeddem_sigma);
+            }
         }
         printf("seeddem end\n");
         printf("%f %f\n",minmaxHeight[0],minmaxHeight[1]);
     }
 }
 
-void SetGridHeightFromSeed(LevelInfo &rlevelinfo, UGRID *Grid, float *seeddem, CSize seeddem_size, double seed_grid, double minX, double maxY, double seedDEM_sigma, double *minmaxHeight)
+//per seed DEM cell search sigma in [sigma_min, sigma_max], either sampled from a sigma raster or from the seed DEM relief.
+//both paths keep at least SEED_SIGMA_MIN: sigma_min is 0 for -Matchtag seeds and flat cells would get no search range
+float *SetSeedDEMSigma(const ProInfo *proinfo, const float *seeddem, const CSize seeddem_size, const long *cols, const long *rows, const double seed_grid, const double minX, const double maxY, const double grid_resolution, const double sigma_min, const double sigma_max)
+{
+    const long data_length = (long)seeddem_size.width*(long)seeddem_size.height;
+    float *seeddem_sigma = (float*)malloc(sizeof(float)*data_length);
+    const double sigma_floor = sigma_min > SEED_SIGMA_MIN ? sigma_min : SEED_SIGMA_MIN;
+    
+    if(proinfo->seedDEMsigma_mode == 1)
+    {
+        DEMAccessor sigma_accessor;
+        if(!OpenDEMAccessor(proinfo->seedDEMsigma_map, &sigma_accessor, 16))
+        {
+            free(seeddem_sigma);
+            return NULL;
+        }
+        
+        //raster values are used as given, cells without sigma keep the scalar
+        for(long row = 0 ; row < seeddem_size.height ; row++)
+        {
+            for(long col = 0 ; col < seeddem_size.width ; col++)
+            {
+                const double t_x = minX + (col + cols[0])*seed_grid;
+                const double t_y = maxY - (row + rows[0])*seed_grid;
+                const float sigma = GetDEMAccessorBilinear(&sigma_accessor, t_x, t_y);
+                
+                long index = row*(long)seeddem_size.width + col;
+                if(sigma > 0)
+                    seeddem_sigma[index] = sigma > sigma_floor ? sigma : sigma_floor;
+                else
+                    seeddem_sigma[index] = sigma_max;
+            }
+        }
+        
+        CloseDEMAccessor(&sigma_accessor);
+    }
+    else
+    {
+        //largest height change to the 8 neighbours, scaled to the matching grid spacing.
+        //it covers slope and roughness, and is the error of picking the nearest seed cell
+        const double scale = grid_resolution > seed_grid ? grid_resolution/seed_grid : 1.0;
+#pragma omp parallel for schedule(guided)
+        for(long row = 0 ; row < seeddem_size.height ; row++)
+        {
+            for(long col = 0 ; col < seeddem_size.width ; col++)
+            {
+                long index = row*(long)seeddem_size.width + col;
+                double sigma = sigma_max;
+                
+                if(seeddem[index] > -1000)
+                {
+                    double max_dz = 0;
+                    for(int k = -1 ; k <= 1 ; k++)
+                    {
+                        for(int l = -1 ; l <= 1 ; l++)
+                        {
+                            long t_row = row + k;
+                            long t_col = col + l;
+                            if(t_row >= 0 && t_row < seeddem_size.height && t_col >= 0 && t_col < seeddem_size.width)
+                            {
+                                const float value = seeddem[t_row*(long)seeddem_size.width + t_col];
+                                if(value > -1000 && max_dz < fabs(value - seeddem[index]))
+                                    max_dz = fabs(value - seeddem[index]);
+                            }
+                        }
+                    }
+                    
+                    sigma = sigma_floor + scale*max_dz;
+                    if(sigma > sigma_max)
+                        sigma = sigma_max > sigma_floor ? sigma_max : sigma_floor;
+                }
+                
+                seeddem_sigma[index] = sigma;
+            }
+        }
+    }
+    
+    return seeddem_sigma;
+}
+
+void SetGridHeightFromSeed(LevelInfo &rlevelinfo, UGRID *Grid, float *seeddem, const float *seeddem_sigma, CSize seeddem_size, const long *cols, const long *rows, double seed_grid, double minX, double maxY, double seedDEM_sigma_scalar, double *minmaxHeight)
 {
     double total_minH = 999999;
     double total_maxH = -999999;
@@ -5288,11 +5526,14 @@ void SetGridHeightFromSeed(LevelInfo &rlevelinfo, UGRID *Grid, float *seeddem, C
             double t_x = rlevelinfo.Boundary[0] + col*(*rlevelinfo.grid_resolution);
             double t_y = rlevelinfo.Boundary[1] + row*(*rlevelinfo.grid_resolution);
             
-            long int col_seed = floor((t_x - minX)/seed_grid);
-            long int row_seed = floor((maxY - t_y)/seed_grid);
+            //seeddem holds the window cols x rows of the seed DEM
+            long int col_seed = floor((t_x - minX)/seed_grid) - cols[0];
+            long int row_seed = floor((maxY - t_y)/seed_grid) - rows[0];
             long int index_seeddem = row_seed*(long)seeddem_size.width + col_seed;
-            if(index_seeddem >= 0 && index_seeddem < (long int)seeddem_size.width*(long int)seeddem_size.height)
+            if(col_seed >= 0 && col_seed < seeddem_size.width && row_seed >= 0 && row_seed < seeddem_size.height)
             {
+                const double seedDEM_sigma = seeddem_sigma ? seeddem_sigma[index_seeddem] : seedDEM_sigma_scalar;
+
                 if(seeddem[index_seeddem] > -1000)
                 {
                     if(seeddem[index_seeddem] >= minmaxHeight[0] && seeddem[index_seeddem] <= minmaxHeight[1])
@@ -5447,6 +5688,117 @@ void SetDEMBoundary_photo(EO Photo, CAMERA_INFO m_Camera, RM M, double* _boundar
     _boundary[3] =  ceil(maxY);
 }
 
+//keep the max_pairs best targets of a tile, ranked by metadata pair score and tile coverage
+//coverage is the part of the reference ground footprint in the tile that the target also sees, sampled on a ground grid at mean height
+int SelectImagePairs(ProInfo *proinfo, const LevelInfo &rlevelinfo, const double *minmaxHeight, uint16 **SourceImages)
+{
+    const int reference_id = 0;
+    const double *subBoundary = rlevelinfo.Boundary;
+    const int num_pts = PAIR_FOOTPRINT_SAMPLES*PAIR_FOOTPRINT_SAMPLES;
+    
+    D3DPOINT *ground = (D3DPOINT*)malloc(sizeof(D3DPOINT)*num_pts);
+    for(int row = 0 ; row < PAIR_FOOTPRINT_SAMPLES ; row++)
+    {
+        for(int col = 0 ; col < PAIR_FOOTPRINT_SAMPLES ; col++)
+        {
+            D3DPOINT &pt = ground[row*PAIR_FOOTPRINT_SAMPLES + col];
+            pt.m_X = subBoundary[0] + (col + 0.5)*(subBoundary[2] - subBoundary[0])/PAIR_FOOTPRINT_SAMPLES;
+            pt.m_Y = subBoundary[1] + (row + 0.5)*(subBoundary[3] - subBoundary[1])/PAIR_FOOTPRINT_SAMPLES;
+            pt.m_Z = (minmaxHeight[0] + minmaxHeight[1])/2.0;
+        }
+    }
+    
+    D3DPOINT *ground_wgs = NULL;
+    if(proinfo->sensor_type == SB)
+        ground_wgs = ps2wgs_3D(*rlevelinfo.param, num_pts, ground);
+    
+    vector<char> ref_seen;
+    SetImageFootprintMask(proinfo, rlevelinfo, reference_id, ground, ground_wgs, num_pts, ref_seen);
+    long ref_count = 0;
+    for(int i = 0 ; i < num_pts ; i++)
+        ref_count += ref_seen[i];
+    
+    vector<std::pair<double,int> > pairs;
+    for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
+    {
+        if(proinfo->check_selected_image[ti])
+        {
+            double overlap = 1.0;
+            if(ref_count > 0)
+            {
+                vector<char> seen;
+                SetImageFootprintMask(proinfo, rlevelinfo, ti, ground, ground_wgs, num_pts, seen);
+                long count = 0;
+                for(int i = 0 ; i < num_pts ; i++)
+                    count += ref_seen[i] && seen[i];
+                overlap = count/(double)ref_count;
+            }
+            
+            pairs.push_back(std::make_pair(proinfo->pair_score[ti]*overlap, ti));
+        }
+    }
+    
+    free(ground);
+    if(ground_wgs)
+        free(ground_wgs);
+    
+    std::stable_sort(pairs.begin(), pairs.end(), [](const std::pair<double,int> &a, const std::pair<double,int> &b) { return a.first > b.first; });
+    
+    int count_available_images = 1;
+    for(size_t k = 0 ; k < pairs.size() ; k++)
+    {
+        const int ti = pairs[k].second;
+        if((int)k < proinfo->max_pairs)
+        {
+            printf("selected pair 1-%d score %f\n",ti+1,pairs[k].first);
+            count_available_images++;
+        }
+        else
+        {
+            free(SourceImages[ti]);
+            SourceImages[ti] = NULL;
+            proinfo->check_selected_image[ti] = false;
+        }
+    }
+    
+    return count_available_images;
+}
+
+//seen[i] is 1 when ground point i projects strictly inside image ti
+void SetImageFootprintMask(const ProInfo *proinfo, const LevelInfo &rlevelinfo, const int ti, D3DPOINT *ground, D3DPOINT *ground_wgs, const int num_pts, vector<char> &seen)
+{
+    seen.assign(num_pts, 0);
+    
+    CSize Imagesize;
+    if(!GetImageSize((char*)proinfo->Imagefilename[ti], &Imagesize))
+        return;
+    
+    D2DPOINT *ImageCoord = NULL;
+    if(proinfo->sensor_type == SB)
+        ImageCoord = GetObjectToImageRPC(rlevelinfo.RPCs[ti], 2, rlevelinfo.ImageAdjust[ti], num_pts, ground_wgs);
+    else
+    {
+        const FrameInfo &m_frameinfo = proinfo->frameinfo;
+        D2DPOINT *t_image = GetPhotoCoordinate(ground, m_frameinfo.Photoinfo[ti], num_pts, m_frameinfo.m_Camera, m_frameinfo.Photoinfo[ti].m_Rm);
+        ImageCoord = PhotoToImage(t_image, num_pts, m_frameinfo.m_Camera.m_CCDSize, m_frameinfo.m_Camera.m_ImageSize);
+        free(t_image);
+    }
+    
+    //GetObjectToImageRPC clamps to [0, offset + 1.2*scale], so a point on either clamp value is outside the image
+    double max_samp = Imagesize.width;
+    double max_line = Imagesize.height;
+    if(proinfo->sensor_type == SB)
+    {
+        max_samp = min(max_samp, rlevelinfo.RPCs[ti][0][1] + rlevelinfo.RPCs[ti][1][1]*1.2);
+        max_line = min(max_line, rlevelinfo.RPCs[ti][0][0] + rlevelinfo.RPCs[ti][1][0]*1.2);
+    }
+    
+    for(int i = 0 ; i < num_pts ; i++)
+        seen[i] = ImageCoord[i].m_X > 0 && ImageCoord[i].m_X < max_samp && ImageCoord[i].m_Y > 0 && ImageCoord[i].m_Y < max_line;
+    
+    free(ImageCoord);
+}
+
 uint16 *SetsubsetImage(ProInfo *proinfo, LevelInfo &rlevelinfo, const int index_image, const TransParam transparam, const uint8 NumofIAparam, const double * const * const *RPCs, const double * const *ImageParams, const double *subBoundary, const double *minmaxHeight, D2DPOINT *Startpos, CSize *Subsetsize)
 {
     bool ret = false;
@@ -5624,7 +5976,7 @@ double GetHeightStep(int Pyramid_step, double im_resolution)
     return HS;
 }
 
-void InitializeVoxel(const ProInfo *proinfo, VOXEL **grid_voxel,LevelInfo &plevelinfo, UGRID *GridPT3, NCCresult* nccresult,const int iteration, const double *minmaxHeight)
+void InitializeVoxel(const ProInfo *proinfo, VOXEL **grid_voxel,LevelInfo &plevelinfo, UGRID *GridPT3, NCCresult &nccresult,const int iteration, const double *minmaxHeight)
 {
     const double height_step = *plevelinfo.height_step;
     const uint8 pyramid_step = *plevelinfo.Pyramid_step;
@@ -5914,7 +6266,160 @@ double SetNCC_alpha(const int Pyramid_step, const int iteration, bool IsRA)
     
 }
 
-int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccresult, LevelInfo &plevelinfo, const UGRID *GridPT3, const uint8 iteration, const double *minmaxHeight)
+D2DPOINT GetGridImageCoord(const ProInfo *proinfo, const LevelInfo &plevelinfo, const long int pt_index, const int image_index, const float iter_height)
+{
+    D2DPOINT Imagecoord;
+    D3DPOINT temp_GP;
+    temp_GP.m_Z = (double)iter_height;
+    if(proinfo->sensor_type == SB)
+    {
+        temp_GP = plevelinfo.Grid_wgs[pt_index];
+        Imagecoord = GetObjectToImageRPC_single(plevelinfo.RPCs[image_index],*plevelinfo.NumOfIAparam,plevelinfo.ImageAdjust[image_index],temp_GP);
+    }
+    else
+    {
+        temp_GP = plevelinfo.GridPts[pt_index];
+        D2DPOINT photo = GetPhotoCoordinate_single(temp_GP,proinfo->frameinfo.Photoinfo[image_index],proinfo->frameinfo.m_Camera,proinfo->frameinfo.Photoinfo[image_index].m_Rm);
+        Imagecoord = PhotoToImage_single(photo,proinfo->frameinfo.m_Camera.m_CCDSize,proinfo->frameinfo.m_Camera.m_ImageSize);
+    }
+    
+    return Imagecoord;
+}
+
+//reference patches and statistics of every height of one grid point, shared by all targets.
+//a height reuses the slot of the last computed height while the reference moved less than REF_PATCH_REUSE_TH pixels
+void SetRefPatchStack(const ProInfo *proinfo, const LevelInfo &plevelinfo, const NCCresultCell &nccresult, const long int pt_index, const int start_H, const int end_H, const bool check_combined_WNCC_INCC, RefPatchStack &ref_stack)
+{
+    const bool IsRA = proinfo->IsRA;
+    const int Pyramid_step = *plevelinfo.Pyramid_step;
+    const int reference_id = plevelinfo.reference_id;
+    const CSize LImagesize(plevelinfo.py_Sizes[reference_id][Pyramid_step]);
+    CSize LImagesize_next(LImagesize);
+    if(check_combined_WNCC_INCC)
+        LImagesize_next = plevelinfo.py_Sizes[reference_id][Pyramid_step-1];
+    
+    ref_stack.Resize(nccresult.NumOfHeight, check_combined_WNCC_INCC);
+    
+    int last_slot = -1;
+    for(int grid_voxel_hindex = 0 ; grid_voxel_hindex < nccresult.NumOfHeight ; grid_voxel_hindex++)
+    {
+        float iter_height;
+        
+        if(IsRA || (*plevelinfo.check_matching_rate ))
+            iter_height = start_H + grid_voxel_hindex*(*plevelinfo.height_step);
+        else
+            iter_height = nccresult.minHeight + grid_voxel_hindex*(*plevelinfo.height_step);
+        
+        if(iter_height < start_H || iter_height > end_H)
+            continue;
+        
+        const D2DPOINT Ref_Imagecoord = GetGridImageCoord(proinfo, plevelinfo, pt_index, reference_id, iter_height);
+        const D2DPOINT Ref_Imagecoord_py = OriginalToPyramid_single(Ref_Imagecoord,plevelinfo.py_Startpos[reference_id],Pyramid_step);
+        
+        bool check_py_image_pt = (int)Ref_Imagecoord_py.m_Y >= 0 && (int)Ref_Imagecoord_py.m_Y + 1 < LImagesize.height && (int)Ref_Imagecoord_py.m_X >= 0 && (int)Ref_Imagecoord_py.m_X + 1 < LImagesize.width;
+        
+        D2DPOINT Ref_Imagecoord_py_next;
+        if(check_combined_WNCC_INCC)
+        {
+            Ref_Imagecoord_py_next = OriginalToPyramid_single(Ref_Imagecoord,plevelinfo.py_Startpos_next[reference_id],Pyramid_step-1);
+            check_py_image_pt = check_py_image_pt && (int)Ref_Imagecoord_py_next.m_Y >= 0 && (int)Ref_Imagecoord_py_next.m_Y + 1 < LImagesize_next.height && (int)Ref_Imagecoord_py_next.m_X >= 0 && (int)Ref_Imagecoord_py_next.m_X + 1 < LImagesize_next.width;
+        }
+        
+        if(!check_py_image_pt)
+            continue;
+        
+        ref_stack.valid[grid_voxel_hindex] = 1;
+        ref_stack.Imagecoord[grid_voxel_hindex] = Ref_Imagecoord;
+        ref_stack.Imagecoord_py[grid_voxel_hindex] = Ref_Imagecoord_py;
+        if(check_combined_WNCC_INCC)
+            ref_stack.Imagecoord_py_next[grid_voxel_hindex] = Ref_Imagecoord_py_next;
+        
+        if(last_slot >= 0)
+        {
+            bool check_reuse = fabs(Ref_Imagecoord_py.m_X - ref_stack.Imagecoord_py[last_slot].m_X) < REF_PATCH_REUSE_TH && fabs(Ref_Imagecoord_py.m_Y - ref_stack.Imagecoord_py[last_slot].m_Y) < REF_PATCH_REUSE_TH;
+            if(check_combined_WNCC_INCC)
+                check_reuse = check_reuse && fabs(Ref_Imagecoord_py_next.m_X - ref_stack.Imagecoord_py_next[last_slot].m_X) < REF_PATCH_REUSE_TH && fabs(Ref_Imagecoord_py_next.m_Y - ref_stack.Imagecoord_py_next[last_slot].m_Y) < REF_PATCH_REUSE_TH;
+            
+            if(check_reuse)
+            {
+                ref_stack.slot[grid_voxel_hindex] = last_slot;
+                continue;
+            }
+        }
+        
+        const size_t offset = (size_t)grid_voxel_hindex*ref_stack.patch_size;
+        ref_stack.slot[grid_voxel_hindex] = grid_voxel_hindex;
+        last_slot = grid_voxel_hindex;
+        
+        SetRefPatchValue(plevelinfo.py_Images[reference_id], plevelinfo.py_MagImages[reference_id], LImagesize, Ref_Imagecoord_py, ref_stack.Half_template_size, &ref_stack.patch[offset], &ref_stack.mag_patch[offset]);
+        SetRefPatchStat(&ref_stack.patch[offset], &ref_stack.mag_patch[offset], ref_stack.Half_template_size, &ref_stack.stat[grid_voxel_hindex*3]);
+        
+        if(check_combined_WNCC_INCC)
+        {
+            SetRefPatchValue(plevelinfo.py_Images_next[reference_id], plevelinfo.py_MagImages_next[reference_id], LImagesize_next, Ref_Imagecoord_py_next, ref_stack.Half_template_size, &ref_stack.patch_next[offset], &ref_stack.mag_patch_next[offset]);
+            SetRefPatchStat(&ref_stack.patch_next[offset], &ref_stack.mag_patch_next[offset], ref_stack.Half_template_size, &ref_stack.stat_next[grid_voxel_hindex*3]);
+        }
+    }
+}
+
+//coarse pass of the height sweep: ComputeCoarseNCC every HEIGHT_SWEEP_STRIDE voxels, then keep the voxels within one stride
+//of the HEIGHT_SWEEP_PEAKS best coarse peaks that are within height_sweep_th of the best one.
+//with sum_tables, unrotated voxels use BoxNCC at the nearest whole pixels instead.
+//returns false when the sweep finds nothing, and all voxels are evaluated
+bool SetHeightSweepMask(const ProInfo *proinfo, const LevelInfo &plevelinfo, const NCCresultCell &nccresult, const long int pt_index, const int ti, const int start_H, const int end_H, const int Half_template_size, const KernelPatchArg &patch, const NCCSumTable *sum_tables, vector<char> &height_mask)
+{
+    const int Pyramid_step = *plevelinfo.Pyramid_step;
+    const int reference_id = plevelinfo.reference_id;
+    const int NumOfHeight = nccresult.NumOfHeight;
+    
+    vector<std::pair<double,int> > coarse_peaks;
+    double max_rho = -1.0;
+    for(int grid_voxel_hindex = 0 ; grid_voxel_hindex < NumOfHeight ; grid_voxel_hindex += HEIGHT_SWEEP_STRIDE)
+    {
+        const float iter_height = nccresult.minHeight + grid_voxel_hindex*(*plevelinfo.height_step);
+        if(iter_height < start_H || iter_height > end_H)
+            continue;
+        
+        const D2DPOINT Ref_Imagecoord_py = OriginalToPyramid_single(GetGridImageCoord(proinfo, plevelinfo, pt_index, reference_id, iter_height),plevelinfo.py_Startpos[reference_id],Pyramid_step);
+        const D2DPOINT Tar_Imagecoord_py = OriginalToPyramid_single(GetGridImageCoord(proinfo, plevelinfo, pt_index, ti, iter_height),plevelinfo.py_Startpos[ti],Pyramid_step);
+        
+        if(!((int)Ref_Imagecoord_py.m_Y >= 0 && (int)Ref_Imagecoord_py.m_Y + 1 < patch.LImagesize.height && (int)Ref_Imagecoord_py.m_X >= 0 && (int)Ref_Imagecoord_py.m_X + 1 < patch.LImagesize.width && (int)Tar_Imagecoord_py.m_Y >= 0 && (int)Tar_Imagecoord_py.m_Y + 1 < patch.RImagesize.height && (int)Tar_Imagecoord_py.m_X >= 0 && (int)Tar_Imagecoord_py.m_X + 1 < patch.RImagesize.width))
+            continue;
+        
+        const int ori_diff = plevelinfo.py_OriImages[reference_id][(int)Ref_Imagecoord_py.m_Y*patch.LImagesize.width + (int)Ref_Imagecoord_py.m_X] - plevelinfo.py_OriImages[ti][(int)Tar_Imagecoord_py.m_Y*patch.RImagesize.width + (int)Tar_Imagecoord_py.m_X];
+        const double rot_theta = (double)(ori_diff*(*plevelinfo.bin_angle)*PI/180.0);
+        
+        double rho = -99;
+        if(sum_tables && ori_diff == 0)
+            rho = BoxNCC(sum_tables[reference_id], sum_tables[ti], patch.left_image, patch.right_image, (long)(Ref_Imagecoord_py.m_X + 0.5), (long)(Ref_Imagecoord_py.m_Y + 0.5), (long)(Tar_Imagecoord_py.m_X + 0.5), (long)(Tar_Imagecoord_py.m_Y + 0.5), Half_template_size);
+        if(rho < -2)
+            rho = ComputeCoarseNCC(patch, Ref_Imagecoord_py, Tar_Imagecoord_py, Half_template_size, cos(-rot_theta), sin(-rot_theta));
+        coarse_peaks.push_back(std::make_pair(rho, grid_voxel_hindex));
+        if(max_rho < rho)
+            max_rho = rho;
+    }
+    
+    if(coarse_peaks.empty() || max_rho <= -1.0)
+        return false;
+    
+    std::sort(coarse_peaks.begin(), coarse_peaks.end(), std::greater<std::pair<double,int> >());
+    
+    height_mask.assign(NumOfHeight, 0);
+    for(size_t k = 0 ; k < coarse_peaks.size() && k < HEIGHT_SWEEP_PEAKS ; k++)
+    {
+        if(coarse_peaks[k].first < max_rho - proinfo->height_sweep_th)
+            break;
+        
+        const int start = max(0, coarse_peaks[k].second - HEIGHT_SWEEP_STRIDE + 1);
+        const int end = min(NumOfHeight - 1, coarse_peaks[k].second + HEIGHT_SWEEP_STRIDE - 1);
+        for(int h = start ; h <= end ; h++)
+            height_mask[h] = 1;
+    }
+    
+    return true;
+}
+
+int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult &nccresult, LevelInfo &plevelinfo, const UGRID *GridPT3, const uint8 iteration, const double *minmaxHeight)
 {
     const bool check_matchtag = proinfo->check_Matchtag;
     const char* save_filepath = proinfo->save_filepath;
@@ -6004,12 +6509,33 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
     const int reference_id = plevelinfo.reference_id;
     const double ortho_th = 0.7 - (4 - Pyramid_step)*0.10;
     
+    //coarse-to-fine height sweep on the voxel path; every HEIGHT_SWEEP_SAMPLE-th grid point keeps the full sweep
+    //and reports whether its best height would have survived the pruning
+    const bool check_height_sweep = proinfo->height_sweep_th > 0 && !IsRA && !(*plevelinfo.check_matching_rate);
+    long int count_sweep_heights = 0, count_sweep_pruned = 0, count_sweep_samples = 0, count_sweep_kept = 0;
+    
+    const KernelOffsetLUT rot_lut(Half_template_size, Half_template_size + 1, *plevelinfo.bin_angle);
+    
+    //sum tables for the box NCC of the coarse sweep, per selected image at this level
+    NCCSumTable *sweep_tables = NULL;
+    if(check_height_sweep && proinfo->check_box_NCC && Pyramid_step >= BOX_NCC_LEVEL)
+    {
+        sweep_tables = new NCCSumTable[proinfo->number_of_images];
+        for(int ti = 0 ; ti < proinfo->number_of_images ; ti++)
+        {
+            if(proinfo->check_selected_image[ti])
+                sweep_tables[ti].Set(plevelinfo.py_Images[ti], plevelinfo.py_Sizes[ti][Pyramid_step], 0);
+        }
+    }
+    
 #pragma omp parallel
     {
         SetKernel rsetkernel(reference_id,1,Half_template_size);
         SetKernel rsetkernel_next(reference_id,1,Half_template_size);
+        RefPatchStack ref_stack(Half_template_size);
+        vector<char> height_mask;
         
-#pragma omp for schedule(dynamic,1) reduction(+:Accessable_grid/*,sum_data2, sum_data*/)
+#pragma omp for schedule(dynamic,1) reduction(+:Accessable_grid,count_sweep_heights,count_sweep_pruned,count_sweep_samples,count_sweep_kept/*,sum_data2, sum_data*/)
         for(long int iter_count = 0 ; iter_count < numofpts ; iter_count++)
         {
             long int pts_row = (long int)(floor(iter_count/plevelinfo.Size_Grid2D->width));
@@ -6073,6 +6599,7 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                 
                 if(!check_blunder_cell)
                 {
+                    bool check_ref_stack = false;
                     for(int ti = 1 ; ti < proinfo->number_of_images ; ti ++)
                     {
                         if(proinfo->check_selected_image[ti])
@@ -6106,7 +6633,7 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
 
                             
                             //GNCC computation
-                            if(check_ortho && SignedCharToDouble_grid(GridPT3[pt_index].ortho_ncc[ti]) > ortho_th)
+                            if(check_ortho && SignedCharToDouble_grid(plevelinfo.ortho_ncc[OrthoNCCIndex(numofpts, ti, pt_index)]) > ortho_th)
                             {
                                 int Count_N_ortho[3] = {0};
                                 int Count_N_ortho_next[3] = {0};
@@ -6168,7 +6695,7 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                     nccresult[pt_index].GNCC = DoubleToSignedChar_result(sum_GNCC_multi/count_GNCC);
                                 else
                                     nccresult[pt_index].GNCC = DoubleToSignedChar_result(-1.0);
-                            }  // if(check_ortho && GridPT3[pt_index].ortho_ncc[ti] > ortho_th)
+                            }  // if(check_ortho && ortho_ncc > ortho_th)
                             else
                                 nccresult[pt_index].GNCC = DoubleToSignedChar_result(-1.0);
                             
@@ -6193,9 +6720,38 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                 nccresult[pt_index].result1 = DoubleToSignedChar_result(-1.0);
                                 nccresult[pt_index].result3 = -1000;
                                 nccresult[pt_index].result4 = 0;
+                                
+                                //reference patches are computed once per grid point and shared by all heights and targets
+                                if(!check_ref_stack)
+                                {
+                                    SetRefPatchStack(proinfo, plevelinfo, nccresult[pt_index], pt_index, start_H, end_H, check_combined_WNCC_INCC, ref_stack);
+                                    check_ref_stack = true;
+                                }
+                                
+                                bool check_sweep_mask = false;
+                                const bool check_sweep_sample = pt_index % HEIGHT_SWEEP_SAMPLE == 0;
+                                int max_WNCC_hindex = -1;
+                                if(check_height_sweep && nccresult[pt_index].NumOfHeight > 2*HEIGHT_SWEEP_STRIDE*HEIGHT_SWEEP_PEAKS)
+                                {
+                                    check_sweep_mask = SetHeightSweepMask(proinfo, plevelinfo, nccresult[pt_index], pt_index, ti, start_H, end_H, Half_template_size, patch, sweep_tables, height_mask);
+                                    if(check_sweep_mask)
+                                    {
+                                        count_sweep_heights += nccresult[pt_index].NumOfHeight;
+                                        if(check_sweep_sample)
+                                            count_sweep_samples++;
+                                        else
+                                            count_sweep_pruned += std::count(height_mask.begin(), height_mask.end(), 0);
+                                    }
+                                }
                             
                                 for(int grid_voxel_hindex = 0 ; grid_voxel_hindex < nccresult[pt_index].NumOfHeight ; grid_voxel_hindex++)
                                 {
+                                    if(check_sweep_mask && !check_sweep_sample && !height_mask[grid_voxel_hindex])
+                                    {
+                                        grid_voxel[pt_index][grid_voxel_hindex].INCC = DoubleToSignedChar_voxel(-1.0);
+                                        continue;
+                                    }
+                                    
                                     float iter_height;
                                     
                                     if(IsRA || (*plevelinfo.check_matching_rate ))
@@ -6203,39 +6759,18 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                     else
                                         iter_height = nccresult[pt_index].minHeight + grid_voxel_hindex*(*plevelinfo.height_step);
                                     
-                                    if(iter_height >= start_H && iter_height <= end_H)
+                                    if(iter_height >= start_H && iter_height <= end_H && ref_stack.valid[grid_voxel_hindex])
                                     {
                                         const CSize LImagesize(plevelinfo.py_Sizes[reference_id][Pyramid_step]);
                                         const CSize RImagesize(plevelinfo.py_Sizes[ti][Pyramid_step]);
                                         
                                         // Image point setting
-                                        const double temp_LIA[2] = {plevelinfo.ImageAdjust[reference_id][0], plevelinfo.ImageAdjust[reference_id][1]};
-                                        
                                         D2DPOINT Ref_Imagecoord[1], Ref_Imagecoord_py[1];
                                         D2DPOINT Tar_Imagecoord[1], Tar_Imagecoord_py[1];
-                                        D3DPOINT temp_GP[1];
-                                        D2DPOINT photo;
-                                        temp_GP[0].m_Z = (double)iter_height;
-                                        if(proinfo->sensor_type == SB)
-                                        {
-                                            temp_GP[0] = plevelinfo.Grid_wgs[pt_index];
-                                            
-                                            Ref_Imagecoord[0]      = GetObjectToImageRPC_single(plevelinfo.RPCs[reference_id],*plevelinfo.NumOfIAparam,temp_LIA,temp_GP[0]);
-                                            
-                                            Tar_Imagecoord[0]     = GetObjectToImageRPC_single(plevelinfo.RPCs[ti],*plevelinfo.NumOfIAparam,plevelinfo.ImageAdjust[ti],temp_GP[0]);
-                                        }
-                                        else
-                                        {
-                                            temp_GP[0] = plevelinfo.GridPts[pt_index];
-                                            
-                                            photo = GetPhotoCoordinate_single(temp_GP[0],proinfo->frameinfo.Photoinfo[reference_id],proinfo->frameinfo.m_Camera,proinfo->frameinfo.Photoinfo[reference_id].m_Rm);
-                                            Ref_Imagecoord[0] = PhotoToImage_single(photo,proinfo->frameinfo.m_Camera.m_CCDSize,proinfo->frameinfo.m_Camera.m_ImageSize);
-                                            
-                                            photo = GetPhotoCoordinate_single(temp_GP[0],proinfo->frameinfo.Photoinfo[ti],proinfo->frameinfo.m_Camera,proinfo->frameinfo.Photoinfo[ti].m_Rm);
-                                            Tar_Imagecoord[0] = PhotoToImage_single(photo,proinfo->frameinfo.m_Camera.m_CCDSize,proinfo->frameinfo.m_Camera.m_ImageSize);
-                                        }
+                                        Ref_Imagecoord[0]      = ref_stack.Imagecoord[grid_voxel_hindex];
+                                        Ref_Imagecoord_py[0]   = ref_stack.Imagecoord_py[grid_voxel_hindex];
                                         
-                                        Ref_Imagecoord_py[0]   = OriginalToPyramid_single(Ref_Imagecoord[0],plevelinfo.py_Startpos[reference_id],Pyramid_step);
+                                        Tar_Imagecoord[0]     = GetGridImageCoord(proinfo, plevelinfo, pt_index, ti, iter_height);
                                         Tar_Imagecoord_py[0]  = OriginalToPyramid_single(Tar_Imagecoord[0],plevelinfo.py_Startpos[ti],Pyramid_step);
                                         
                                         const bool check_py_image_pt = (int)Ref_Imagecoord_py[0].m_Y >= 0 && (int)Ref_Imagecoord_py[0].m_Y + 1 < LImagesize.height && (int)Ref_Imagecoord_py[0].m_X >= 0 && (int)Ref_Imagecoord_py[0].m_X + 1 < LImagesize.width && (int)Tar_Imagecoord_py[0].m_Y >= 0 && (int)Tar_Imagecoord_py[0].m_Y + 1 < RImagesize.height && (int)Tar_Imagecoord_py[0].m_X >= 0 && (int)Tar_Imagecoord_py[0].m_X + 1< RImagesize.width;
@@ -6243,14 +6778,14 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                         // image point setting for next level
                                         bool check_py_image_pt_next = true;
                                         D2DPOINT Ref_Imagecoord_py_next[1];
-                                        CSize LImagesize_next, RImagesize_next;
+                                        CSize LImagesize_next(LImagesize), RImagesize_next(RImagesize);
                                         D2DPOINT Tar_Imagecoord_py_next[1];
                                         if(check_combined_WNCC_INCC)
                                         {
                                             LImagesize_next = plevelinfo.py_Sizes[reference_id][Pyramid_step-1];
                                             RImagesize_next = plevelinfo.py_Sizes[ti][Pyramid_step-1];
                                             
-                                            Ref_Imagecoord_py_next[0]   = OriginalToPyramid_single(Ref_Imagecoord[0],plevelinfo.py_Startpos_next[reference_id],Pyramid_step-1);
+                                            Ref_Imagecoord_py_next[0] = ref_stack.Imagecoord_py_next[grid_voxel_hindex];
                                             
                                             Tar_Imagecoord_py_next[0]  = OriginalToPyramid_single(Tar_Imagecoord[0],plevelinfo.py_Startpos_next[ti],Pyramid_step-1);
                                             
@@ -6290,38 +6825,27 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                                 int Count_N[3] = {0};
                                                 int Count_N_next[3] = {0};
                                                 
-                                                const double rot_theta = (double)(diff_theta*(*plevelinfo.bin_angle)*PI/180.0);
-                                                const double cos0 = cos(-rot_theta);
-                                                const double sin0 = sin(-rot_theta);
+                                                const vector<KernelOffset> &kernel_offsets = rot_lut.Get(diff_theta);
+                                                const int ref_slot = ref_stack.slot[grid_voxel_hindex];
+                                                const size_t ref_offset = (size_t)ref_slot*ref_stack.patch_size;
                                                 
-                                                for(int row = -Half_template_size; row <= Half_template_size ; row++)
+                                                for(size_t k = 0 ; k < kernel_offsets.size() ; k++)
                                                 {
-                                                    for(int col = -Half_template_size; col <= Half_template_size ; col++)
+                                                    const KernelOffset &offset = kernel_offsets[k];
+                                                    D2DPOINT pos_right(Tar_Imagecoord_py[0].m_X + offset.pos.m_X,Tar_Imagecoord_py[0].m_Y + offset.pos.m_Y);
+                                                    
+                                                    SetVecKernelValue_ref(patch, &ref_stack.patch[ref_offset], &ref_stack.mag_patch[ref_offset], offset.row, offset.col, pos_right, offset.radius2, Count_N);
+                                                    
+                                                    if(check_combined_WNCC_INCC)
                                                     {
-                                                        int radius2  =  row*row + col*col;
-                                                        if(radius2 <= (Half_template_size + 1)*(Half_template_size + 1))
-                                                        {
-                                                            D2DPOINT pos_left(Ref_Imagecoord_py[0].m_X + col,Ref_Imagecoord_py[0].m_Y + row);
-                                                            D2DPOINT temp_pos(cos0*col - sin0*row, sin0*col + cos0*row);
-                                                            D2DPOINT pos_right(Tar_Imagecoord_py[0].m_X + temp_pos.m_X,Tar_Imagecoord_py[0].m_Y + temp_pos.m_Y);
-                                                            
-                                                            SetVecKernelValue(patch, row, col, pos_left,pos_right, radius2, Count_N);
-                                                            
-                                                            if(check_combined_WNCC_INCC)
-                                                            {
-                                                                D2DPOINT pos_left_next(Ref_Imagecoord_py_next[0].m_X + col,Ref_Imagecoord_py_next[0].m_Y + row);
-                                                                D2DPOINT temp_pos_next(cos0*col - sin0*row, sin0*col + cos0*row);
-                                                                D2DPOINT pos_right_next(Tar_Imagecoord_py_next[0].m_X + temp_pos_next.m_X,Tar_Imagecoord_py_next[0].m_Y + temp_pos_next.m_Y);
-                                                                
-                                                                SetVecKernelValue(patch_next, row, col, pos_left_next,pos_right_next, radius2, Count_N_next);
-                                                                
-                                                            }  // if(check_combined_WNCC_INCC)
-                                                        }
-                                                    }  // end col loop
-                                                }  // end row loop
+                                                        D2DPOINT pos_right_next(Tar_Imagecoord_py_next[0].m_X + offset.pos.m_X,Tar_Imagecoord_py_next[0].m_Y + offset.pos.m_Y);
+                                                        
+                                                        SetVecKernelValue_ref(patch_next, &ref_stack.patch_next[ref_offset], &ref_stack.mag_patch_next[ref_offset], offset.row, offset.col, pos_right_next, offset.radius2, Count_N_next);
+                                                    }  // if(check_combined_WNCC_INCC)
+                                                }  // end kernel offset loop
                                                 
                                                 // Compute correlations
-                                                ComputeMultiNCC(rsetkernel, TH_N, Count_N, count_INCC,  sum_INCC_multi);
+                                                ComputeMultiNCC_ref(rsetkernel, &ref_stack.stat[ref_slot*3], TH_N, Count_N, count_INCC,  sum_INCC_multi);
                                                 if(Count_N[0] > TH_N && Count_N[1] > TH_N && Count_N[2] > TH_N)
                                                 {
                                                     if(!(*plevelinfo.check_matching_rate) && !IsRA)
@@ -6329,7 +6853,9 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                                 }
                                                 
                                                 if(check_combined_WNCC_INCC)
-                                                    ComputeMultiNCC(rsetkernel_next, TH_N, Count_N_next, count_INCC,  sum_INCC_multi);
+                                                {
+                                                    ComputeMultiNCC_ref(rsetkernel_next, &ref_stack.stat_next[ref_slot*3], TH_N, Count_N_next, count_INCC,  sum_INCC_multi);
+                                                }
                                                 
                                                 //printf("sum_INCC_multi %f\n",sum_INCC_multi);
                                                 
@@ -6358,7 +6884,10 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                                 }
                                                 
                                                 if(max_WNCC < temp_rho)
+                                                {
                                                     max_WNCC = temp_rho;
+                                                    max_WNCC_hindex = grid_voxel_hindex;
+                                                }
                                                 
                                                 //find peak position
                                                 if(*plevelinfo.check_matching_rate)
@@ -6374,6 +6903,10 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
                                         }
                                     }//end iter_height loop
                                 }// end grid_voxel_hindex loop
+                                
+                                if(check_sweep_mask && check_sweep_sample && max_WNCC_hindex >= 0 && height_mask[max_WNCC_hindex])
+                                    count_sweep_kept++;
+                                
                                 if(nccresult[pt_index].check_height_change)
                                     nccresult[pt_index].max_WNCC = DoubleToSignedChar_result(max_WNCC);
                             }//end INCC computation
@@ -6386,6 +6919,11 @@ int VerticalLineLocus(VOXEL **grid_voxel,const ProInfo *proinfo, NCCresult* nccr
     
     //printf("check height cell %d\t%d\t%d\t%f\t%f\n",sum_data2,sum_data,sum_data2+sum_data,(double)sum_data2/(double)(sum_data2+sum_data)*100,(double)sum_data/(double)(sum_data2+sum_data)*100);
     
+    delete [] sweep_tables;
+    
+    if(check_height_sweep && count_sweep_heights > 0)
+        printf("height sweep : pruned %4.1f%% of voxels, full-sweep peak kept at %ld of %ld sampled points (%4.1f%%)\n",(double)count_sweep_pruned/(double)count_sweep_heights*100,count_sweep_kept,count_sweep_samples,count_sweep_samples > 0 ? (double)count_sweep_kept/(double)count_sweep_samples*100 : 100.0);
+    
     if(check_ortho)
     {
         for(int ti = 0 ; ti < proinfo->number_of_images ; ti++)
@@ -6537,7 +7075,7 @@ void SetOrthoImageCoord(const ProInfo *proinfo, LevelInfo &plevelinfo, const UGR
     }
 }
 
-void FindPeakNcc(const int Pyramid_step, const int iteration, const long int grid_index, const double temp_rho, const float iter_height, bool &check_rho, double &pre_rho, float &pre_height, int &direction, double &max_WNCC, NCCresult *nccresult)
+void FindPeakNcc(const int Pyramid_step, const int iteration, const long int grid_index, const double temp_rho, const float iter_height, bool &check_rho, double &pre_rho, float &pre_height, int &direction, double &max_WNCC, NCCresult &nccresult)
 {
     double diff_rho;
     int t_direction;
@@ -6620,7 +7158,7 @@ void FindPeakNcc(const int Pyramid_step, const int iteration, const long int gri
 }
 
 
-void SGM_start_pos(NCCresult *nccresult, VOXEL** grid_voxel, UGRID *GridPT3, long pt_index, float* LHcost_pre,float **SumCost, double height_step_interval)
+void SGM_start_pos(NCCresult &nccresult, VOXEL** grid_voxel, UGRID *GridPT3, long pt_index, float* LHcost_pre,float **SumCost, double height_step_interval)
 {
     for(int height_step = 0 ; height_step < nccresult[pt_index].NumOfHeight ; height_step++)
     {
@@ -6634,7 +7172,7 @@ void SGM_start_pos(NCCresult *nccresult, VOXEL** grid_voxel, UGRID *GridPT3, lon
     }
 }
 
-void SGM_con_pos(int pts_col, int pts_row, CSize Size_Grid2D, int direction_iter, double step_height, int P_HS_step, int *u_col, int *v_row, NCCresult *nccresult, VOXEL** grid_voxel,UGRID *GridPT3, long pt_index, double P1, double P2, float* LHcost_pre, float* LHcost_curr, float **SumCost)
+void SGM_con_pos(int pts_col, int pts_row, CSize Size_Grid2D, int direction_iter, double step_height, int P_HS_step, int *u_col, int *v_row, NCCresult &nccresult, VOXEL** grid_voxel,UGRID *GridPT3, long pt_index, double P1, double P2, float* LHcost_pre, float* LHcost_curr, float **SumCost)
 {
     for(int height_step = 0 ; height_step < nccresult[pt_index].NumOfHeight ; height_step++)
     {
@@ -6866,7 +7404,7 @@ void SGM_con_pos(int pts_col, int pts_row, CSize Size_Grid2D, int direction_iter
     }
 }
 
-void AWNCC(ProInfo *proinfo, VOXEL **grid_voxel,CSize Size_Grid2D, UGRID *GridPT3, NCCresult *nccresult, double step_height, uint8 Pyramid_step, uint8 iteration,int MaxNumberofHeightVoxel)
+void AWNCC(ProInfo *proinfo, VOXEL **grid_voxel,CSize Size_Grid2D, UGRID *GridPT3, NCCresult &nccresult, double step_height, uint8 Pyramid_step, uint8 iteration,int MaxNumberofHeightVoxel)
 {
     // P2 >= P1
     const double P1 = 0.3;
@@ -7725,7 +8263,7 @@ void VerticalLineLocus_seeddem(const ProInfo *proinfo,LevelInfo &rlevelinfo, UGR
                             //    count_low += 1;
                         }
 
-                        GridPT3[pt_index].ortho_ncc[ti] = DoubleToSignedChar_grid(nccresult);
+                        rlevelinfo.ortho_ncc[OrthoNCCIndex(*rlevelinfo.Grid_length, ti, pt_index)] = DoubleToSignedChar_grid(nccresult);
 
 
                         if(proinfo->check_Matchtag)
@@ -7878,7 +8416,7 @@ bool VerticalLineLocus_blunder(const ProInfo *proinfo,LevelInfo &rlevelinfo, flo
                         if(max_ncc < t_nccresult)
                             max_ncc = t_nccresult;
                         
-                        GridPT3[pt_index].ortho_ncc[ti] = DoubleToSignedChar_grid(t_nccresult);
+                        rlevelinfo.ortho_ncc[OrthoNCCIndex(*rlevelinfo.Grid_length, ti, pt_index)] = DoubleToSignedChar_grid(t_nccresult);
                     }
                 } // end ti loop
                 GridPT3[pt_index].Mean_ortho_ncc = DoubleToSignedChar_grid(max_ncc);
@@ -8022,6 +8560,7 @@ int Ortho_blunder(ProInfo *proinfo, LevelInfo &rlevelinfo, double MPP, D3DPOINT
             }
         }
         
+        //serial: a triangle's anchor check sees the flags set by the triangles before it
         for(int tcnt=0;tcnt<(int)(num_triangles);tcnt++)
         {
             if(tris_check[tcnt] == 0)
@@ -8408,7 +8947,7 @@ int VerticalLineLocus_Ortho(ProInfo *proinfo, LevelInfo &rlevelinfo, double MPP,
     return selected_count;
 }
 
-long SelectMPs(const ProInfo *proinfo,LevelInfo &rlevelinfo, const NCCresult* roh_height, UGRID *GridPT3, const double Th_roh, const double Th_roh_min, const double Th_roh_start, const double Th_roh_next, const int iteration, const double MPP, const int final_level_iteration,const double MPP_stereo_angle, vector<D3DPOINT> *linkedlist)
+long SelectMPs(const ProInfo *proinfo,LevelInfo &rlevelinfo, const NCCresult &roh_height, UGRID *GridPT3, const double Th_roh, const double Th_roh_min, const double Th_roh_start, const double Th_roh_next, const int iteration, const double MPP, const int final_level_iteration,const double MPP_stereo_angle, vector<D3DPOINTGRID> *linkedlist)
 {
     long int count_MPs = 0;
 
@@ -8719,8 +9258,7 @@ long SelectMPs(const ProInfo *proinfo,LevelInfo &rlevelinfo, const NCCresult* ro
                         {
                             count_MPs++;
                             
-                            temp_mp.flag = 0;
-                            linkedlist->push_back(temp_mp);
+                            linkedlist->push_back(D3DPOINTGRID(col, row, (float)temp_mp.m_Z, 0));
        
                             // update max_roh value
                             GridPT3[grid_index].roh     = roh_height[grid_index].result0;
@@ -8741,8 +9279,7 @@ long SelectMPs(const ProInfo *proinfo,LevelInfo &rlevelinfo, const NCCresult* ro
                         {
                             count_MPs++;
                             
-                            temp_mp.flag = 0;
-                            linkedlist->push_back(temp_mp);
+                            linkedlist->push_back(D3DPOINTGRID(col, row, (float)temp_mp.m_Z, 0));
                         }
                         // update max_roh value
                         GridPT3[grid_index].roh     = roh_height[grid_index].result0;
@@ -8994,43 +9531,6 @@ void DecisionMPs_setheight(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
 
 }
 
-void set_blunder(long int index, uint8_t val, D3DPOINT *pts, bool *detectedBlunders) {
-    // if the flag is already 1 and it's an "old blunder",
-    // then we don't want to update it to 3. This can cause
-    // nondeterminism in the loop. However, the race here is
-    // okay. If it's an "old blunder", we'll always see 1 here.
-    // If it's a new blunder, we may see any of 0, 1 or 3 here.
-    // If it's a new blunder and 1, then detectedBlunders was
-    // already set, so we can exit early. Same with 3. If it's
-    // a new blunder and zero, but there's a race, that's fine
-    // too.
-    uint8_t prev = pts[index].flag;
-    if(prev != 0)
-        return;
-
-    // Only update the detectedBlunders value
-    // if we know that this is a new blunder.
-    // if it was previously zero, we know it is
-    // a new blunder. If it was not previously zero,
-    // there are two possible cases. First, it
-    // was already a blunder. In that case, we don't
-    // want to set detectedBlunders. Alternatively,
-    // it could be a new blunder but another thread
-    // changed it from zero to 1 or 3. In that case,
-    // the other thread/iteration would have
-    // updated detectedBlunders, so we don't need to.
-#pragma omp atomic capture
-    {
-        prev = pts[index].flag;
-        pts[index].flag = val;
-    }
-    if(prev == 0)
-    {
-#pragma omp atomic write
-        detectedBlunders[index] = true;
-    }
-}
-
 bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const int iteration, float* ortho_ncc, bool flag_blunder, uint16 count_bl, D3DPOINT *pts, bool *detectedBlunders, long int num_points, UI3DPOINT *tris, long int num_triangles, UGRID *Gridpts, long *blunder_count,double *minz_mp, double *maxz_mp)
 {
     int IsRA(proinfo->IsRA);
@@ -9040,11 +9540,9 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
     if(!(pyramid_step == 0 && iteration == 3))
     {
         uint32 hdiffcount = (uint32)(*rlevelinfo.Hinterval);
-        const uint8 max_nodes       = 30;
-        //savenode will now be a pointer to a uint
-        //make savenode a giant array with row size max_nodes
-        uint32 *savenode    = (uint32*)malloc((long)sizeof(uint32)*(long)max_nodes*(long)num_points);
-        uint32 *nodecount   = (uint32*)calloc(num_points,sizeof(uint32));
+        TinAdjacency adjacency;
+        SetTinAdjacency(tris, num_triangles, num_points, &adjacency);
+        
         uint32 *hdiffbin    = (uint32*)calloc(hdiffcount+1,sizeof(uint32));
         
         const double *boundary    = rlevelinfo.Boundary;
@@ -9066,11 +9564,6 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
             
             if(tris[tcnt].m_X < num_points)
             {
-                if(nodecount[tris[tcnt].m_X] < max_nodes)
-                {
-                    savenode[(long)tris[tcnt].m_X*(long)max_nodes+(long)nodecount[tris[tcnt].m_X]] = tcnt;
-                    nodecount[tris[tcnt].m_X]++;
-                }
                 pt0     = pts[tris[tcnt].m_X];
                 
                 t_col         = (int)((pt0.m_X - boundary[0])/gridspace + 0.5);
@@ -9088,11 +9581,6 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
             
             if(tris[tcnt].m_Y < num_points)
             {
-                if(nodecount[tris[tcnt].m_Y] < max_nodes)
-                {
-                    savenode[(long)tris[tcnt].m_Y*(long)max_nodes+(long)nodecount[tris[tcnt].m_Y]] = tcnt;
-                    nodecount[tris[tcnt].m_Y]++;
-                }
                 pt1     = pts[tris[tcnt].m_Y];
                 
                 t_col         = (int)((pt1.m_X - boundary[0])/gridspace + 0.5);
@@ -9110,11 +9598,6 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
             
             if(tris[tcnt].m_Z < num_points)
             {
-                if(nodecount[tris[tcnt].m_Z] < max_nodes)
-                {
-                    savenode[(long)tris[tcnt].m_Z*(long)max_nodes+(long)nodecount[tris[tcnt].m_Z]] = tcnt;
-                    nodecount[tris[tcnt].m_Z]++;
-                }
                 pt2     = pts[tris[tcnt].m_Z];
                 
                 t_col         = (int)((pt2.m_X - boundary[0])/gridspace + 0.5);
@@ -9295,25 +9778,16 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
         
         free(hdiffbin);
 
-        // be very careful modifying this code. The thread safety
-        // here is a bit complicated. This loop touches three
-        // shared arrays: pts, detectedBlunders, and GridPts.
-        // GridPts and detecetedBlunders are write-only, while
-        // pts is read/write. GridPts is the least problematic.
-        // It is written is a "safe" way, with one-to-one mapping
-        // between iterations and the index.
-        //
-        // That's not the case for pts and detectedBlunders.
-        // pts is only read from the iteration index. But, it is
-        // written from other indices. detectedBlunders tracks
-        // whether a given pts index was updated from zero to
-        // one or three. It is also written from other threads.
-        //
-        // openmp atomics are used to coordinate this. Take
-        // care when modifying anything in here.
-        //
-        // detectedBlunders is updated when for an index when
-        // the pts value is changed from 0 to 1 or from 0 to 3.
+        // two phases, so the result does not depend on the thread count.
+        // phase one reads pts as a snapshot and only writes decisions:
+        // point_blunder[index] by the iteration of index, and
+        // neighbor_blunder by any iteration. All neighbor writes store the
+        // same value, so plain atomic writes are enough and no
+        // read-modify-write is needed. Gridpts is written one-to-one.
+        // phase two applies the decisions to points that were not blunders.
+        uint8 *point_blunder    = (uint8*)calloc(num_points,sizeof(uint8));
+        uint8 *neighbor_blunder = (uint8*)calloc(num_points,sizeof(uint8));
+        
 #pragma omp parallel for schedule(guided)
         for(long index=0;index<num_points;index++)
         {
@@ -9325,15 +9799,9 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
                 int count_th_positive   = 0;
                 int count_th_negative   = 0;
                 int count = 0;
-                int max_iter;
                 
                 bool check_neigh = false;
                 
-                if(nodecount[index] < max_nodes)
-                    max_iter    = nodecount[index];
-                else
-                    max_iter    = max_nodes;
-                
                 const D3DPOINT ref_index_pt(pts[index]);
                 long t_col         = (long)((ref_index_pt.m_X - boundary[0])/gridspace + 0.5);
                 long t_row         = (long)((ref_index_pt.m_Y - boundary[1])/gridspace + 0.5);
@@ -9358,194 +9826,195 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
                     }
                 }
                 
-                for(long iter = 0 ; iter < max_iter ; iter++)
+                for(long iter = adjacency.start[index] ; iter < adjacency.start[index + 1] ; iter++)
                 {
-                    if(savenode[(long)index*(long)max_nodes+(long)iter] < num_triangles && savenode[(long)index*(long)max_nodes+(long)iter] > 0)
+                    const UI3DPOINT &t_tri = tris[adjacency.tri_index[iter]];
+                    long reference_index = 0;
+                    long target_index_0 = 0, target_index_1 = 0;
+                    const uint32 temp_tri[3] = {t_tri.m_X, t_tri.m_Y, t_tri.m_Z};
+                    
+                    bool check_index = false;
+                    for(int kk=0;kk<3;kk++)
                     {
-                        long reference_index = 0;
-                        long target_index_0 = 0, target_index_1 = 0;
-                        const uint32 temp_tri[3] = {tris[savenode[(long)index*(long)max_nodes+(long)iter]].m_X, tris[savenode[(long)index*(long)max_nodes+(long)iter]].m_Y, tris[savenode[(long)index*(long)max_nodes+(long)iter]].m_Z};
-                        
-                        bool check_index = false;
-                        for(int kk=0;kk<3;kk++)
+                        if(temp_tri[kk] == index)
+                            reference_index = index;
+                        else
                         {
-                            if(temp_tri[kk] == index)
-                                reference_index = index;
-                            else
+                            if(!check_index)
                             {
-                                if(!check_index)
-                                {
-                                    target_index_0 = temp_tri[kk];
-                                    check_index    = true;
-                                }
-                                else
-                                    target_index_1 = temp_tri[kk];
+                                target_index_0 = temp_tri[kk];
+                                check_index    = true;
                             }
+                            else
+                                target_index_1 = temp_tri[kk];
                         }
+                    }
+                    
+                    if(reference_index < num_points && target_index_0 < num_points && target_index_1 < num_points &&
+                       target_index_0 >= 0 && target_index_1 >= 0)
+                    {
+                        //plane normal angle
+                        const D3DPOINT pt0(pts[reference_index]);
+                        const D3DPOINT pt1(pts[target_index_0]);
+                        const D3DPOINT pt2(pts[target_index_1]);
+                        
+                        double angle = SetNormalAngle(pt0, pt1, pt2);
+                        
+                        const double dh1 = pt0.m_Z - pt1.m_Z;
+                        const double dh2 = pt0.m_Z - pt2.m_Z;
+                        const double dh3 = pt1.m_Z - pt2.m_Z;
+                        
+                        if(dh1 >= 0 && dh2 >= 0 && angle > 30)
+                            count_th_positive ++;
+                        if(dh1 <  0 && dh2 < 0  && angle > 30)
+                            count_th_negative ++;
                         
-                        if(reference_index < num_points && target_index_0 < num_points && target_index_1 < num_points &&
-                           target_index_0 >= 0 && target_index_1 >= 0)
+                        bool check_match = false;
+                        if(pyramid_step  > 1)
                         {
-                            //plane normal angle
-                            const D3DPOINT pt0(pts[reference_index]);
-                            const D3DPOINT pt1(pts[target_index_0]);
-                            const D3DPOINT pt2(pts[target_index_1]);
-                            
-                            double angle = SetNormalAngle(pt0, pt1, pt2);
-                            
-                            const double dh1 = pt0.m_Z - pt1.m_Z;
-                            const double dh2 = pt0.m_Z - pt2.m_Z;
-                            const double dh3 = pt1.m_Z - pt2.m_Z;
-                            
-                            if(dh1 >= 0 && dh2 >= 0 && angle > 30)
-                                count_th_positive ++;
-                            if(dh1 <  0 && dh2 < 0  && angle > 30)
-                                count_th_negative ++;
-                            
-                            bool check_match = false;
-                            if(pyramid_step  > 1)
-                            {
-                                check_match     = true;
-                            }
-                            else if(pyramid_step == 1)
-                            {
-                                if(iteration == 1 && count_bl <= 5)
-                                    check_match = true;
-                            }
-                            else if(pyramid_step == 0)
-                            {
-                                if(iteration == 1 && count_bl <= 5)
-                                    check_match = true;
-                                else if(iteration == 2 && count_bl <= 5)
-                                    check_match = false;
-                            }
-                            else
+                            check_match     = true;
+                        }
+                        else if(pyramid_step == 1)
+                        {
+                            if(iteration == 1 && count_bl <= 5)
+                                check_match = true;
+                        }
+                        else if(pyramid_step == 0)
+                        {
+                            if(iteration == 1 && count_bl <= 5)
+                                check_match = true;
+                            else if(iteration == 2 && count_bl <= 5)
                                 check_match = false;
+                        }
+                        else
+                            check_match = false;
+                        
+                        if(check_match)
+                        {
+                            const double ddh_1     = fabs(dh1) - fabs(dh2);
+                            const double ddh_2     = fabs(dh1) - fabs(dh3);
+                            const double ddh_3     = fabs(dh2) - fabs(dh3);
                             
-                            if(check_match)
+                            if((fabs(ddh_1) > height_th || fabs(ddh_2) > height_th || fabs(ddh_3) > height_th))
                             {
-                                const double ddh_1     = fabs(dh1) - fabs(dh2);
-                                const double ddh_2     = fabs(dh1) - fabs(dh3);
-                                const double ddh_3     = fabs(dh2) - fabs(dh3);
+                                // all node check with height difference.
+                                double h1,h2,dh;
+                                int t_o_min,t_o_max,t_o_mid;
+                                long order[3]    = {reference_index, target_index_0, target_index_1};
+                                double height[3] = {pt0.m_Z, pt1.m_Z, pt2.m_Z};
+                                
+                                long Col         = (long)((pt0.m_X - boundary[0])/gridspace + 0.5);
+                                long Row         = (long)((pt0.m_Y- boundary[1])/gridspace + 0.5);
+                                long Index[3];
+                                Index[0]     = (long)gridsize.width*Row + Col;
+                                Col             = (long)((pt1.m_X - boundary[0])/gridspace + 0.5);
+                                Row             = (long)((pt1.m_Y - boundary[1])/gridspace + 0.5);
+                                Index[1]     = (long)gridsize.width*Row + Col;
+                       
+                                Col             = (long)((pt2.m_X - boundary[0])/gridspace + 0.5);
+                                Row             = (long)((pt2.m_Y - boundary[1])/gridspace + 0.5);
+                                Index[2]     = (long)gridsize.width*Row + Col;
+                                
+                                check_neigh = true;
                                 
-                                if((fabs(ddh_1) > height_th || fabs(ddh_2) > height_th || fabs(ddh_3) > height_th))
+                                if(height[0] > height[1])
                                 {
-                                    // all node check with height difference.
-                                    double h1,h2,dh;
-                                    int t_o_min,t_o_max,t_o_mid;
-                                    long order[3]    = {reference_index, target_index_0, target_index_1};
-                                    double height[3] = {pt0.m_Z, pt1.m_Z, pt2.m_Z};
-                                    
-                                    long Col         = (long)((pt0.m_X - boundary[0])/gridspace + 0.5);
-                                    long Row         = (long)((pt0.m_Y- boundary[1])/gridspace + 0.5);
-                                    long Index[3];
-                                    Index[0]     = (long)gridsize.width*Row + Col;
-                                    Col             = (long)((pt1.m_X - boundary[0])/gridspace + 0.5);
-                                    Row             = (long)((pt1.m_Y - boundary[1])/gridspace + 0.5);
-                                    Index[1]     = (long)gridsize.width*Row + Col;
-                           
-                                    Col             = (long)((pt2.m_X - boundary[0])/gridspace + 0.5);
-                                    Row             = (long)((pt2.m_Y - boundary[1])/gridspace + 0.5);
-                                    Index[2]     = (long)gridsize.width*Row + Col;
-                                    
-                                    check_neigh = true;
-                                    
-                                    if(height[0] > height[1])
+                                    if(height[0] > height[2])
                                     {
-                                        if(height[0] > height[2])
+                                        t_o_max = 0;
+                                        if(height[1] > height[2])
                                         {
-                                            t_o_max = 0;
-                                            if(height[1] > height[2])
-                                            {
-                                                t_o_min = 2;
-                                                t_o_mid = 1;
-                                            }
-                                            else
-                                            {
-                                                t_o_min = 1;
-                                                t_o_mid = 2;
-                                            }
+                                            t_o_min = 2;
+                                            t_o_mid = 1;
                                         }
                                         else
                                         {
-                                            t_o_max = 2;
                                             t_o_min = 1;
-                                            t_o_mid = 0;
+                                            t_o_mid = 2;
                                         }
                                     }
                                     else
                                     {
-                                        if(height[1] > height[2])
+                                        t_o_max = 2;
+                                        t_o_min = 1;
+                                        t_o_mid = 0;
+                                    }
+                                }
+                                else
+                                {
+                                    if(height[1] > height[2])
+                                    {
+                                        t_o_max = 1;
+                                        if(height[0] > height[2])
                                         {
-                                            t_o_max = 1;
-                                            if(height[0] > height[2])
-                                            {
-                                                t_o_min = 2;
-                                                t_o_mid = 0;
-                                            }
-                                            else
-                                            {
-                                                t_o_min = 0;
-                                                t_o_mid = 2;
-                                            }
+                                            t_o_min = 2;
+                                            t_o_mid = 0;
                                         }
                                         else
                                         {
-                                            t_o_max = 2;
-                                            t_o_mid = 1;
                                             t_o_min = 0;
+                                            t_o_mid = 2;
                                         }
                                     }
-                                    
-                                    h1        = height[t_o_mid] - height[t_o_min];
-                                    h2        = height[t_o_max] - height[t_o_mid];
-                                    dh        = h1 - h2;
+                                    else
+                                    {
+                                        t_o_max = 2;
+                                        t_o_mid = 1;
+                                        t_o_min = 0;
+                                    }
+                                }
+                                
+                                h1        = height[t_o_mid] - height[t_o_min];
+                                h2        = height[t_o_max] - height[t_o_mid];
+                                dh        = h1 - h2;
 
-                                    long int blunder_neighbor_index = -1;
-                                    if((dh > 0 && dh > height_th))
+                                long int blunder_neighbor_index = -1;
+                                if((dh > 0 && dh > height_th))
+                                {
+                                    if(IsRA == 1)
                                     {
-                                        if(IsRA == 1)
+                                        blunder_neighbor_index = order[t_o_min];
+                                    }
+                                    else
+                                    {
+                                        if(flag_blunder)
                                         {
-                                            blunder_neighbor_index = order[t_o_min];
+                                            if(ortho_ncc[Index[t_o_min]] < ortho_ncc_th)
+                                                blunder_neighbor_index = order[t_o_min];
                                         }
                                         else
-                                        {
-                                            if(flag_blunder)
-                                            {
-                                                if(ortho_ncc[Index[t_o_min]] < ortho_ncc_th)
-                                                    blunder_neighbor_index = order[t_o_min];
-                                            }
-                                            else
-                                                if(ortho_ncc[Index[t_o_min]] < ortho_ancc_th)
-                                                    blunder_neighbor_index = order[t_o_min];
-                                            
-                                        }
+                                            if(ortho_ncc[Index[t_o_min]] < ortho_ancc_th)
+                                                blunder_neighbor_index = order[t_o_min];
+                                        
                                     }
-                                    else if((dh < 0 && fabs(dh) > height_th))
+                                }
+                                else if((dh < 0 && fabs(dh) > height_th))
+                                {
+                                    if(IsRA == 1)
                                     {
-                                        if(IsRA == 1)
+                                        blunder_neighbor_index = order[t_o_max];
+                                    }
+                                    else
+                                    {
+                                        if(flag_blunder)
                                         {
-                                            blunder_neighbor_index = order[t_o_max];
+                                            if(ortho_ncc[Index[t_o_max]] < ortho_ncc_th)
+                                                blunder_neighbor_index = order[t_o_max];
                                         }
                                         else
-                                        {
-                                            if(flag_blunder)
-                                            {
-                                                if(ortho_ncc[Index[t_o_max]] < ortho_ncc_th)
-                                                    blunder_neighbor_index = order[t_o_max];
-                                            }
-                                            else
-                                                if(ortho_ncc[Index[t_o_max]] < ortho_ancc_th)
-                                                    blunder_neighbor_index = order[t_o_max];
-                                        }
+                                            if(ortho_ncc[Index[t_o_max]] < ortho_ancc_th)
+                                                blunder_neighbor_index = order[t_o_max];
                                     }
+                                }
 
-                                    if(blunder_neighbor_index >= 0)
-                                        set_blunder(blunder_neighbor_index, 3, pts, detectedBlunders);
+                                if(blunder_neighbor_index >= 0)
+                                {
+#pragma omp atomic write
+                                    neighbor_blunder[blunder_neighbor_index] = 1;
                                 }
                             }
-                            count++;
                         }
+                        count++;
                     }
                 }
                 
@@ -9621,16 +10090,25 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
                         }
                     }
                 }
-                // only set detectedBlunders[index] to true for the index associated
-                // with this loop iteration. The neighbor points set detectedBlunders
-                // above as appropriate. We have to use the private variable instead
-                // of just reading the array value because other threads may set
-                // the value to 3 as we're processing.
                 if(pt_is_blunder)
-                    set_blunder(index, 1, pts, detectedBlunders);
+                    point_blunder[index] = 1;
+            }
+        }
+        
+        //a point's own decision takes precedence over a neighbor decision, old blunders are kept
+#pragma omp parallel for schedule(static)
+        for(long index=0;index<num_points;index++)
+        {
+            if(pts[index].flag == 0 && (point_blunder[index] || neighbor_blunder[index]))
+            {
+                pts[index].flag = point_blunder[index] ? 1 : 3;
+                detectedBlunders[index] = true;
             }
         }
         
+        free(point_blunder);
+        free(neighbor_blunder);
+        
         for(long tcnt=0;tcnt<num_points;tcnt++)
         {
             if(pts[tcnt].flag == 1)
@@ -9650,65 +10128,38 @@ bool blunder_detection_TIN(const ProInfo *proinfo, LevelInfo &rlevelinfo, const
                     *maxz_mp        = pts[tcnt].m_Z;
             }
         }
-        free(savenode);
-        free(nodecount);
     }
   
     return true;
 }
 
-int SetttingFlagOfGrid(LevelInfo &rlevelinfo, UGRID *GridPT3, vector<D3DPOINT> MatchedPts_list_anchor,vector<D3DPOINT> MatchedPts_list_blunder,vector<D3DPOINT> *MatchedPts_list_mps)
+int SetttingFlagOfGrid(LevelInfo &rlevelinfo, UGRID *GridPT3, const vector<D3DPOINTGRID> &MatchedPts_list_anchor, const vector<D3DPOINTGRID> &MatchedPts_list_blunder, vector<D3DPOINTGRID> *MatchedPts_list_mps)
 {
     int total_count = 0;
-    double X,Y,Z;
-    int t_flag;
     long i = 0;
     long grid_index;
     long t_col, t_row;
-    vector<D3DPOINT>::iterator it;
     
-    i = 0;
     for( i = 0 ; i < MatchedPts_list_anchor.size() ; i++)
-    //for(it = MatchedPts_list_anchor.begin(); it != MatchedPts_list_anchor.end() ; ++it)
     {
-        X = MatchedPts_list_anchor[i].m_X;
-        Y = MatchedPts_list_anchor[i].m_Y;
-        Z = MatchedPts_list_anchor[i].m_Z;
-        t_flag = MatchedPts_list_anchor[i].flag;
-        
-        t_col         = (int)((X - rlevelinfo.Boundary[0])/(*rlevelinfo.grid_resolution) + 0.5);
-        t_row         = (int)((Y - rlevelinfo.Boundary[1])/(*rlevelinfo.grid_resolution) + 0.5);
+        t_col         = MatchedPts_list_anchor[i].col;
+        t_row         = MatchedPts_list_anchor[i].row;
         grid_index     = (long)rlevelinfo.Size_Grid2D->width*t_row + t_col;
         if(grid_index >= 0 && grid_index < *rlevelinfo.Grid_length && t_col >=0 && t_col < rlevelinfo.Size_Grid2D->width && t_row >= 0 && t_row < rlevelinfo.Size_Grid2D->height)
         {
             GridPT3[grid_index].anchor_flag = 1;
         }
-        
-   //     i++;
     }
  
-    i=0;
     for( i = 0 ; i < MatchedPts_list_blunder.size() ; i++)
-    //for(it = MatchedPts_list_blunder.begin(); it != MatchedPts_list_blunder.end() ; ++it)
     {
-        X = MatchedPts_list_blunder[i].m_X;
-        Y = MatchedPts_list_blunder[i].m_Y;
-        Z = MatchedPts_list_blunder[i].m_Z;
-        t_flag = MatchedPts_list_blunder[i].flag;
-        
-        t_col         = (int)((X - rlevelinfo.Boundary[0])/(*rlevelinfo.grid_resolution) + 0.5);
-        t_row         = (int)((Y - rlevelinfo.Boundary[1])/(*rlevelinfo.grid_resolution) + 0.5);
+        t_col         = MatchedPts_list_blunder[i].col;
+        t_row         = MatchedPts_list_blunder[i].row;
         
         grid_index     = (long)rlevelinfo.Size_Grid2D->width*t_row + t_col;
         if(grid_index >= 0 && grid_index < *rlevelinfo.Grid_length && t_col >=0 && t_col < rlevelinfo.Size_Grid2D->width && t_row >= 0 && t_row < rlevelinfo.Size_Grid2D->height)
         {
-            D3DPOINT temp_pts;
-            temp_pts.m_X = X;
-            temp_pts.m_Y = Y;
-            temp_pts.m_Z = Z;
-            temp_pts.flag = t_flag;
-            
-            MatchedPts_list_mps->push_back(temp_pts);
+            MatchedPts_list_mps->push_back(MatchedPts_list_blunder[i]);
             
             total_count++;
             if(GridPT3[grid_index].anchor_flag != 1)
@@ -9717,14 +10168,12 @@ int SetttingFlagOfGrid(LevelInfo &rlevelinfo, UGRID *GridPT3, vector<D3DPOINT> M
                 
             }
         }
-        
-        //i++;
     }
 
     return total_count;
 }
 
-UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult *nccresult, const int numOfPts, const int num_triangles, UGRID *GridPT3, const int iteration, double *minH_grid, double *maxH_grid, D3DPOINT *pts, const UI3DPOINT *tris, const double MPP, const bool level_check_matching_rate)
+UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult &nccresult, const int numOfPts, const int num_triangles, UGRID *GridPT3, const int iteration, double *minH_grid, double *maxH_grid, D3DPOINT *pts, const UI3DPOINT *tris, const double MPP, const bool level_check_matching_rate)
 {
     UGRID *result = NULL;
     
@@ -9807,21 +10256,29 @@ UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult *nccres
     for (long counter = 0; counter < *rlevelinfo.Grid_length; counter++)
         NewHeight[counter]          = -1000.0;
     
-    for(long tcnt = 0;tcnt < num_triangles;tcnt++)
+    TinTileBins bins;
+    SetTinTileBins(rlevelinfo, pts, numOfPts, tris, num_triangles, &bins, Total_Min_Z, Total_Max_Z);
+    
+#pragma omp parallel for schedule(dynamic,1)
+    for(long tile = 0 ; tile < (long)bins.tiles_x*(long)bins.tiles_y ; tile++)
     {
-        const UI3DPOINT &t_tri = (tris[tcnt]);
-        const int pdex0 = t_tri.m_X;
-        const int pdex1 = t_tri.m_Y;
-        const int pdex2 = t_tri.m_Z;
-        
-        if(pdex0 < numOfPts && pdex1 < numOfPts && pdex2 < numOfPts)
+        for(long k = bins.start[tile] ; k < bins.start[tile + 1] ; k++)
         {
-            const D3DPOINT &TriP1(pts[pdex0]);
-            const D3DPOINT &TriP2(pts[pdex1]);
-            const D3DPOINT &TriP3(pts[pdex2]);
+            const long tcnt = bins.tri_index[k];
             int PixelMinXY[2], PixelMaxXY[2];
-            double temp_MinZ, temp_MaxZ;
-            SetTinBoundary(rlevelinfo, TriP1, TriP2, TriP3, PixelMinXY, PixelMaxXY, Total_Min_Z, Total_Max_Z, temp_MinZ, temp_MaxZ);
+            if(!GetTinTileBox(bins, tile, tcnt, PixelMinXY, PixelMaxXY))
+                continue;
+            
+            const UI3DPOINT &t_tri = (tris[tcnt]);
+            const D3DPOINT &TriP1(pts[t_tri.m_X]);
+            const D3DPOINT &TriP2(pts[t_tri.m_Y]);
+            const D3DPOINT &TriP3(pts[t_tri.m_Z]);
+            const TinEdgeFunction edge(rlevelinfo, TriP1, TriP2, TriP3);
+            if(!edge.valid)
+                continue;
+            
+            const double temp_MinZ = min(min(TriP1.m_Z,TriP2.m_Z),TriP3.m_Z);
+            const double temp_MaxZ = max(max(TriP1.m_Z,TriP2.m_Z),TriP3.m_Z);
             
             double angle = SetNormalAngle(TriP1, TriP2, TriP3);
             
@@ -9839,20 +10296,19 @@ UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult *nccres
             
             for (long Row=PixelMinXY[1]; Row <= PixelMaxXY[1]; Row++)
             {
-                for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++)
+                double E[3];
+                edge.SetRow(PixelMinXY[0], Row, E);
+                for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++, edge.NextCol(E))
                 {
                     long Index= (long)rlevelinfo.Size_Grid2D->width*Row + Col;
                     
                     if(!m_bHeight[Index])
                     {
-                        float Z = -1000.0;
-                        bool rtn = false;
-                        
-                        D3DPOINT CurGPXY((Col)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[0],(Row)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[1],0,0);
-                        rtn = IsTinInside(CurGPXY, TriP1, TriP2, TriP3, Z);
-                        
-                        if (rtn)
+                        if (edge.IsInside(E))
                         {
+                            D3DPOINT CurGPXY((Col)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[0],(Row)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[1],0,0);
+                            float Z = edge.Height(CurGPXY.m_X, CurGPXY.m_Y);
+                            
                             if(pyramid_step < 2)
                             {
                                 // IDW
@@ -10095,11 +10551,6 @@ UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult *nccres
             
             result[matlab_index].anchor_flag                = 0;
             
-            for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
-            {
-                if(proinfo->check_selected_image[ti])
-                    result[matlab_index].ortho_ncc[ti]      = GridPT3[matlab_index].ortho_ncc[ti];
-            }
             result[matlab_index].Mean_ortho_ncc             = GridPT3[matlab_index].Mean_ortho_ncc;
             result[matlab_index].minHeight                  = GridPT3[matlab_index].minHeight;
             
@@ -10130,238 +10581,230 @@ UGRID* SetHeightRange(ProInfo *proinfo, LevelInfo &rlevelinfo, NCCresult *nccres
     return result;
 }
 
-UGRID* ResizeGirdPT3(ProInfo *proinfo, CSize preSize, CSize resize_Size, double* Boundary, D2DPOINT *resize_Grid, UGRID *preGridPT3, double pre_gridsize, double* minmaxheight)
+UGRID *GetArenaGrid(UGRIDArena *arena, const long int Grid_length)
 {
-    if(resize_Size.height > 8000 || resize_Size.width > 8000)
-        printf("resize memory allocation start\n");
+    UGRID *grid = NULL;
+    if(arena->buffer && arena->length >= Grid_length)
+    {
+        grid = arena->buffer;
+        arena->buffer = NULL;
+        arena->length = 0;
+    }
+    else
+        grid = (UGRID*)malloc(sizeof(UGRID)*Grid_length);
     
-    UGRID *resize_GridPT3 = (UGRID *)calloc(sizeof(UGRID),(long)resize_Size.height*(long)resize_Size.width);
+    return grid;
+}
+
+void ReleaseArenaGrid(UGRIDArena *arena, UGRID *grid, const long int Grid_length)
+{
+    if(!grid)
+        return;
     
-    if(resize_Size.height > 8000 || resize_Size.width > 8000)
-        printf("resize memory allocation start %ld\n",sizeof(UGRID)*(long)resize_Size.height*(long)resize_Size.width);
+    //keep the larger buffer for the next level or tile
+    if(!arena->buffer || arena->length < Grid_length)
+    {
+        if(arena->buffer)
+            free(arena->buffer);
+        arena->buffer = grid;
+        arena->length = Grid_length;
+    }
+    else
+        free(grid);
+}
+
+static void ResampleGridPT3(const ProInfo *proinfo, const CSize preSize, const CSize resize_Size, const double *preBoundary, const double *Boundary, const D2DPOINT *resize_Grid, const UGRID *preGridPT3, const short *pre_ortho_ncc, UGRID *resize_GridPT3, short *resize_ortho_ncc, const double pre_gridsize, const double gridsize, const double *minmaxheight)
+{
+    const long int pre_Grid_length = (long)preSize.height*(long)preSize.width;
+    const long int resize_Grid_length = (long)resize_Size.height*(long)resize_Size.width;
     
-    printf("preresize memory allocation start %ld\n",sizeof(UGRID)*(long)preSize.height*(long)preSize.width);
-    for(long row=0;row<resize_Size.height;row++)
+    UGRID outside;
+    outside.minHeight     = floor(minmaxheight[0] - 0.5);
+    outside.maxHeight     = ceil(minmaxheight[1] + 0.5);
+    outside.Height        = -1000;
+    outside.Matched_flag  = 0;
+    outside.roh           = 0.0;
+    outside.anchor_flag   = 0;
+    outside.Mean_ortho_ncc= 0;
+    
+    //the next pyramid level halves the grid space on the same origin, so each previous cell covers a 2x2 block
+    const bool check_2x = preBoundary[0] == Boundary[0] && preBoundary[1] == Boundary[1] && fabs(pre_gridsize - 2.0*gridsize) < 1e-6*gridsize;
+    
+    if(check_2x)
     {
-        for(long col=0;col<resize_Size.width;col++)
+        const long inside_cols = min((long)resize_Size.width, 2L*preSize.width);
+        
+#pragma omp parallel for schedule(static)
+        for(long row=0;row<resize_Size.height;row++)
         {
-            long index = row*(long)resize_Size.width + col;
-            double X = resize_Grid[index].m_X;
-            double Y = resize_Grid[index].m_Y;
-            
-            int pos_c = (int)((X - Boundary[0])/pre_gridsize);
-            int pos_r = (int)((Y - Boundary[1])/pre_gridsize);
-            long pre_index = pos_r*(long)preSize.width + pos_c;
-            if(pos_c >= 0 && pos_c < preSize.width && pos_r >= 0 && pos_r < preSize.height && pre_index >= 0 && pre_index < (long)preSize.width*(long)preSize.height)
+            const long pos_r = row >> 1;
+            UGRID *dst = resize_GridPT3 + row*(long)resize_Size.width;
+            long col = 0;
+            if(pos_r < preSize.height)
             {
-                resize_GridPT3[index].minHeight     = preGridPT3[pre_index].minHeight;
-                resize_GridPT3[index].maxHeight     = preGridPT3[pre_index].maxHeight;
-                resize_GridPT3[index].Height        = preGridPT3[pre_index].Height;
-                resize_GridPT3[index].Matched_flag  = preGridPT3[pre_index].Matched_flag;
-                resize_GridPT3[index].roh           = preGridPT3[pre_index].roh;
-                resize_GridPT3[index].anchor_flag   = preGridPT3[pre_index].anchor_flag;
-              
-                resize_GridPT3[index].Mean_ortho_ncc=preGridPT3[pre_index].Mean_ortho_ncc;
+                const UGRID *src = preGridPT3 + pos_r*(long)preSize.width;
+                for(; col < inside_cols ; col++)
+                    dst[col] = src[col >> 1];
                 
                 for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
                 {
                     if(proinfo->check_selected_image[ti])
-                        resize_GridPT3[index].ortho_ncc[ti]     = preGridPT3[pre_index].ortho_ncc[ti];
+                    {
+                        short *dst_ncc = resize_ortho_ncc + OrthoNCCIndex(resize_Grid_length, ti, row*(long)resize_Size.width);
+                        const short *src_ncc = pre_ortho_ncc + OrthoNCCIndex(pre_Grid_length, ti, pos_r*(long)preSize.width);
+                        for(long t_col = 0 ; t_col < inside_cols ; t_col++)
+                            dst_ncc[t_col] = src_ncc[t_col >> 1];
+                    }
                 }
             }
-            else
+            for(; col < resize_Size.width ; col++)
+                dst[col] = outside;
+        }
+    }
+    else
+    {
+#pragma omp parallel for schedule(static)
+        for(long row=0;row<resize_Size.height;row++)
+        {
+            for(long col=0;col<resize_Size.width;col++)
             {
-                resize_GridPT3[index].minHeight     = floor(minmaxheight[0] - 0.5);
-                resize_GridPT3[index].maxHeight     = ceil(minmaxheight[1] + 0.5);
-                resize_GridPT3[index].Height        = -1000;
-                resize_GridPT3[index].Matched_flag  = 0;
-                resize_GridPT3[index].roh           = 0.0;
-                resize_GridPT3[index].anchor_flag   = 0;
-                for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
+                long index = row*(long)resize_Size.width + col;
+                double X = resize_Grid[index].m_X;
+                double Y = resize_Grid[index].m_Y;
+                
+                long pos_c = (long)((X - preBoundary[0])/pre_gridsize);
+                long pos_r = (long)((Y - preBoundary[1])/pre_gridsize);
+                long pre_index = pos_r*(long)preSize.width + pos_c;
+                if(pos_c >= 0 && pos_c < preSize.width && pos_r >= 0 && pos_r < preSize.height && pre_index >= 0 && pre_index < pre_Grid_length)
                 {
-                    if(proinfo->check_selected_image[ti])
-                        resize_GridPT3[index].ortho_ncc[ti]     = 0;
+                    resize_GridPT3[index] = preGridPT3[pre_index];
+                    
+                    for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
+                    {
+                        if(proinfo->check_selected_image[ti])
+                            resize_ortho_ncc[OrthoNCCIndex(resize_Grid_length, ti, index)] = pre_ortho_ncc[OrthoNCCIndex(pre_Grid_length, ti, pre_index)];
+                    }
                 }
-                resize_GridPT3[index].Mean_ortho_ncc= 0;
+                else
+                    resize_GridPT3[index] = outside;
             }
         }
     }
+}
+
+UGRID* ResizeGirdPT3(ProInfo *proinfo, CSize preSize, CSize resize_Size, double* Boundary, D2DPOINT *resize_Grid, UGRID *preGridPT3, short **ortho_ncc, UGRIDArena *arena, double pre_gridsize, double gridsize, double* minmaxheight)
+{
+    if(resize_Size.height > 8000 || resize_Size.width > 8000)
+        printf("resize memory allocation start\n");
+    
+    const long int pre_Grid_length = (long)preSize.height*(long)preSize.width;
+    const long int resize_Grid_length = (long)resize_Size.height*(long)resize_Size.width;
+    UGRID *resize_GridPT3 = GetArenaGrid(arena, resize_Grid_length);
+    short *pre_ortho_ncc = *ortho_ncc;
+    short *resize_ortho_ncc = SetOrthoNCCPlanes(proinfo, resize_Grid_length);
+    
+    if(resize_Size.height > 8000 || resize_Size.width > 8000)
+        printf("resize memory allocation start %ld\n",sizeof(UGRID)*(long)resize_Size.height*(long)resize_Size.width);
+    
+    printf("preresize memory allocation start %ld\n",sizeof(UGRID)*(long)preSize.height*(long)preSize.width);
+    
+    ResampleGridPT3(proinfo, preSize, resize_Size, Boundary, Boundary, resize_Grid, preGridPT3, pre_ortho_ncc, resize_GridPT3, resize_ortho_ncc, pre_gridsize, gridsize, minmaxheight);
     
     printf("before release preGirdPT3\n");
     
-    free(preGridPT3);
+    ReleaseArenaGrid(arena, preGridPT3, pre_Grid_length);
+    free(pre_ortho_ncc);
+    *ortho_ncc = resize_ortho_ncc;
     
     printf("after release preGirdPT3\n");
 
     return resize_GridPT3;
 }
 
-UGRID* ResizeGirdPT3_RA(const ProInfo *proinfo,const CSize preSize,const CSize resize_Size,const double* preBoundary,const double* Boundary, const D2DPOINT *resize_Grid, UGRID *preGridPT3, const double pre_gridsize,const double* minmaxheight)
+UGRID* ResizeGirdPT3_RA(const ProInfo *proinfo,const CSize preSize,const CSize resize_Size,const double* preBoundary,const double* Boundary, const D2DPOINT *resize_Grid, UGRID *preGridPT3, short **ortho_ncc, UGRIDArena *arena, const double pre_gridsize, const double gridsize, const double* minmaxheight)
 {
+    const long int pre_Grid_length = (long)preSize.height*(long)preSize.width;
+    const long int resize_Grid_length = (long)resize_Size.height*(long)resize_Size.width;
+    UGRID *resize_GridPT3 = GetArenaGrid(arena, resize_Grid_length);
+    short *pre_ortho_ncc = *ortho_ncc;
+    short *resize_ortho_ncc = SetOrthoNCCPlanes(proinfo, resize_Grid_length);
     
-    UGRID *resize_GridPT3 = (UGRID *)calloc(sizeof(UGRID),resize_Size.height*resize_Size.width);
-    
-    for(long int row=0;row<resize_Size.height;row++)
-    {
-        for(long int col=0;col<resize_Size.width;col++)
-        {
-            long int index = row*(long int)resize_Size.width + col;
-            double X = resize_Grid[index].m_X;
-            double Y = resize_Grid[index].m_Y;
-            long int pos_c = (long int)((X - preBoundary[0])/pre_gridsize);
-            long int pos_r = (long int)((Y - preBoundary[1])/pre_gridsize);
-            long int pre_index = pos_r*(long int)preSize.width + pos_c;
-            if(pos_c >= 0 && pos_c < preSize.width && pos_r >= 0 && pos_r < preSize.height && pre_index >= 0 && pre_index < (long)preSize.width*(long)preSize.height)
-            {
-                resize_GridPT3[index].minHeight     = preGridPT3[pre_index].minHeight;
-                resize_GridPT3[index].maxHeight     = preGridPT3[pre_index].maxHeight;
-                resize_GridPT3[index].Height        = preGridPT3[pre_index].Height;
-                resize_GridPT3[index].Matched_flag  = preGridPT3[pre_index].Matched_flag;
-                resize_GridPT3[index].roh           = preGridPT3[pre_index].roh;
-                resize_GridPT3[index].anchor_flag   = preGridPT3[pre_index].anchor_flag;
-                for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
-                {
-                    if(proinfo->check_selected_image[ti])
-                        resize_GridPT3[index].ortho_ncc[ti]     = preGridPT3[pre_index].ortho_ncc[ti];
-                }
-                resize_GridPT3[index].Mean_ortho_ncc=preGridPT3[pre_index].Mean_ortho_ncc;
-            }
-            else
-            {
-                resize_GridPT3[index].minHeight     = floor(minmaxheight[0] - 0.5);
-                resize_GridPT3[index].maxHeight     = ceil(minmaxheight[1] + 0.5);
-                resize_GridPT3[index].Height        = -1000;
-                resize_GridPT3[index].Matched_flag  = 0;
-                resize_GridPT3[index].roh           = 0.0;
-                resize_GridPT3[index].anchor_flag   = 0;
-                for(int ti = 1 ; ti < proinfo->number_of_images ; ti++)
-                {
-                    if(proinfo->check_selected_image[ti])
-                        resize_GridPT3[index].ortho_ncc[ti]     = 0;
-                }
-            }
-        }
-    }
+    ResampleGridPT3(proinfo, preSize, resize_Size, preBoundary, Boundary, resize_Grid, preGridPT3, pre_ortho_ncc, resize_GridPT3, resize_ortho_ncc, pre_gridsize, gridsize, minmaxheight);
     
     printf("before release preGirdPT3\n");
     
-    free(preGridPT3);
+    ReleaseArenaGrid(arena, preGridPT3, pre_Grid_length);
+    free(pre_ortho_ncc);
+    *ortho_ncc = resize_ortho_ncc;
     
     printf("after release preGirdPT3\n");
     
     return resize_GridPT3;
 }
 
-static void update_max(std::atomic<float> *cur, float val) {
-    float prev = *cur;
-    // exit this loop if cur becomes larger (or is larger) than val,
-    // or if cur is updated to val. This update will only happen when
-    // val is larger than cur.
-    //
-    // See here for a similar construct: https://stackoverflow.com/a/16190791
-    while(val > prev) {
-        if(cur->compare_exchange_weak(prev, val)) {
-            break;
-        }
-    }
-}
-
 bool SetHeightRange_blunder(LevelInfo &rlevelinfo, const D3DPOINT *pts, const int numPts, UI3DPOINT *tris,const long num_triangles, UGRID *GridPT3)
 {
-
-    int len = rlevelinfo.Size_Grid2D->width * rlevelinfo.Size_Grid2D->height;
-
-    constexpr double unset = -1000;
-    std::unique_ptr<std::atomic<float>[]> heights(new std::atomic<float>[len]);
-    for(int i = 0; i < len; i++) {
+    const long len = *rlevelinfo.Grid_length;
+    
+    const float unset = -1000;
+    float *heights = (float*)malloc(sizeof(float)*len);
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < len; i++)
         heights[i] = unset;
-    }
-
-#pragma omp parallel for schedule(guided)
-    for(long tcnt=0;tcnt<num_triangles;tcnt++)
+    
+    //unused in this function, but SetTinTileBins requres them
+    double Total_Min_Z      =  100000;
+    double Total_Max_Z      = -100000;
+    
+    TinTileBins bins;
+    SetTinTileBins(rlevelinfo, pts, numPts, tris, num_triangles, &bins, Total_Min_Z, Total_Max_Z);
+    
+    //each tile is owned by one thread, so the max height of overlapping triangles needs no atomics
+#pragma omp parallel for schedule(dynamic,1)
+    for(long tile = 0 ; tile < (long)bins.tiles_x*(long)bins.tiles_y ; tile++)
     {
-        //unused in this function, but SetTinBoundary requres them
-        double Total_Min_Z      =  100000;
-        double Total_Max_Z      = -100000;
-
-        // get triangle and it's indicies
-        const UI3DPOINT &t_tri = (tris[tcnt]);
-        const int pdex0 = t_tri.m_X;
-        const int pdex1 = t_tri.m_Y;
-        const int pdex2 = t_tri.m_Z;
-        
-        // if triangle not entirely within grid, continue
-        // this is mostly a sanity check I think
-        if(pdex0 < numPts && pdex1 < numPts && pdex2 < numPts)
+        for(long k = bins.start[tile] ; k < bins.start[tile + 1] ; k++)
         {
-            // Get the point corresponding to each triangle
-            // vertex
-            const D3DPOINT &TriP1 = (pts[pdex0]);
-            const D3DPOINT &TriP2 = (pts[pdex1]);
-            const D3DPOINT &TriP3 = (pts[pdex2]);
-
-
-            // These will be pooulated with a bounding box
-            // around the triangle
+            const long tcnt = bins.tri_index[k];
             int PixelMinXY[2], PixelMaxXY[2];
-
-            // These are unused in this function, but
-            // SetTinBoundary requries them
-            double temp_MinZ, temp_MaxZ;
-            SetTinBoundary(
-                rlevelinfo,
-                TriP1,
-                TriP2,
-                TriP3,
-                PixelMinXY,
-                PixelMaxXY,
-                Total_Min_Z,
-                Total_Max_Z,
-                temp_MinZ,
-                temp_MaxZ);
-            
-            // iterate through points in the triangle bounding box
+            if(!GetTinTileBox(bins, tile, tcnt, PixelMinXY, PixelMaxXY))
+                continue;
+            
+            const UI3DPOINT &t_tri = (tris[tcnt]);
+            const TinEdgeFunction edge(rlevelinfo, pts[t_tri.m_X], pts[t_tri.m_Y], pts[t_tri.m_Z]);
+            if(!edge.valid)
+                continue;
+            
             for (long Row=PixelMinXY[1]; Row <= PixelMaxXY[1]; Row++)
             {
-                for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++)
+                double E[3];
+                edge.SetRow(PixelMinXY[0], Row, E);
+                for (long Col=PixelMinXY[0]; Col <= PixelMaxXY[0]; Col++, edge.NextCol(E))
                 {
-                    //Index of the point in GridPT3
-                    const int Index= (long)rlevelinfo.Size_Grid2D->width*Row + Col;
-
-                    float Z = -1000.0;
-                    bool rtn = false;
-                     
-                    // The point on object/world coordinates
-                    // x, y, z, flag
-                    D3DPOINT CurGPXY(
-                        (Col)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[0],
-                        (Row)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[1],
-                        0,
-                        0);
-
-                    // checks to see if point is inside triangle
-                    // if it is, returns true
-                    // if inside, interpolates height value of point
-                    // and puts that value in Z
-                    rtn = IsTinInside(CurGPXY, TriP1, TriP2, TriP3, Z);
-                    
-                    if (rtn)
+                    if (edge.IsInside(E))
                     {
-                        update_max(&heights[Index], (float)Z);
+                        const long Index = (long)rlevelinfo.Size_Grid2D->width*Row + Col;
+                        const float Z = edge.Height((Col)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[0], (Row)*(*rlevelinfo.grid_resolution) + rlevelinfo.Boundary[1]);
+                        if(Z > heights[Index])
+                            heights[Index] = Z;
                     }
                 }
             }
         }
     }
-    for(int i = 0; i < len; i++) {
+    
+#pragma omp parallel for schedule(static)
+    for(long i = 0; i < len; i++) {
         if(heights[i] != unset) {
             GridPT3[i].Height = heights[i];
         }
     }
+    
+    free(heights);
     return true;
 }
 
-void echoprint_Gridinfo(ProInfo *proinfo,NCCresult* roh_height,int row,int col,int level, int iteration, double update_flag, CSize *Size_Grid2D, UGRID *GridPT3, char *add_str)
+void echoprint_Gridinfo(ProInfo *proinfo,const NCCresult &roh_height,int row,int col,int level, int iteration, double update_flag, CSize *Size_Grid2D, UGRID *GridPT3, char *add_str)
 {
     FILE *outfile_h,*outfile_min, *outfile_max,   *outfile_flag, *outMean_ortho, *outMean_ortho_asc;
     CSize temp_S;
@@ -10461,7 +10904,7 @@ void echoprint_Gridinfo(ProInfo *proinfo,NCCresult* roh_height,int row,int col,i
     }
 }
 
-void echo_print_nccresults(char *save_path,int row,int col,int level, int iteration, NCCresult *nccresult, CSize *Size_Grid2D, char *add_str)
+void echo_print_nccresults(char *save_path,int row,int col,int level, int iteration, NCCresult &nccresult, CSize *Size_Grid2D, char *add_str)
 {
     int k,j;
     FILE *outfile_min, *outfile_max, *outfile_h, *outfile_roh, *outfile_diff, *outfile_peak, *outINCC, *outGNCC,*outcount;
@@ -10542,12 +10985,6 @@ int AdjustParam(ProInfo *proinfo, LevelInfo &rlevelinfo, int NumofPts, double **
     CSize LImagesize(rlevelinfo.py_Sizes[reference_id][Pyramid_step].width, rlevelinfo.py_Sizes[reference_id][Pyramid_step].height);
     const double left_IA[2] = {ImageAdjust[reference_id][0], ImageAdjust[reference_id][1]};
    
-    double subA[9][6] = {0};
-    double TsubA[6][9] = {0};
-    double InverseSubA[6][6] = {0};
-
-    Set6by6Matrix(subA,TsubA,InverseSubA);
-
     D3DPOINT *Coord           = ps2wgs_3D(*rlevelinfo.param,NumofPts,ptslists);
 
     int iter_count = 0;
@@ -10569,10 +11006,12 @@ int AdjustParam(ProInfo *proinfo, LevelInfo &rlevelinfo, int NumofPts, double **
                 const double b_factor             = pwrtwo(total_pyramid-Pyramid_step+1);
                 const int Half_template_size   = (int)(*rlevelinfo.Template_size/2.0);
                 int patch_size = (2*Half_template_size+1) * (2*Half_template_size+1);
+                const KernelOffsetLUT rot_lut(Half_template_size, Half_template_size - 1, *rlevelinfo.bin_angle);
 
 #pragma omp parallel reduction(+:count_pts)
                 {
-                    Matrix left_patch_vecs(3, patch_size);
+                    //row 3 of left_patch_vecs holds the left kernel, interpolated once per point
+                    Matrix left_patch_vecs(4, patch_size);
                     Matrix right_patch_vecs(3, patch_size);
                     
 #pragma omp for schedule(guided)
@@ -10596,7 +11035,7 @@ int AdjustParam(ProInfo *proinfo, LevelInfo &rlevelinfo, int NumofPts, double **
                             {
                                 double ori_diff = rlevelinfo.py_OriImages[reference_id][index_l] - rlevelinfo.py_OriImages[ti][index_r];
                                 
-                                if(postNCC(rlevelinfo, ori_diff, Left_Imagecoord, Right_Imagecoord, subA, TsubA, InverseSubA, Half_template_size, reference_id, ti, &t_sum_weight_X, &t_sum_weight_Y, &t_sum_max_roh, left_patch_vecs, right_patch_vecs))
+                                if(postNCC(rlevelinfo, ori_diff, Left_Imagecoord, Right_Imagecoord, Half_template_size, rot_lut, reference_id, ti, &t_sum_weight_X, &t_sum_weight_Y, &t_sum_max_roh, left_patch_vecs, right_patch_vecs))
                                 {
                                     weights_X[i] = t_sum_weight_X;
                                     weights_Y[i] = t_sum_weight_Y;
@@ -10650,7 +11089,7 @@ int AdjustParam(ProInfo *proinfo, LevelInfo &rlevelinfo, int NumofPts, double **
 }
 
 
-bool postNCC(LevelInfo &rlevelinfo, const double Ori_diff, const D2DPOINT left_pt, const D2DPOINT right_pt, double subA[][6], double TsubA[][9], double InverseSubA[][6], uint8 Half_template_size, const int reference_ID, const int target_ID, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, Matrix &left_patch_vecs, Matrix &right_patch_vecs)
+bool postNCC(LevelInfo &rlevelinfo, const double Ori_diff, const D2DPOINT left_pt, const D2DPOINT right_pt, uint8 Half_template_size, const KernelOffsetLUT &rot_lut, const int reference_ID, const int target_ID, double *sum_weight_X, double *sum_weight_Y, double *sum_max_roh, Matrix &left_patch_vecs, Matrix &right_patch_vecs)
 {
     bool check_pt = false;
  
@@ -10661,79 +11100,83 @@ bool postNCC(LevelInfo &rlevelinfo, const double Ori_diff, const D2DPOINT left_p
     double result_rho[9]  = {};
     
     uint8 cell_count = 0;
+    const vector<KernelOffset> &kernel_offsets = rot_lut.Get(Ori_diff);
 
     for(int j=0;j<9;j++)
         result_rho[j]       = -1.00;
 
+    //the left kernel doesn't move with the mask, so interpolate it once for all 9 cells
+    for(size_t k = 0 ; k < kernel_offsets.size() ; k++)
+    {
+        double pos_row_left      = (left_pt.m_Y + kernel_offsets[k].row);
+        double pos_col_left      = (left_pt.m_X + kernel_offsets[k].col);
+        
+        if(pos_row_left-3 >= 0 && pos_row_left+3 < leftsize.height && pos_col_left-3 >= 0 && pos_col_left+3 < leftsize.width)
+        {
+            double dx = pos_col_left - (int) (pos_col_left);
+            double dy = pos_row_left - (int) (pos_row_left);
+            long position = (long int) (pos_col_left) + (long int) (pos_row_left) * (long)leftsize.width;
+            
+            left_patch_vecs(3, k) = InterpolatePatch(rlevelinfo.py_Images[reference_ID], position, leftsize, dx, dy);
+        }
+    }
+
     for(long mask_row = - half_mask_size ; mask_row <= half_mask_size ; mask_row++)
     {
         for(long mask_col = - half_mask_size ; mask_col <= half_mask_size ; mask_col++)
         {
             int Count_N[3] = {0};
-            double rot_theta = (double)(Ori_diff*(*rlevelinfo.bin_angle)*PI/180.0);
-        
-            for(long row = -Half_template_size; row <= Half_template_size ; row++)
+            
+            for(size_t k = 0 ; k < kernel_offsets.size() ; k++)
             {
-                for(long col = -Half_template_size; col <= Half_template_size ; col++)
-                {
-                    double radius2  = (double)(row*row + col*col);
-                    if(radius2 <= (Half_template_size-1)*(Half_template_size-1))
-                    {
-                        double pos_row_left      = (left_pt.m_Y + row);
-                        double pos_col_left      = (left_pt.m_X + col);
+                const int row = kernel_offsets[k].row;
+                const int col = kernel_offsets[k].col;
+                double pos_row_left      = (left_pt.m_Y + row);
+                double pos_col_left      = (left_pt.m_X + col);
 
-                        double temp_col        = (cos(-rot_theta)*col - sin(-rot_theta)*row);
-                        double temp_row        = (sin(-rot_theta)*col + cos(-rot_theta)*row);
-                        double pos_row_right     = (right_pt.m_Y + temp_row + mask_row);
-                        double pos_col_right     = (right_pt.m_X + temp_col + mask_col);
+                double pos_row_right     = (right_pt.m_Y + kernel_offsets[k].pos.m_Y + mask_row);
+                double pos_col_right     = (right_pt.m_X + kernel_offsets[k].pos.m_X + mask_col);
 
-                        if(pos_row_right-3 >= 0 && pos_row_right+3 < rightsize.height && pos_col_right-3 >= 0 && pos_col_right+3 < rightsize.width &&
-                           pos_row_left-3 >= 0 && pos_row_left+3 < leftsize.height && pos_col_left-3 >= 0 && pos_col_left+3 < leftsize.width)
-                        {
-                            //interpolate left_patch
-                            double dx = pos_col_left - (int) (pos_col_left);
-                            double dy = pos_row_left - (int) (pos_row_left);
-                            long position = (long int) (pos_col_left) + (long int) (pos_row_left) * (long)leftsize.width;
-                            
-                            double left_patch = InterpolatePatch(rlevelinfo.py_Images[reference_ID], position, leftsize, dx, dy);
-                            left_patch_vecs(0, Count_N[0]) = left_patch;
+                if(pos_row_right-3 >= 0 && pos_row_right+3 < rightsize.height && pos_col_right-3 >= 0 && pos_col_right+3 < rightsize.width &&
+                   pos_row_left-3 >= 0 && pos_row_left+3 < leftsize.height && pos_col_left-3 >= 0 && pos_col_left+3 < leftsize.width)
+                {
+                    double left_patch = left_patch_vecs(3, k);
+                    left_patch_vecs(0, Count_N[0]) = left_patch;
 
-                            //interpolate right_patch
-                            dx = pos_col_right - (int) (pos_col_right);
-                            dy = pos_row_right - (int) (pos_row_right);
-                            position = (long int) (pos_col_right) + (long int) (pos_row_right) * (long)rightsize.width;
-                            
-                            double right_patch = InterpolatePatch(rlevelinfo.py_Images[target_ID], position, rightsize, dx, dy);
-                            right_patch_vecs(0, Count_N[0]) = right_patch;
-                            
-                            //end
-                            Count_N[0]++;
+                    //interpolate right_patch
+                    double dx = pos_col_right - (int) (pos_col_right);
+                    double dy = pos_row_right - (int) (pos_row_right);
+                    long position = (long int) (pos_col_right) + (long int) (pos_row_right) * (long)rightsize.width;
+                    
+                    double right_patch = InterpolatePatch(rlevelinfo.py_Images[target_ID], position, rightsize, dx, dy);
+                    right_patch_vecs(0, Count_N[0]) = right_patch;
+                    
+                    //end
+                    Count_N[0]++;
 
-                            int size_1        = (int)(Half_template_size/2);
-                            if( row >= -Half_template_size + size_1 && row <= Half_template_size - size_1)
-                            {
-                                if( col >= -Half_template_size + size_1 && col <= Half_template_size - size_1)
-                                {
-                                    left_patch_vecs(1, Count_N[1]) = left_patch;
-                                    right_patch_vecs(1, Count_N[1]) = right_patch;
-                                    Count_N[1]++;
-                                }
-                            }
+                    int size_1        = (int)(Half_template_size/2);
+                    if( row >= -Half_template_size + size_1 && row <= Half_template_size - size_1)
+                    {
+                        if( col >= -Half_template_size + size_1 && col <= Half_template_size - size_1)
+                        {
+                            left_patch_vecs(1, Count_N[1]) = left_patch;
+                            right_patch_vecs(1, Count_N[1]) = right_patch;
+                            Count_N[1]++;
+                        }
+                    }
 
-                            int size_2        = size_1 + (int)((size_1/2.0) + 0.5);
-                            if( row >= -Half_template_size + size_2 && row <= Half_template_size - size_2)
-                            {
-                                if( col >= -Half_template_size + size_2 && col <= Half_template_size - size_2)
-                                {
-                                    left_patch_vecs(2, Count_N[2]) = left_patch;
-                                    right_patch_vecs(2, Count_N[2]) = right_patch;
-                                    Count_N[2]++;
-                                }
-                            }
+                    int size_2        = size_1 + (int)((size_1/2.0) + 0.5);
+                    if( row >= -Half_template_size + size_2 && row <= Half_template_size - size_2)
+                    {
+                        if( col >= -Half_template_size + size_2 && col <= Half_template_size - size_2)
+                        {
+                            left_patch_vecs(2, Count_N[2]) = left_patch;
+                            right_patch_vecs(2, Count_N[2]) = right_patch;
+                            Count_N[2]++;
                         }
                     }
-                }  // end col loop
-            }  // end row loop
+                }
+            }  // end kernel offset loop
 
             if(Count_N[0] > 0 && Count_N[1] && Count_N[2])
             {
@@ -10769,11 +11212,8 @@ bool postNCC(LevelInfo &rlevelinfo, const double Ori_diff, const D2DPOINT left_p
     double t_weight_X   = 0;
     double t_weight_Y   = 0;
     double t_max_roh    = 0;
-    double XX[6]          = {};
-    double ATLT[6]        = {};
     if(cell_count == 9)
     {
-        double demnum;
         double max_X        = 100;
         double max_Y        = 100;
         double max_roh      = 0;
@@ -10781,35 +11221,8 @@ bool postNCC(LevelInfo &rlevelinfo, const double Ori_diff, const D2DPOINT left_p
         bool find_index_2   = false;
         bool find_index     = false;
 
-        for(int i=0;i<6;i++)
-        {
-            for(int j=0;j<1;j++)
-            {
-                double sum = 0.0;
-                for(int k=0;k<9;k++)
-                    sum += TsubA[i][k]*result_rho[k*1 + j];
-                ATLT[i*1 + j] = sum;
-            }
-        }
-
-        for(int i=0;i<6;i++)
-        {
-            for(int j=0;j<1;j++)
-            {
-                double sum = 0.0;
-                for(int k=0;k<6;k++)
-                    sum += InverseSubA[i][k]*ATLT[k*1 + j];
-                XX[i*1 + j] = sum;
-            }
-        }
-
-        demnum      = -pow(XX[4],2.0) + 4*XX[3]*XX[5];
-        if(demnum > 0 && XX[3] < 0)
+        if(FitPeak3x3(result_rho, max_X, max_Y, max_roh))
         {
-            max_X = (- 2*XX[5]*XX[1] + XX[2]*XX[4])/demnum;
-            max_Y = (- 2*XX[2]*XX[3] + XX[1]*XX[4])/demnum;
-            max_roh =  XX[0]                + XX[1]*max_X           + XX[2]*max_Y
-                + XX[3]*max_X*max_X + XX[4]*max_X*max_Y + XX[5]*max_Y*max_Y;
             if(fabs(max_X) <= 1.0)
                 find_index_1 = true;
             if(fabs(max_Y) <= 1.0)
@@ -4,6 +4,10 @@
 #include <stdlib.h>
 #include "math.h"
 #include <cmath>
+#include <algorithm>
+
+using std::min;
+using std::max;
 
 #define FLOAT 4
 #define UCHAR 1
@@ -16,7 +20,6 @@ static const TIFFFieldInfo xtiffFieldInfo[] = {
 };
 
 #define STRIP_SIZE_DEFAULT 8192
-#define max(a, b)  (((a) > (b)) ? (a) : (b))
 
 int WriteGeotiff(char *filename, void *buffer, size_t width, size_t height, double scale, double minX, double maxY, int projection, int zone, int NS_hemisphere, int data_type)
 {
@@ -166,7 +169,7 @@ CSize ReadGeotiff_info_dxy(char *filename, double *minX, double *maxY, double *g
     return image_size;
 }
 
-void SetUpTIFFDirectory(TIFF *tif, size_t width, size_t height, double scale, double minX, double maxY, int data_type)
+void SetUpTIFFDirectory(TIFF *tif, size_t width, size_t height, double scale, double minX, double maxY, int data_type, uint32 tile_size)
 {
     double tiepoints[6] = {0};
     double pixscale[3] = {0};
@@ -185,33 +188,150 @@ void SetUpTIFFDirectory(TIFF *tif, size_t width, size_t height, double scale, do
     TIFFSetField(tif, TIFFTAG_PREDICTOR, 1);
     TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
     
-    //TIFFSetField(tif, TIFFTAG_TILEWIDTH, 256);
-    //TIFFSetField(tif, TIFFTAG_TILELENGTH,  256);
-    
+    size_t bits = 0;
     switch (data_type)
     {
         case FLOAT:
+            bits = 32;
             TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
             TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
             TIFFMergeFieldInfo(tif, xtiffFieldInfo, N(xtiffFieldInfo));
             TIFFSetField(tif, GDAL_NODATA, "-9999");
-            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, max(1, (STRIP_SIZE_DEFAULT * 8) / (width * 32)));
             break;
         case UCHAR:
+            bits = 8;
             TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
             TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 2);
-            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, max(1, (STRIP_SIZE_DEFAULT * 8) / (width * 8)));
             break;
         case UINT16:
+            bits = 16;
             TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
             TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 1);
-            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, max(1, (STRIP_SIZE_DEFAULT * 8) / (width * 16)));
             break;
         default:
             break;
     }
+    
+    if (tile_size > 0)
+    {
+        TIFFSetField(tif, TIFFTAG_TILEWIDTH, tile_size);
+        TIFFSetField(tif, TIFFTAG_TILELENGTH, tile_size);
+    }
+    else if (bits > 0)
+        TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, max((size_t)1, (STRIP_SIZE_DEFAULT * 8) / (width * bits)));
+}
+
+bool OpenGeotiffTileWriter(const char *filename, GeotiffTileWriter *writer, size_t width, size_t height, double scale, double minX, double maxY, int projection, int zone, int NS_hemisphere, int data_type)
+{
+    writer->width = width;
+    writer->height = height;
+    writer->rows_written = 0;
+    writer->data_type = data_type;
+    writer->gtif = NULL;
+    
+    if (data_type != FLOAT && data_type != UINT16)
+    {
+        printf("unrecognized tiled data type: %d\n", data_type);
+        writer->tif = NULL;
+        return false;
+    }
+    
+    writer->tif = XTIFFOpen(filename, "w8");
+    if (!writer->tif)
+    {
+        printf("OpenGeotiffTileWriter failed in XTIFFOpen\n");
+        return false;
+    }
+    
+    writer->gtif = GTIFNew(writer->tif);
+    if (!writer->gtif)
+    {
+        printf("OpenGeotiffTileWriter failed in GTIFNew\n");
+        XTIFFClose(writer->tif);
+        writer->tif = NULL;
+        return false;
+    }
+    
+    SetUpTIFFDirectory(writer->tif, width, height, scale, minX, maxY, data_type, GEOTIFF_TILE_SIZE);
+    SetUpGeoKeys(writer->gtif, projection, zone, NS_hemisphere);
+    
+    return true;
+}
+
+//edge tiles are padded with pad
+template <typename T>
+static bool WriteGeotiffTileBand_T(GeotiffTileWriter *writer, const T *band, size_t rows, const T pad)
+{
+    const size_t row_start = writer->rows_written;
+    if (row_start % GEOTIFF_TILE_SIZE != 0 || (rows % GEOTIFF_TILE_SIZE != 0 && row_start + rows < writer->height))
+    {
+        printf("WriteGeotiffTileBand needs bands of whole tile rows (row %ld, %ld rows)\n",(long)row_start,(long)rows);
+        return false;
+    }
+    
+    vector<T> tile(GEOTIFF_TILE_SIZE*GEOTIFF_TILE_SIZE);
+    bool check_write = true;
+    for (size_t tile_row = 0; tile_row < rows; tile_row += GEOTIFF_TILE_SIZE)
+    {
+        for (size_t tile_col = 0; tile_col < writer->width; tile_col += GEOTIFF_TILE_SIZE)
+        {
+            for (size_t r = 0; r < GEOTIFF_TILE_SIZE; r++)
+            {
+                for (size_t c = 0; c < GEOTIFF_TILE_SIZE; c++)
+                {
+                    if (tile_row + r < rows && tile_col + c < writer->width)
+                        tile[r*GEOTIFF_TILE_SIZE + c] = band[(tile_row + r)*writer->width + tile_col + c];
+                    else
+                        tile[r*GEOTIFF_TILE_SIZE + c] = pad;
+                }
+            }
+            
+            const ttile_t tile_index = TIFFComputeTile(writer->tif, tile_col, row_start + tile_row, 0, 0);
+            if (TIFFWriteEncodedTile(writer->tif, tile_index, &tile[0], sizeof(T)*tile.size()) == -1)
+            {
+                TIFFError("WriteGeotiffTileBand","failure in WriteEncodedTile on row %ld col %ld\n", (long)(row_start + tile_row), (long)tile_col);
+                check_write = false;
+            }
+        }
+    }
+    
+    writer->rows_written += rows;
+    return check_write;
+}
+
+bool WriteGeotiffTileBand(GeotiffTileWriter *writer, const float *band, size_t rows)
+{
+    if (writer->data_type != FLOAT)
+    {
+        printf("WriteGeotiffTileBand float band for data type %d\n", writer->data_type);
+        return false;
+    }
+    return WriteGeotiffTileBand_T(writer, band, rows, (float)Nodata);
+}
+
+//0 is the no data value of uint16 images
+bool WriteGeotiffTileBand(GeotiffTileWriter *writer, const uint16 *band, size_t rows)
+{
+    if (writer->data_type != UINT16)
+    {
+        printf("WriteGeotiffTileBand uint16 band for data type %d\n", writer->data_type);
+        return false;
+    }
+    return WriteGeotiffTileBand_T(writer, band, rows, (uint16)0);
+}
+
+void CloseGeotiffTileWriter(GeotiffTileWriter *writer)
+{
+    if (writer->gtif)
+    {
+        GTIFWriteKeys(writer->gtif);
+        GTIFFree(writer->gtif);
+    }
+    if (writer->tif)
+        XTIFFClose(writer->tif);
+    
+    writer->gtif = NULL;
+    writer->tif = NULL;
 }
 
 void SetUpGeoKeys(GTIF *gtif, int projection, int zone, int NS_hemisphere)
@@ -265,3 +385,308 @@ void SetUpGeoKeys(GTIF *gtif, int projection, int zone, int NS_hemisphere)
         }
     }
 }
+
+bool OpenDEMAccessor(const char *filename, DEMAccessor *dem, const int max_blocks)
+{
+    dem->tif = XTIFFOpen(filename, "r");
+    dem->raw = NULL;
+    if (!dem->tif)
+    {
+        printf("DEM file %s cannot be opened\n",filename);
+        return false;
+    }
+    
+    dem->size = ReadGeotiff_info(filename, &dem->minX, &dem->maxY, &dem->grid_size);
+    
+    uint32 tileW = 0, tileL = 0;
+    if (TIFFGetField(dem->tif, TIFFTAG_TILEWIDTH, &tileW) == 1)
+    {
+        TIFFGetField(dem->tif, TIFFTAG_TILELENGTH, &tileL);
+        dem->tiled          = true;
+        dem->block_width    = tileW;
+        dem->block_height   = tileL;
+    }
+    else
+    {
+        uint32 rowsperstrip = dem->size.height;
+        TIFFGetField(dem->tif, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+        if (rowsperstrip > (uint32)dem->size.height)
+            rowsperstrip = dem->size.height;
+        
+        dem->tiled          = false;
+        dem->block_width    = dem->size.width;
+        dem->block_height   = rowsperstrip;
+    }
+    
+    dem->blocks_x   = (dem->size.width + dem->block_width - 1)/dem->block_width;
+    dem->max_blocks = max_blocks > 0 ? max_blocks : 1;
+    dem->use_count  = 0;
+    dem->last_block = -1;
+    dem->cache.clear();
+    
+    printf("DEM accessor %s size %d\t%d\tblock %d\t%d\ttiled %d\n",filename,dem->size.width,dem->size.height,dem->block_width,dem->block_height,dem->tiled);
+    
+    return true;
+}
+
+bool OpenDEMAccessor_raw(const char *filename, const CSize size, const double minX, const double maxY, const double grid_size, DEMAccessor *dem, const int max_blocks)
+{
+    dem->tif = NULL;
+    dem->raw = fopen(filename, "rb");
+    if (!dem->raw)
+    {
+        printf("DEM file %s cannot be opened\n",filename);
+        return false;
+    }
+    
+    dem->size       = size;
+    dem->minX       = minX;
+    dem->maxY       = maxY;
+    dem->grid_size  = grid_size;
+    
+    dem->tiled          = false;
+    dem->block_width    = size.width;
+    dem->block_height   = size.height < DEM_RAW_BLOCK_ROWS ? size.height : DEM_RAW_BLOCK_ROWS;
+    
+    dem->blocks_x   = 1;
+    dem->max_blocks = max_blocks > 0 ? max_blocks : 1;
+    dem->use_count  = 0;
+    dem->last_block = -1;
+    dem->cache.clear();
+    
+    return true;
+}
+
+void CloseDEMAccessor(DEMAccessor *dem)
+{
+    for (size_t i = 0; i < dem->cache.size(); i++)
+        free(dem->cache[i].data);
+    dem->cache.clear();
+    dem->last_block = -1;
+    
+    if (dem->tif)
+        XTIFFClose(dem->tif);
+    if (dem->raw)
+        fclose(dem->raw);
+    
+    dem->tif = NULL;
+    dem->raw = NULL;
+}
+
+//false when the block could not be read in full; data is then all Nodata
+static bool ReadDEMBlock(DEMAccessor *dem, const long key, float *data)
+{
+    const long block_length = (long)dem->block_width*(long)dem->block_height;
+    for (long i = 0; i < block_length; i++)
+        data[i] = Nodata;
+    
+    const long block_col = key % dem->blocks_x;
+    const long block_row = key / dem->blocks_x;
+    
+    bool check_read = true;
+    if (dem->tif)
+    {
+        tsize_t ret;
+        if (dem->tiled)
+            ret = TIFFReadEncodedTile(dem->tif, TIFFComputeTile(dem->tif, block_col*dem->block_width, block_row*dem->block_height, 0, 0), data, sizeof(float)*block_length);
+        else
+            ret = TIFFReadEncodedStrip(dem->tif, TIFFComputeStrip(dem->tif, block_row*dem->block_height, 0), data, sizeof(float)*block_length);
+        
+        check_read = ret >= 0;
+    }
+    else if (dem->raw)
+    {
+        const long start_row = block_row*dem->block_height;
+        long num_rows = dem->size.height - start_row;
+        if (num_rows > dem->block_height)
+            num_rows = dem->block_height;
+        
+        const size_t count = num_rows*(long)dem->size.width;
+        check_read = fseek(dem->raw, sizeof(float)*start_row*(long)dem->size.width, SEEK_SET) == 0 && fread(data, sizeof(float), count, dem->raw) == count;
+    }
+    
+    if (!check_read)
+    {
+        printf("DEM block %ld cannot be read\n",key);
+        for (long i = 0; i < block_length; i++)
+            data[i] = Nodata;
+    }
+    
+    return check_read;
+}
+
+static const float *GetDEMBlock(DEMAccessor *dem, const long key)
+{
+    dem->use_count++;
+    
+    if (dem->last_block >= 0 && dem->cache[dem->last_block].key == key)
+    {
+        dem->cache[dem->last_block].last_use = dem->use_count;
+        return dem->cache[dem->last_block].data;
+    }
+    
+    int oldest = 0;
+    for (int i = 0; i < (int)dem->cache.size(); i++)
+    {
+        if (dem->cache[i].key == key)
+        {
+            dem->cache[i].last_use = dem->use_count;
+            dem->last_block = i;
+            return dem->cache[i].data;
+        }
+        if (dem->cache[i].last_use < dem->cache[oldest].last_use)
+            oldest = i;
+    }
+    
+    //miss: take a new slot while the cache has room, otherwise reuse the least recently used one
+    if ((int)dem->cache.size() < dem->max_blocks)
+    {
+        DEMBlock block;
+        block.data = (float*)malloc(sizeof(float)*(long)dem->block_width*(long)dem->block_height);
+        dem->cache.push_back(block);
+        oldest = dem->cache.size() - 1;
+    }
+    
+    DEMBlock &block = dem->cache[oldest];
+    block.key       = key;
+    block.last_use  = dem->use_count;
+    //a failed read is returned as Nodata once but not kept, so the next access retries it
+    if (!ReadDEMBlock(dem, key, block.data))
+    {
+        block.key = -1;
+        dem->last_block = -1;
+        return block.data;
+    }
+    
+    dem->last_block = oldest;
+    return block.data;
+}
+
+float GetDEMAccessorValue(DEMAccessor *dem, const long col, const long row)
+{
+    if (col < 0 || col >= dem->size.width || row < 0 || row >= dem->size.height)
+        return Nodata;
+    
+    const long key = (row/dem->block_height)*dem->blocks_x + col/dem->block_width;
+    const float *data = GetDEMBlock(dem, key);
+    
+    return data[(row % dem->block_height)*(long)dem->block_width + col % dem->block_width];
+}
+
+//same weighting and nodata fallback as BilinearResampling, cell (col,row) at (minX + col*grid, maxY - row*grid)
+float GetDEMAccessorBilinear(DEMAccessor *dem, const double X, const double Y)
+{
+    const double t_col = (X - dem->minX)/dem->grid_size;
+    const double t_row = (dem->maxY - Y)/dem->grid_size;
+    
+    const long t_col_int = (long)(t_col + 0.01);
+    const long t_row_int = (long)(t_row + 0.01);
+    
+    if (t_col < 0 || t_row < 0 || t_col_int + 1 >= dem->size.width || t_row_int + 1 >= dem->size.height)
+        return Nodata;
+    
+    const double dcol = t_col - t_col_int;
+    const double drow = t_row - t_row_int;
+    
+    const float value1 = GetDEMAccessorValue(dem, t_col_int    , t_row_int    );
+    const float value2 = GetDEMAccessorValue(dem, t_col_int + 1, t_row_int    );
+    const float value3 = GetDEMAccessorValue(dem, t_col_int    , t_row_int + 1);
+    const float value4 = GetDEMAccessorValue(dem, t_col_int + 1, t_row_int + 1);
+    
+    if (value1 > Nodata && value2 > Nodata && value3 > Nodata && value4 > Nodata)
+        return value1*(1-dcol)*(1-drow) + value2*dcol*(1-drow) + value3*(1-dcol)*drow + value4*dcol*drow;
+    else if (value1 > Nodata)
+        return value1;
+    else if (value2 > Nodata)
+        return value2;
+    else if (value3 > Nodata)
+        return value3;
+    else if (value4 > Nodata)
+        return value4;
+    
+    return Nodata;
+}
+
+//cells covering boundary plus one cell on each side, copied block by block.
+//cols and rows are set like Readtiff_T: start inclusive, end exclusive. NULL when the boundary misses the DEM
+float *GetDEMAccessorWindow(DEMAccessor *dem, const double *boundary, long *cols, long *rows, CSize *data_size)
+{
+    cols[0] = (long)floor((boundary[0] - dem->minX)/dem->grid_size) - 1;
+    cols[1] = (long)floor((boundary[2] - dem->minX)/dem->grid_size) + 2;
+    rows[0] = (long)floor((dem->maxY - boundary[3])/dem->grid_size) - 1;
+    rows[1] = (long)floor((dem->maxY - boundary[1])/dem->grid_size) + 2;
+    
+    if (cols[0] < 0)
+        cols[0] = 0;
+    if (rows[0] < 0)
+        rows[0] = 0;
+    if (cols[1] > dem->size.width)
+        cols[1] = dem->size.width;
+    if (rows[1] > dem->size.height)
+        rows[1] = dem->size.height;
+    
+    if (cols[0] >= cols[1] || rows[0] >= rows[1])
+        return NULL;
+    
+    data_size->width  = cols[1] - cols[0];
+    data_size->height = rows[1] - rows[0];
+    
+    float *out = (float*)malloc(sizeof(float)*(long)data_size->width*(long)data_size->height);
+    
+    const long block_row_start  = rows[0]/dem->block_height;
+    const long block_row_end    = (rows[1] - 1)/dem->block_height;
+    const long block_col_start  = cols[0]/dem->block_width;
+    const long block_col_end    = (cols[1] - 1)/dem->block_width;
+    
+    for (long block_row = block_row_start; block_row <= block_row_end; block_row++)
+    {
+        for (long block_col = block_col_start; block_col <= block_col_end; block_col++)
+        {
+            const float *data = GetDEMBlock(dem, block_row*dem->blocks_x + block_col);
+            
+            const long col_s = max(cols[0], block_col*(long)dem->block_width);
+            const long col_e = min(cols[1], (block_col + 1)*(long)dem->block_width);
+            const long row_s = max(rows[0], block_row*(long)dem->block_height);
+            const long row_e = min(rows[1], (block_row + 1)*(long)dem->block_height);
+            
+            for (long row = row_s; row < row_e; row++)
+                memcpy(out + (row - rows[0])*(long)data_size->width + (col_s - cols[0]),
+                       data + (row - block_row*dem->block_height)*(long)dem->block_width + (col_s - block_col*dem->block_width),
+                       sizeof(float)*(col_e - col_s));
+        }
+    }
+    
+    return out;
+}
+
+//height range of valid cells (> -1000), one block at a time
+void GetDEMAccessorMinMax(DEMAccessor *dem, double *minmaxHeight)
+{
+    const long blocks_y = (dem->size.height + dem->block_height - 1)/dem->block_height;
+    
+    for (long block_row = 0; block_row < blocks_y; block_row++)
+    {
+        for (long block_col = 0; block_col < dem->blocks_x; block_col++)
+        {
+            const float *data = GetDEMBlock(dem, block_row*dem->blocks_x + block_col);
+            
+            const long col_e = min((long)dem->size.width, (block_col + 1)*(long)dem->block_width) - block_col*(long)dem->block_width;
+            const long row_e = min((long)dem->size.height, (block_row + 1)*(long)dem->block_height) - block_row*(long)dem->block_height;
+            
+            for (long row = 0; row < row_e; row++)
+            {
+                for (long col = 0; col < col_e; col++)
+                {
+                    const float value = data[row*(long)dem->block_width + col];
+                    if (value > -1000)
+                    {
+                        if (minmaxHeight[0] > value)
+                            minmaxHeight[0] = value;
+                        if (minmaxHeight[1] < value)
+                            minmaxHeight[1] = value;
+                    }
+                }
+            }
+        }
+    }
+}
@@ -1,15 +1,66 @@
 #ifndef _SETSMGEO_H_
 #define _SETSMGEO_H_
 
+#include <stdio.h>
 #include "geotiffio.h"
 #include "xtiffio.h"
 #include "Typedefine.hpp"
 
-void SetUpTIFFDirectory(TIFF *tif, size_t width, size_t height, double scale, double minX, double maxY, int data_type);
+void SetUpTIFFDirectory(TIFF *tif, size_t width, size_t height, double scale, double minX, double maxY, int data_type, uint32 tile_size = 0);
 void SetUpGeoKeys(GTIF *gtif, int projection, int zone, int NS_hemisphere);
 int WriteGeotiff(char *filename, void *buffer, size_t width, size_t height, double scale, double minX, double maxY, int projection, int zone, int NS_hemisphere, int data_type);
 uint8 ReadGeotiff_bits(char *filename);
 CSize ReadGeotiff_info(const char *filename, double *minX, double *maxY, double *grid_size);
 CSize ReadGeotiff_info_dxy(char *filename, double *minX, double *maxY, double *grid_size_dx, double *grid_size_dy);
 
+//float or uint16 GeoTIFF written as LZW-compressed GEOTIFF_TILE_SIZE tiles, one band of tile rows at a time from the top.
+//every band but the last is a multiple of GEOTIFF_TILE_SIZE rows, so only one band is ever held in memory
+#define GEOTIFF_TILE_SIZE 256
+
+typedef struct tagGeotiffTileWriter {
+    TIFF *tif;
+    GTIF *gtif;
+    size_t width, height;
+    size_t rows_written;
+    int data_type;
+} GeotiffTileWriter;
+
+bool OpenGeotiffTileWriter(const char *filename, GeotiffTileWriter *writer, size_t width, size_t height, double scale, double minX, double maxY, int projection, int zone, int NS_hemisphere, int data_type);
+bool WriteGeotiffTileBand(GeotiffTileWriter *writer, const float *band, size_t rows);
+bool WriteGeotiffTileBand(GeotiffTileWriter *writer, const uint16 *band, size_t rows);
+void CloseGeotiffTileWriter(GeotiffTileWriter *writer);
+
+//float DEM opened without reading the raster. Tiled GeoTIFFs are read per TIFF tile, strip GeoTIFFs per strip
+//and raw files per band of rows; the last max_blocks blocks stay in a least recently used cache.
+//one accessor is not thread safe, parallel loops read a window first
+typedef struct tagDEMBlock {
+    long key;
+    unsigned long last_use;
+    float *data;
+} DEMBlock;
+
+typedef struct tagDEMAccessor {
+    TIFF *tif;
+    FILE *raw;
+    CSize size;
+    double minX, maxY, grid_size;
+    bool tiled;
+    uint32 block_width, block_height;
+    long blocks_x;
+    int max_blocks;
+    unsigned long use_count;
+    int last_block;
+    vector<DEMBlock> cache;
+} DEMAccessor;
+
+#define DEM_RAW_BLOCK_ROWS 256
+
+bool OpenDEMAccessor(const char *filename, DEMAccessor *dem, const int max_blocks);
+bool OpenDEMAccessor_raw(const char *filename, const CSize size, const double minX, const double maxY, const double grid_size, DEMAccessor *dem, const int max_blocks);
+void CloseDEMAccessor(DEMAccessor *dem);
+float GetDEMAccessorValue(DEMAccessor *dem, const long col, const long row);
+float GetDEMAccessorBilinear(DEMAccessor *dem, const double X, const double Y);
+float *GetDEMAccessorWindow(DEMAccessor *dem, const double *boundary, long *cols, long *rows, CSize *data_size);
+void GetDEMAccessorMinMax(DEMAccessor *dem, double *minmaxHeight);
+
 #endif